@@ -523,6 +523,13 @@ struct gtktsm_renderer {
 	uint8_t *data;
 	cairo_surface_t *surface;
 	tsm_age_t age;
+
+	/* pending background fill, see renderer_fill_run() */
+	unsigned int run_x;
+	unsigned int run_y;
+	unsigned int run_width;
+	unsigned int run_height;
+	uint8_t run_r, run_g, run_b;
 };
 
 struct gtktsm_renderer_ctx {
@@ -581,6 +588,7 @@ static int renderer_realloc(struct gtktsm_renderer *rend,
 	rend->data = data;
 	rend->surface = surface;
 	rend->age = 0;
+	rend->run_width = 0;
 
 	return 0;
 }
@@ -670,6 +678,49 @@ static void renderer_fill(struct gtktsm_renderer *rend,
 	}
 }
 
+static void renderer_flush_run(struct gtktsm_renderer *rend)
+{
+	if (!rend->run_width)
+		return;
+
+	renderer_fill(rend,
+		      rend->run_x,
+		      rend->run_y,
+		      rend->run_width,
+		      rend->run_height,
+		      rend->run_r, rend->run_g, rend->run_b);
+	rend->run_width = 0;
+}
+
+/* Like renderer_fill() but the fill is delayed, so it can be merged with the
+ * following ones if they continue it on the same row with the same color.
+ * renderer_flush_run() must be called before anything is drawn over it. */
+static void renderer_fill_run(struct gtktsm_renderer *rend,
+			      unsigned int x,
+			      unsigned int y,
+			      unsigned int width,
+			      unsigned int height,
+			      uint8_t br, uint8_t bg, uint8_t bb)
+{
+	if (rend->run_width &&
+	    rend->run_x + rend->run_width == x &&
+	    rend->run_y == y &&
+	    rend->run_height == height &&
+	    rend->run_r == br && rend->run_g == bg && rend->run_b == bb) {
+		rend->run_width += width;
+		return;
+	}
+
+	renderer_flush_run(rend);
+	rend->run_x = x;
+	rend->run_y = y;
+	rend->run_width = width;
+	rend->run_height = height;
+	rend->run_r = br;
+	rend->run_g = bg;
+	rend->run_b = bb;
+}
+
 /* used for debugging; draws a border on the given rectangle */
 static void renderer_highlight(struct gtktsm_renderer *rend,
 			       unsigned int x,
@@ -936,6 +987,35 @@ static void renderer_blend(struct gtktsm_renderer *rend,
 	}
 }
 
+/* Move the pixel rows of a scrolled region like the screen moved its lines,
+ * clipped to the buffer. The uncovered rows are damaged and get redrawn. */
+static void renderer_scroll(struct gtktsm_renderer *rend,
+			    unsigned int cell_height,
+			    const struct tsm_screen_damage *damage)
+{
+	unsigned int top, bottom, n, num;
+	uint8_t *src, *dst;
+
+	n = abs(damage->scroll) * cell_height;
+	top = damage->scroll_top * cell_height;
+	bottom = (damage->scroll_bottom + 1) * cell_height;
+	if (bottom > rend->height)
+		bottom = rend->height;
+	if (top + n >= bottom)
+		return;
+	num = bottom - top - n;
+
+	if (damage->scroll > 0) {
+		dst = &rend->data[top * rend->stride];
+		src = &rend->data[(top + n) * rend->stride];
+	} else {
+		src = &rend->data[top * rend->stride];
+		dst = &rend->data[(top + n) * rend->stride];
+	}
+
+	memmove(dst, src, num * rend->stride);
+}
+
 static int renderer_draw_cell(struct tsm_screen *screen,
 			      uint32_t id,
 			      const uint32_t *ch,
@@ -991,12 +1071,12 @@ static int renderer_draw_cell(struct tsm_screen *screen,
 
 	/* !len means background-only */
 	if (!len) {
-		renderer_fill(rend,
-			      x,
-			      y,
-			      ctx->cell_width * cwidth,
-			      ctx->cell_height,
-			      br, bg, bb);
+		renderer_fill_run(rend,
+				  x,
+				  y,
+				  ctx->cell_width * cwidth,
+				  ctx->cell_height,
+				  br, bg, bb);
 	} else {
 		r = gtktsm_face_render(face,
 				       &glyph,
@@ -1005,12 +1085,12 @@ static int renderer_draw_cell(struct tsm_screen *screen,
 				       len,
 				       cwidth);
 		if (r < 0)
-			renderer_fill(rend,
-				      x,
-				      y,
-				      ctx->cell_width * cwidth,
-				      ctx->cell_height,
-				      br, bg, bb);
+			renderer_fill_run(rend,
+					  x,
+					  y,
+					  ctx->cell_width * cwidth,
+					  ctx->cell_height,
+					  br, bg, bb);
 		else
 			renderer_blend(rend,
 				       glyph,
@@ -1020,6 +1100,9 @@ static int renderer_draw_cell(struct tsm_screen *screen,
 				       br, bg, bb);
 	}
 
+	if (attr->underline || (!skip && ctx->debug))
+		renderer_flush_run(rend);
+
 	if (attr->underline)
 		renderer_fill(rend,
 			      x,
@@ -1041,18 +1124,33 @@ static int renderer_draw_cell(struct tsm_screen *screen,
 static void gtktsm_renderer_draw(const struct gtktsm_renderer_ctx *ctx)
 {
 	struct gtktsm_renderer *rend = ctx->rend;
+	struct tsm_screen_damage damage;
 	struct tsm_screen_attr attr;
 	unsigned int w, h;
 
 	/* cairo is *way* too slow to render all masks efficiently. Therefore,
 	 * we render all glyphs into a shadow buffer on the CPU and then tell
 	 * cairo to blit it into the gtk buffer. This way we get two mem-writes
-	 * but at least it's fast enough to render a whole screen. */
+	 * but at least it's fast enough to render a whole screen.
+	 * The shadow buffer survives between frames, so scrolled rows are just
+	 * moved and only damaged cells are pushed unless it was just
+	 * (re)allocated. The debug mode highlights the cells that changed, so
+	 * it still needs to see all of them. */
 
 	cairo_surface_flush(rend->surface);
-	rend->age = tsm_screen_draw(ctx->screen,
-				    renderer_draw_cell,
-				    (void*)ctx);
+	if (rend->age && !ctx->debug) {
+		tsm_screen_get_damage(ctx->screen, &damage);
+		if (!damage.full && damage.scroll)
+			renderer_scroll(rend, ctx->cell_height, &damage);
+		rend->age = tsm_screen_draw_damage(ctx->screen,
+						   true,
+						   renderer_draw_cell,
+						   (void*)ctx);
+	} else
+		rend->age = tsm_screen_draw(ctx->screen,
+					    renderer_draw_cell,
+					    (void*)ctx);
+	renderer_flush_run(rend);
 	cairo_surface_mark_dirty(rend->surface);
 
 	cairo_set_source_surface(ctx->cr, rend->surface, 0, 0);
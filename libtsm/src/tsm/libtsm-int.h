@@ -26,6 +26,7 @@
 #ifndef TSM_LIBTSM_INT_H
 #define TSM_LIBTSM_INT_H
 
+#include <errno.h>
 #include <inttypes.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -75,23 +76,42 @@ int tsm_utf8_mach_feed(struct tsm_utf8_mach *mach, char c);
 uint32_t tsm_utf8_mach_get(struct tsm_utf8_mach *mach);
 void tsm_utf8_mach_reset(struct tsm_utf8_mach *mach);
 
+size_t tsm_utf8_mach_decode(struct tsm_utf8_mach *mach, const char *u8,
+			    size_t len, uint32_t *out, size_t *num);
+size_t tsm_utf8_mach_decode_ref(struct tsm_utf8_mach *mach, const char *u8,
+				size_t len, uint32_t *out, size_t *num);
+bool tsm_utf8_set_simd(bool enable);
+
+/* C0, DEL and C1 control characters */
+static inline bool tsm_ucs4_is_control(uint32_t ucs4)
+{
+	return ucs4 < 0x20 || (ucs4 >= 0x7f && ucs4 < 0xa0);
+}
+
 /* TSM screen */
 
+/* Cells are aged with their line and only store the id of their attributes
+ * in the screen's attribute table, which keeps them at 8 bytes. */
 struct cell {
 	tsm_symbol_t ch;		/* stored character */
-	unsigned int width;		/* character width */
-	struct tsm_screen_attr attr;	/* cell attributes */
-	tsm_age_t age;			/* age of the single cell */
+	uint16_t attr;			/* id of the cell attributes */
+	uint8_t width;			/* character width */
 };
 
-struct line {
-	struct line *next;		/* next line (NULL if not sb) */
-	struct line *prev;		/* prev line (NULL if not sb) */
+struct sb_segment;
+struct sb_chunk;
+struct sb_archive;
 
-	unsigned int size;		/* real width */
-	struct cell *cells;		/* actuall cells */
+struct line {
+	unsigned int size;		/* real width; trimmed in scroll-back */
+	uint16_t fill;			/* attribute of the cells after size */
+	struct cell *cells;		/* actuall cells; NULL while compressed
+					 * or if size is 0 */
 	uint64_t sb_id;			/* sb ID */
 	tsm_age_t age;			/* age of the whole line */
+	struct sb_segment *seg;		/* compressed sb segment or NULL */
+	struct sb_chunk *chunk;		/* sb chunk holding cells or NULL */
+	bool wrapped;			/* continued in the next line */
 };
 
 #define SELECTION_TOP -1
@@ -101,6 +121,17 @@ struct selection_pos {
 	int y;
 };
 
+/* number of decompressed scroll-back segments that are kept around */
+#define SB_UNPACKED_MAX 8
+
+/* number of recent scroll-back lines new lines can share their cells with */
+#define SB_RECENT_NUM 64
+
+struct sb_recent {
+	uint32_t hash;			/* hash of the cells */
+	uint64_t sb_id;			/* sb ID of the line */
+};
+
 struct tsm_screen {
 	size_t ref;
 	llog_submit_t llog;
@@ -111,6 +142,20 @@ struct tsm_screen {
 
 	/* default attributes for new cells */
 	struct tsm_screen_attr def_attr;
+	uint16_t def_attr_id;
+
+	/* attribute table, see screen_attr_intern() */
+	struct tsm_screen_attr *attrs;	/* attributes by id */
+	unsigned int attr_num;		/* number of ids in use */
+	unsigned int attr_size;		/* allocated size of attrs */
+	uint16_t *attr_hash;		/* open-addressing table of ids */
+	unsigned int attr_hash_size;	/* size of attr_hash; power of 2 */
+	uint16_t attr_last;		/* id returned last */
+	unsigned int attr_gen;		/* bumped when ids are renumbered */
+	unsigned int attr_skip;		/* new ids refused before collecting */
+	uint16_t *attr_pins;		/* ids kept and renumbered by collects */
+	unsigned int attr_pin_num;	/* number of attr_pins */
+	uint16_t draw_attr;		/* id of the cell being drawn */
 
 	/* ageing */
 	tsm_age_t age_cnt;		/* current age counter */
@@ -127,13 +172,35 @@ struct tsm_screen {
 	struct line **alt_lines;	/* real alternative lines */
 	tsm_age_t age;			/* whole screen age */
 
-	/* scroll-back buffer */
+	/* damage since the last draw, in viewport rows */
+	struct tsm_screen_span *damage;	/* dirty columns of each row */
+	bool damage_full;		/* everything must be redrawn */
+	int damage_scroll;		/* pending scroll hint; >0 is up */
+	unsigned int damage_scroll_top;	/* first row of scrolled region */
+	unsigned int damage_scroll_bottom; /* last row of scrolled region */
+
+	/* scroll-back buffer: a ring holding the newest sb_count lines */
+	struct line **sb_lines;		/* ring of sb_size line slots */
+	unsigned int sb_size;		/* number of slots in sb_lines */
+	unsigned int sb_head;		/* slot of the oldest line */
 	unsigned int sb_count;		/* number of lines in sb */
-	struct line *sb_first;		/* first line; was moved first */
-	struct line *sb_last;		/* last line; was moved last*/
+	struct line **sb_old_lines;	/* ring of lines not reflowed yet */
+	unsigned int sb_old_size;	/* number of slots in sb_old_lines */
+	unsigned int sb_old_head;	/* slot of the oldest of them */
+	unsigned int sb_old_count;	/* number of them; older than the rest */
+	uint64_t sb_old_id;		/* sb ID of the oldest of them */
 	unsigned int sb_max;		/* max-limit of lines in sb */
 	struct line *sb_pos;		/* current position in sb or NULL */
 	uint64_t sb_last_id;		/* last id given to sb-line */
+	struct sb_chunk *sb_chunk;	/* chunk new sb cells are taken from */
+	struct sb_recent sb_recent[SB_RECENT_NUM]; /* by hash of the cells */
+	unsigned int sb_hot;		/* newest lines never compressed; 0=off */
+	unsigned int sb_cold;		/* oldest lines that are compressed */
+	struct sb_segment *sb_unpacked[SB_UNPACKED_MAX]; /* cached segments */
+	unsigned long sb_unpack_cnt;	/* LRU clock of sb_unpacked */
+	struct sb_archive *sb_arch;	/* file of dropped sb lines or NULL */
+	struct line sb_arch_line;	/* sb_pos while sb_arch is shown */
+	unsigned int sb_arch_top;	/* archived line at the top of screen */
 
 	/* cursor: positions are always in-bound, but cursor_x might be
 	 * bigger than size_x if new-line is pending */
@@ -149,7 +216,132 @@ struct tsm_screen {
 	struct selection_pos sel_end;
 };
 
+uint16_t screen_attr_intern(struct tsm_screen *con,
+			    const struct tsm_screen_attr *attr);
+
+static inline const struct tsm_screen_attr *screen_attr(struct tsm_screen *con,
+							 uint16_t id)
+{
+	return &con->attrs[id];
+}
+
+/*
+ * The lines in the scroll-back buffer are numbered from 0 (oldest) to
+ * sb_count - 1 (newest). While the buffer is reflowed, the first sb_old_count
+ * of them are kept in sb_old_lines and the others in sb_lines. The sb_id values
+ * of each part are consecutive and all those of sb_lines are bigger, so the
+ * number of a line follows from its sb_id.
+ */
+static inline struct line *screen_sb_line(struct tsm_screen *con,
+					  unsigned int i)
+{
+	if (i < con->sb_old_count) {
+		i += con->sb_old_head;
+		if (i >= con->sb_old_size)
+			i -= con->sb_old_size;
+
+		return con->sb_old_lines[i];
+	}
+
+	i += con->sb_head;
+	i -= con->sb_old_count;
+	if (i >= con->sb_size)
+		i -= con->sb_size;
+
+	return con->sb_lines[i];
+}
+
+static inline unsigned int screen_sb_index(struct tsm_screen *con,
+					   const struct line *line)
+{
+	uint64_t first = con->sb_last_id + 1 - con->sb_count +
+			 con->sb_old_count;
+
+	if (line->sb_id < first)
+		return line->sb_id - con->sb_old_id;
+
+	return con->sb_old_count + (line->sb_id - first);
+}
+
+/* return the line after @line in the scroll-back buffer, or NULL */
+static inline struct line *screen_sb_next(struct tsm_screen *con,
+					  const struct line *line)
+{
+	unsigned int i = screen_sb_index(con, line) + 1;
+
+	return i < con->sb_count ? screen_sb_line(con, i) : NULL;
+}
+
+/* return the line before @line in the scroll-back buffer, or NULL */
+static inline struct line *screen_sb_prev(struct tsm_screen *con,
+					  const struct line *line)
+{
+	unsigned int i = screen_sb_index(con, line);
+
+	return i ? screen_sb_line(con, i - 1) : NULL;
+}
+
+/* 7 bits per byte, the high bit is set if more bytes follow */
+#define VARINT_MAX_BYTES 5
+
+static inline uint8_t *put_varint(uint8_t *p, uint32_t v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+
+	return p;
+}
+
+static inline int get_varint(const uint8_t **p, const uint8_t *end,
+			     uint32_t *out)
+{
+	uint32_t v = 0;
+	unsigned int shift;
+	uint8_t b;
+
+	for (shift = 0; shift < VARINT_MAX_BYTES * 7; shift += 7) {
+		if (*p >= end)
+			return -EINVAL;
+		b = *(*p)++;
+		v |= (uint32_t)(b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			*out = v;
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
+void screen_line_free_cells(struct tsm_screen *con, struct line *line);
+bool screen_sb_compress(struct tsm_screen *con);
+int screen_sb_unpack(struct tsm_screen *con, struct sb_segment *seg);
+void screen_sb_release(struct tsm_screen *con, struct line *line);
+
+/* make the cells of @line available; scroll-back lines might be compressed */
+static inline int screen_line_load(struct tsm_screen *con, struct line *line)
+{
+	if (line->cells || !line->size)
+		return 0;
+
+	return screen_sb_unpack(con, line->seg);
+}
+
+int screen_sb_archive_new(struct tsm_screen *con);
+void screen_sb_archive_free(struct tsm_screen *con);
+void screen_sb_archive_clear(struct tsm_screen *con);
+unsigned int screen_sb_archive_count(struct tsm_screen *con);
+int screen_sb_archive_push(struct tsm_screen *con, struct line *line);
+int screen_sb_archive_load(struct tsm_screen *con, unsigned int num);
+
 void screen_cell_init(struct tsm_screen *con, struct cell *cell);
+void screen_damage(struct tsm_screen *con, unsigned int x_from,
+		   unsigned int x_to, unsigned int y);
+void screen_damage_all(struct tsm_screen *con);
+void screen_damage_reset(struct tsm_screen *con);
 
 void tsm_screen_set_opts(struct tsm_screen *scr, unsigned int opts);
 void tsm_screen_reset_opts(struct tsm_screen *scr, unsigned int opts);
@@ -159,6 +351,7 @@ static inline void screen_inc_age(struct tsm_screen *con)
 {
 	if (!++con->age_cnt) {
 		con->age_reset = 1;
+		con->damage_full = true;
 		++con->age_cnt;
 	}
 }
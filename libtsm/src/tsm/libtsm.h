@@ -151,6 +151,7 @@ typedef uint_fast32_t tsm_age_t;
 #define TSM_SCREEN_HIDE_CURSOR	0x10
 #define TSM_SCREEN_FIXED_POS	0x20
 #define TSM_SCREEN_ALTERNATE	0x40
+#define TSM_SCREEN_SYNC_UPDATE	0x80
 
 struct tsm_screen_attr {
 	int8_t fccode;			/* foreground color code or <0 for rgb */
@@ -179,6 +180,21 @@ typedef int (*tsm_screen_draw_cb) (struct tsm_screen *con,
 				   tsm_age_t age,
 				   void *data);
 
+/* dirty columns of one row; the row is clean if start > end */
+struct tsm_screen_span {
+	unsigned int start;		/* first dirty column */
+	unsigned int end;		/* last dirty column */
+};
+
+struct tsm_screen_damage {
+	bool full;			/* whole screen must be redrawn */
+	int scroll;			/* rows moved up (>0) or down (<0) */
+	unsigned int scroll_top;	/* first row of the scrolled region */
+	unsigned int scroll_bottom;	/* last row of the scrolled region */
+	unsigned int rows;		/* number of entries in @spans */
+	const struct tsm_screen_span *spans;	/* dirty columns per row */
+};
+
 int tsm_screen_new(struct tsm_screen **out, tsm_log_t log, void *log_data);
 void tsm_screen_ref(struct tsm_screen *con);
 void tsm_screen_unref(struct tsm_screen *con);
@@ -187,9 +203,12 @@ unsigned int tsm_screen_get_width(struct tsm_screen *con);
 unsigned int tsm_screen_get_height(struct tsm_screen *con);
 int tsm_screen_resize(struct tsm_screen *con, unsigned int x,
 		      unsigned int y);
+unsigned int tsm_screen_sb_reflow(struct tsm_screen *con, unsigned int num);
 int tsm_screen_set_margins(struct tsm_screen *con,
 			   unsigned int top, unsigned int bottom);
 void tsm_screen_set_max_sb(struct tsm_screen *con, unsigned int max);
+void tsm_screen_set_sb_compress(struct tsm_screen *con, unsigned int hot);
+int tsm_screen_set_sb_archive(struct tsm_screen *con, bool enable);
 void tsm_screen_clear_sb(struct tsm_screen *con);
 
 void tsm_screen_sb_up(struct tsm_screen *con, unsigned int num);
@@ -197,6 +216,8 @@ void tsm_screen_sb_down(struct tsm_screen *con, unsigned int num);
 void tsm_screen_sb_page_up(struct tsm_screen *con, unsigned int num);
 void tsm_screen_sb_page_down(struct tsm_screen *con, unsigned int num);
 void tsm_screen_sb_reset(struct tsm_screen *con);
+unsigned int tsm_screen_sb_get_pos(struct tsm_screen *con);
+void tsm_screen_sb_set_pos(struct tsm_screen *con, unsigned int pos);
 
 void tsm_screen_set_def_attr(struct tsm_screen *con,
 			     const struct tsm_screen_attr *attr);
@@ -204,6 +225,8 @@ void tsm_screen_reset(struct tsm_screen *con);
 void tsm_screen_set_flags(struct tsm_screen *con, unsigned int flags);
 void tsm_screen_reset_flags(struct tsm_screen *con, unsigned int flags);
 unsigned int tsm_screen_get_flags(struct tsm_screen *con);
+unsigned int tsm_screen_get_attr_generation(struct tsm_screen *con);
+unsigned int tsm_screen_get_draw_attr_id(struct tsm_screen *con);
 
 unsigned int tsm_screen_get_cursor_x(struct tsm_screen *con);
 unsigned int tsm_screen_get_cursor_y(struct tsm_screen *con);
@@ -214,6 +237,8 @@ void tsm_screen_reset_all_tabstops(struct tsm_screen *con);
 
 void tsm_screen_write(struct tsm_screen *con, tsm_symbol_t ch,
 		      const struct tsm_screen_attr *attr);
+void tsm_screen_write_run(struct tsm_screen *con, const tsm_symbol_t *syms,
+			  size_t num, const struct tsm_screen_attr *attr);
 void tsm_screen_newline(struct tsm_screen *con);
 void tsm_screen_scroll_up(struct tsm_screen *con, unsigned int num);
 void tsm_screen_scroll_down(struct tsm_screen *con, unsigned int num);
@@ -258,6 +283,10 @@ int tsm_screen_selection_copy(struct tsm_screen *con, char **out);
 
 tsm_age_t tsm_screen_draw(struct tsm_screen *con, tsm_screen_draw_cb draw_cb,
 			  void *data);
+int tsm_screen_get_damage(struct tsm_screen *con,
+			  struct tsm_screen_damage *out);
+tsm_age_t tsm_screen_draw_damage(struct tsm_screen *con, bool scrolled,
+				 tsm_screen_draw_cb draw_cb, void *data);
 
 /** @} */
 
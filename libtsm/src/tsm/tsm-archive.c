@@ -0,0 +1,404 @@
+/*
+ * libtsm - Scroll-back Archive
+ *
+ * Copyright (c) 2011-2013 David Herrmann <dh.herrmann@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Scroll-back Archive
+ * If enabled via tsm_screen_set_sb_archive(), lines that are dropped from the
+ * scroll-back buffer are appended to a file instead of being lost. The file
+ * is created in $XDG_RUNTIME_DIR and unlinked right away, so it goes away
+ * with the screen, even if the process dies.
+ *
+ * Each line is stored as its size, the attributes of its trailing blank cells,
+ * runs of (length, attributes), all attributes by value, runs of (length,
+ * width) and one varint per symbol. A second file holds the offset of each
+ * line, so any line is found in O(1).
+ *
+ * Both files are mapped and grow by doubling. On a disk-backed directory the
+ * kernel can write their pages back and drop them, so memory use does not grow
+ * with the history. $XDG_RUNTIME_DIR is normally a tmpfs though, where the
+ * files stay in memory (or swap) and only the compact encoding saves space.
+ *
+ * Archived lines have no "struct line". While they are shown, sb_pos points
+ * to sb_arch_line and sb_arch_top is the number of the archived line at the
+ * top of the screen. Each archived line is decoded into sb_arch_line when it
+ * is drawn. They cannot be selected.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "libtsm.h"
+#include "libtsm-int.h"
+#include "shl-llog.h"
+
+#define LLOG_SUBSYSTEM "tsm-archive"
+
+#define ARCHIVE_DATA_SIZE (1024 * 1024)
+#define ARCHIVE_INDEX_SIZE (64 * 1024)
+#define ARCHIVE_MAX_LINES (UINT_MAX / 2)
+
+/* bytes of an attribute and worst-case bytes of a line */
+#define ARCHIVE_ATTR_BYTES 9
+#define ARCHIVE_CELL_MAX_BYTES (3 * VARINT_MAX_BYTES + ARCHIVE_ATTR_BYTES + 1)
+
+struct sb_archive {
+	int data_fd;			/* file of the lines */
+	uint8_t *data;			/* mapping of data_fd */
+	size_t data_size;		/* bytes in use */
+	size_t data_cap;		/* size of the file and the mapping */
+
+	int index_fd;			/* file of the line offsets */
+	uint64_t *index;		/* mapping of index_fd */
+	unsigned int index_cap;		/* entries in the file and mapping */
+
+	unsigned int count;		/* number of archived lines */
+	unsigned int cells_cap;		/* allocated cells of sb_arch_line */
+};
+
+static int archive_open(struct tsm_screen *con, const char *dir)
+{
+	char path[PATH_MAX];
+	int fd, r;
+
+	r = snprintf(path, sizeof(path), "%s/libtsm-sb-XXXXXX", dir);
+	if (r < 0 || r >= (int)sizeof(path))
+		return -ENAMETOOLONG;
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		r = -errno;
+		llog_warning(con, "cannot create scroll-back file in %s (%d)",
+			     dir, r);
+		return r;
+	}
+
+	unlink(path);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	return fd;
+}
+
+/* Grow the file @fd from @old to @size bytes and map it again. The new range
+ * is allocated first: a hole in a shared mapping raises SIGBUS when it is
+ * written to on a full file system, which $XDG_RUNTIME_DIR easily is. */
+static int archive_map(int fd, void **map, size_t old, size_t size)
+{
+	void *p;
+	int r;
+
+	r = posix_fallocate(fd, old, size - old);
+	if (r)
+		return -r;
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		return -errno;
+
+	if (*map)
+		munmap(*map, old);
+	*map = p;
+
+	return 0;
+}
+
+int screen_sb_archive_new(struct tsm_screen *con)
+{
+	struct sb_archive *arch;
+	const char *dir;
+	int r;
+
+	if (con->sb_arch)
+		return 0;
+
+	dir = getenv("XDG_RUNTIME_DIR");
+	if (!dir || !*dir) {
+		llog_warning(con, "no XDG_RUNTIME_DIR for the scroll-back file");
+		return -ENOENT;
+	}
+
+	arch = malloc(sizeof(*arch));
+	if (!arch)
+		return -ENOMEM;
+	memset(arch, 0, sizeof(*arch));
+
+	arch->data_fd = archive_open(con, dir);
+	if (arch->data_fd < 0) {
+		r = arch->data_fd;
+		goto err_free;
+	}
+
+	arch->index_fd = archive_open(con, dir);
+	if (arch->index_fd < 0) {
+		r = arch->index_fd;
+		goto err_data;
+	}
+
+	r = archive_map(arch->data_fd, (void**)&arch->data, 0,
+			ARCHIVE_DATA_SIZE);
+	if (r)
+		goto err_index;
+	arch->data_cap = ARCHIVE_DATA_SIZE;
+
+	r = archive_map(arch->index_fd, (void**)&arch->index, 0,
+			ARCHIVE_INDEX_SIZE * sizeof(*arch->index));
+	if (r)
+		goto err_unmap;
+	arch->index_cap = ARCHIVE_INDEX_SIZE;
+
+	con->sb_arch = arch;
+	return 0;
+
+err_unmap:
+	munmap(arch->data, arch->data_cap);
+err_index:
+	close(arch->index_fd);
+err_data:
+	close(arch->data_fd);
+err_free:
+	free(arch);
+	return r;
+}
+
+void screen_sb_archive_free(struct tsm_screen *con)
+{
+	struct sb_archive *arch = con->sb_arch;
+
+	if (!arch)
+		return;
+
+	munmap(arch->index, arch->index_cap * sizeof(*arch->index));
+	munmap(arch->data, arch->data_cap);
+	close(arch->index_fd);
+	close(arch->data_fd);
+	free(arch);
+
+	free(con->sb_arch_line.cells);
+	con->sb_arch_line.cells = NULL;
+	con->sb_arch_line.size = 0;
+	con->sb_arch = NULL;
+}
+
+/* drop all archived lines; the files keep their size for reuse */
+void screen_sb_archive_clear(struct tsm_screen *con)
+{
+	if (!con->sb_arch)
+		return;
+
+	con->sb_arch->count = 0;
+	con->sb_arch->data_size = 0;
+}
+
+unsigned int screen_sb_archive_count(struct tsm_screen *con)
+{
+	return con->sb_arch ? con->sb_arch->count : 0;
+}
+
+static uint8_t *put_attr(uint8_t *p, const struct tsm_screen_attr *attr)
+{
+	*p++ = attr->fccode;
+	*p++ = attr->bccode;
+	*p++ = attr->fr;
+	*p++ = attr->fg;
+	*p++ = attr->fb;
+	*p++ = attr->br;
+	*p++ = attr->bg;
+	*p++ = attr->bb;
+	*p++ = attr->bold | attr->underline << 1 | attr->inverse << 2 |
+	       attr->protect << 3 | attr->blink << 4;
+
+	return p;
+}
+
+static void get_attr(const uint8_t *p, struct tsm_screen_attr *attr)
+{
+	memset(attr, 0, sizeof(*attr));
+	attr->fccode = (int8_t)p[0];
+	attr->bccode = (int8_t)p[1];
+	attr->fr = p[2];
+	attr->fg = p[3];
+	attr->fb = p[4];
+	attr->br = p[5];
+	attr->bg = p[6];
+	attr->bb = p[7];
+	attr->bold = p[8] & 1;
+	attr->underline = (p[8] >> 1) & 1;
+	attr->inverse = (p[8] >> 2) & 1;
+	attr->protect = (p[8] >> 3) & 1;
+	attr->blink = (p[8] >> 4) & 1;
+}
+
+/* Append @line, whose cells must be loaded, to the archive. */
+int screen_sb_archive_push(struct tsm_screen *con, struct line *line)
+{
+	struct sb_archive *arch = con->sb_arch;
+	size_t need, size;
+	unsigned int i, j;
+	uint8_t *p;
+	int r;
+
+	if (arch->count >= ARCHIVE_MAX_LINES)
+		return -ENOSPC;
+
+	need = arch->data_size + VARINT_MAX_BYTES + ARCHIVE_ATTR_BYTES +
+	       (size_t)line->size * ARCHIVE_CELL_MAX_BYTES;
+	if (need > arch->data_cap) {
+		size = arch->data_cap;
+		while (size < need)
+			size *= 2;
+		r = archive_map(arch->data_fd, (void**)&arch->data,
+				arch->data_cap, size);
+		if (r)
+			return r;
+		arch->data_cap = size;
+	}
+
+	if (arch->count >= arch->index_cap) {
+		r = archive_map(arch->index_fd, (void**)&arch->index,
+				arch->index_cap * sizeof(*arch->index),
+				arch->index_cap * 2 * sizeof(*arch->index));
+		if (r)
+			return r;
+		arch->index_cap *= 2;
+	}
+
+	p = arch->data + arch->data_size;
+	p = put_varint(p, line->size);
+	p = put_attr(p, screen_attr(con, line->fill));
+
+	for (i = 0; i < line->size; i = j) {
+		for (j = i + 1; j < line->size &&
+		     line->cells[j].attr == line->cells[i].attr; ++j)
+			;
+		p = put_varint(p, j - i);
+		p = put_attr(p, screen_attr(con, line->cells[i].attr));
+	}
+
+	for (i = 0; i < line->size; i = j) {
+		for (j = i + 1; j < line->size &&
+		     line->cells[j].width == line->cells[i].width; ++j)
+			;
+		p = put_varint(p, j - i);
+		*p++ = line->cells[i].width;
+	}
+
+	for (i = 0; i < line->size; ++i)
+		p = put_varint(p, line->cells[i].ch);
+
+	arch->index[arch->count++] = arch->data_size;
+	arch->data_size = p - arch->data;
+
+	return 0;
+}
+
+static int archive_decode(struct tsm_screen *con, const uint8_t *p,
+			  const uint8_t *end)
+{
+	struct sb_archive *arch = con->sb_arch;
+	struct line *line = &con->sb_arch_line;
+	struct tsm_screen_attr attr;
+	struct cell *cells;
+	unsigned int i, j;
+	uint32_t size, len;
+	uint16_t id;
+
+	if (get_varint(&p, end, &size) || end - p < ARCHIVE_ATTR_BYTES)
+		return -EINVAL;
+	get_attr(p, &attr);
+	p += ARCHIVE_ATTR_BYTES;
+	line->fill = screen_attr_intern(con, &attr);
+
+	if (size > arch->cells_cap) {
+		cells = realloc(line->cells, sizeof(*cells) * size);
+		if (!cells)
+			return -ENOMEM;
+		line->cells = cells;
+		arch->cells_cap = size;
+	}
+
+	/* interning might renumber the ids of the cells decoded so far; the
+	 * table is collected with those of sb_arch_line, too */
+	line->size = 0;
+	for (i = 0; i < size; i += len) {
+		if (get_varint(&p, end, &len) || !len || len > size - i ||
+		    end - p < ARCHIVE_ATTR_BYTES)
+			return -EINVAL;
+		get_attr(p, &attr);
+		p += ARCHIVE_ATTR_BYTES;
+		id = screen_attr_intern(con, &attr);
+		for (j = 0; j < len; ++j)
+			line->cells[i + j].attr = id;
+		line->size = i + len;
+	}
+
+	for (i = 0; i < size; i += len) {
+		if (get_varint(&p, end, &len) || !len || len > size - i ||
+		    p >= end)
+			return -EINVAL;
+		for (j = 0; j < len; ++j)
+			line->cells[i + j].width = *p;
+		++p;
+	}
+
+	for (i = 0; i < size; ++i) {
+		if (get_varint(&p, end, &len))
+			return -EINVAL;
+		line->cells[i].ch = len;
+	}
+
+	return 0;
+}
+
+/* Decode the archived line @num into sb_arch_line. On failure the line is left
+ * empty. */
+int screen_sb_archive_load(struct tsm_screen *con, unsigned int num)
+{
+	struct sb_archive *arch = con->sb_arch;
+	const uint8_t *start, *end;
+	int r;
+
+	if (!arch || num >= arch->count) {
+		con->sb_arch_line.size = 0;
+		con->sb_arch_line.fill = con->def_attr_id;
+		return -EINVAL;
+	}
+
+	start = arch->data + arch->index[num];
+	end = arch->data + (num + 1 < arch->count ? arch->index[num + 1] :
+						     arch->data_size);
+
+	r = archive_decode(con, start, end);
+	if (r) {
+		con->sb_arch_line.size = 0;
+		con->sb_arch_line.fill = con->def_attr_id;
+	}
+	return r;
+}
@@ -0,0 +1,578 @@
+/*
+ * libtsm - Scroll-back Compression
+ *
+ * Copyright (c) 2011-2013 David Herrmann <dh.herrmann@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Scroll-back Compression
+ * If enabled via tsm_screen_set_sb_compress(), scroll-back lines that are
+ * followed by more than the given number of newer lines are packed into
+ * segments of SB_SEGMENT_LINES lines each. A segment stores the attributes of
+ * its cells by value (so renumbering the attribute table never touches it),
+ * as runs, followed by runs of cell widths and the symbols as varints. This
+ * stream is then compressed with a small LZ77 codec in the spirit of LZ4.
+ *
+ * The lines stay in the scroll-back ring but their cells are freed. When a
+ * compressed line is drawn or copied, screen_line_load() unpacks its whole
+ * segment and points the cells of all its lines into one block. The newest
+ * SB_UNPACKED_MAX unpacked segments are kept; older ones just drop their
+ * cells again as the compressed copy stays around until the last line of the
+ * segment leaves the scroll-back buffer.
+ * Reflowing the scroll-back buffer moves compressed lines and replaces others
+ * by uncompressed ones, so a segment remembers its lines by pointer and lines
+ * after sb_cold might be compressed already.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libtsm.h"
+#include "libtsm-int.h"
+#include "shl-llog.h"
+
+#define LLOG_SUBSYSTEM "tsm-compress"
+
+#define SB_SEGMENT_LINES 128
+
+/* lines looked at for a segment before a short one is packed */
+#define SB_SEGMENT_SCAN (2 * SB_SEGMENT_LINES)
+
+struct sb_segment {
+	struct line *lines[SB_SEGMENT_LINES]; /* packed lines or NULL once gone */
+	unsigned int line_num;		/* number of packed lines */
+	unsigned int refs;		/* packed lines still in the buffer */
+	unsigned int cell_num;		/* cells of all packed lines */
+	unsigned int raw_size;		/* size of the uncompressed stream */
+	unsigned int attr_num;		/* number of entries in attrs */
+	size_t size;			/* size of data */
+	struct tsm_screen_attr *attrs;	/* attributes of the runs */
+	uint8_t *data;			/* compressed stream */
+	struct cell *cells;		/* unpacked cells or NULL */
+	unsigned long used;		/* LRU clock when last unpacked */
+};
+
+/*
+ * LZ77 Codec
+ * The compressed stream is a sequence of tokens. The high nibble of a token is
+ * the number of literals that follow, the low nibble the length of the match
+ * after them minus LZ_MIN_MATCH. A nibble of 15 is continued by bytes that are
+ * added up until one is not 255. The match is given as 16-bit little-endian
+ * offset back into the output. The last token only carries literals.
+ */
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 0xffff
+
+static uint32_t lz_read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static unsigned int lz_hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* worst-case size of the compressed form of @size bytes */
+static size_t lz_bound(size_t size)
+{
+	return size + size / 255 + 16;
+}
+
+static uint8_t *lz_put_len(uint8_t *dst, size_t len)
+{
+	for (len -= 15; len >= 255; len -= 255)
+		*dst++ = 255;
+	*dst++ = len;
+
+	return dst;
+}
+
+static uint8_t *lz_put_seq(uint8_t *dst, const uint8_t *lit, size_t lit_len,
+			   size_t match_len)
+{
+	uint8_t *token = dst++;
+
+	*token = (lit_len < 15 ? lit_len : 15) << 4;
+	if (lit_len >= 15)
+		dst = lz_put_len(dst, lit_len);
+	memcpy(dst, lit, lit_len);
+	dst += lit_len;
+
+	if (match_len) {
+		match_len -= LZ_MIN_MATCH;
+		*token |= match_len < 15 ? match_len : 15;
+	}
+
+	return dst;
+}
+
+/* compress @size bytes of @src into @dst, which has room for lz_bound() */
+static size_t lz_compress(const uint8_t *src, size_t size, uint8_t *dst)
+{
+	uint32_t table[1 << LZ_HASH_BITS];
+	const uint8_t *ip = src, *anchor = src, *end = src + size, *limit, *ref;
+	uint8_t *op = dst;
+	size_t off, len;
+	unsigned int h;
+
+	memset(table, 0, sizeof(table));
+	limit = size > LZ_MIN_MATCH ? end - LZ_MIN_MATCH : src;
+
+	while (ip < limit) {
+		h = lz_hash(lz_read32(ip));
+		ref = src + table[h];
+		table[h] = ip - src;
+
+		off = ip - ref;
+		if (ref >= ip || off > LZ_MAX_OFFSET ||
+		    lz_read32(ref) != lz_read32(ip)) {
+			++ip;
+			continue;
+		}
+
+		len = LZ_MIN_MATCH;
+		while (ip + len < end && ref[len] == ip[len])
+			++len;
+
+		op = lz_put_seq(op, anchor, ip - anchor, len);
+		*op++ = off & 0xff;
+		*op++ = off >> 8;
+		if (len - LZ_MIN_MATCH >= 15)
+			op = lz_put_len(op, len - LZ_MIN_MATCH);
+
+		ip += len;
+		anchor = ip;
+	}
+
+	op = lz_put_seq(op, anchor, end - anchor, 0);
+	return op - dst;
+}
+
+static int lz_get_len(const uint8_t **ip, const uint8_t *end, size_t *len)
+{
+	uint8_t b;
+
+	do {
+		if (*ip >= end)
+			return -EINVAL;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+
+	return 0;
+}
+
+/* decompress @size bytes of @src into exactly @dst_size bytes of @dst */
+static int lz_decompress(const uint8_t *src, size_t size, uint8_t *dst,
+			 size_t dst_size)
+{
+	const uint8_t *ip = src, *end = src + size;
+	uint8_t *op = dst, *oend = dst + dst_size;
+	size_t len, off;
+	unsigned int token;
+
+	while (ip < end) {
+		token = *ip++;
+
+		len = token >> 4;
+		if (len == 15 && lz_get_len(&ip, end, &len))
+			return -EINVAL;
+		if (len > (size_t)(end - ip) || len > (size_t)(oend - op))
+			return -EINVAL;
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+
+		/* the last token has no match */
+		if (ip >= end)
+			break;
+
+		if (end - ip < 2)
+			return -EINVAL;
+		off = ip[0] | ip[1] << 8;
+		ip += 2;
+
+		len = token & 15;
+		if (len == 15 && lz_get_len(&ip, end, &len))
+			return -EINVAL;
+		len += LZ_MIN_MATCH;
+		if (!off || off > (size_t)(op - dst) ||
+		    len > (size_t)(oend - op))
+			return -EINVAL;
+
+		/* matches may overlap their own output */
+		for ( ; len; --len, ++op)
+			*op = op[-off];
+	}
+
+	return op == oend ? 0 : -EINVAL;
+}
+
+/*
+ * Line Stream
+ * Each line is stored as its size, runs of (length, attribute), runs of
+ * (length, width) and then one varint per symbol, all as varints.
+ */
+
+/* worst-case stream size */
+#define SB_CELL_MAX_BYTES (3 * VARINT_MAX_BYTES)
+#define SB_LINE_MAX_BYTES VARINT_MAX_BYTES
+
+static uint8_t *pack_line(const struct line *line, uint8_t *p,
+			  const uint16_t *map)
+{
+	unsigned int i, j;
+
+	p = put_varint(p, line->size);
+
+	for (i = 0; i < line->size; i = j) {
+		for (j = i + 1; j < line->size &&
+		     line->cells[j].attr == line->cells[i].attr; ++j)
+			;
+		p = put_varint(p, j - i);
+		p = put_varint(p, map[line->cells[i].attr]);
+	}
+
+	for (i = 0; i < line->size; i = j) {
+		for (j = i + 1; j < line->size &&
+		     line->cells[j].width == line->cells[i].width; ++j)
+			;
+		p = put_varint(p, j - i);
+		*p++ = line->cells[i].width;
+	}
+
+	for (i = 0; i < line->size; ++i)
+		p = put_varint(p, line->cells[i].ch);
+
+	return p;
+}
+
+static int unpack_line(const uint8_t **p, const uint8_t *end,
+		       struct cell *cells, unsigned int size,
+		       const uint16_t *ids, unsigned int id_num)
+{
+	unsigned int i, j;
+	uint32_t len, v;
+
+	for (i = 0; i < size; i += len) {
+		if (get_varint(p, end, &len) || get_varint(p, end, &v) ||
+		    !len || len > size - i || v >= id_num)
+			return -EINVAL;
+		for (j = 0; j < len; ++j)
+			cells[i + j].attr = ids[v];
+	}
+
+	for (i = 0; i < size; i += len) {
+		if (get_varint(p, end, &len) || *p >= end ||
+		    !len || len > size - i)
+			return -EINVAL;
+		v = *(*p)++;
+		for (j = 0; j < len; ++j)
+			cells[i + j].width = v;
+	}
+
+	for (i = 0; i < size; ++i) {
+		if (get_varint(p, end, &v))
+			return -EINVAL;
+		cells[i].ch = v;
+	}
+
+	return 0;
+}
+
+/*
+ * Segments
+ * A segment packs up to SB_SEGMENT_LINES lines that are mostly, but not always
+ * consecutive in the scroll-back buffer. A line is removed from its segment
+ * when it leaves the buffer.
+ */
+
+static void segment_uncache(struct tsm_screen *con, struct sb_segment *seg)
+{
+	unsigned int i;
+
+	for (i = 0; i < SB_UNPACKED_MAX; ++i) {
+		if (con->sb_unpacked[i] == seg)
+			con->sb_unpacked[i] = NULL;
+	}
+
+	free(seg->cells);
+	seg->cells = NULL;
+}
+
+/* drop the unpacked cells of @seg; the lines fall back to the packed copy */
+static void segment_drop_cells(struct tsm_screen *con, struct sb_segment *seg)
+{
+	struct line *line;
+	unsigned int i;
+
+	for (i = 0; i < seg->line_num; ++i) {
+		line = seg->lines[i];
+		if (line)
+			line->cells = NULL;
+	}
+
+	segment_uncache(con, seg);
+}
+
+/* remember @seg as unpacked, dropping the least recently used one if needed */
+static void segment_cache(struct tsm_screen *con, struct sb_segment *seg)
+{
+	unsigned int i, slot = 0;
+
+	for (i = 0; i < SB_UNPACKED_MAX; ++i) {
+		if (!con->sb_unpacked[i]) {
+			slot = i;
+			break;
+		}
+		if (con->sb_unpacked[i]->used <
+		    con->sb_unpacked[slot]->used)
+			slot = i;
+	}
+
+	if (con->sb_unpacked[slot])
+		segment_drop_cells(con, con->sb_unpacked[slot]);
+
+	seg->used = ++con->sb_unpack_cnt;
+	con->sb_unpacked[slot] = seg;
+}
+
+/* Pack the oldest uncompressed lines into a new segment if there are more than
+ * sb_hot newer lines. Compressed lines among them are skipped; if there are
+ * many, fewer lines are packed. Nothing changes if this fails; it is retried
+ * with the next line that is added to the buffer. Returns true if a segment
+ * was packed. */
+bool screen_sb_compress(struct tsm_screen *con)
+{
+	struct line *lines[SB_SEGMENT_LINES];
+	struct sb_segment *seg;
+	struct tsm_screen_attr *attrs;
+	struct line *line;
+	uint16_t *map;
+	uint8_t *raw, *p, *data;
+	unsigned int i, j, num, end, limit, cell_num, attr_num;
+	size_t raw_size, size;
+
+	if (!con->sb_hot || con->sb_count < con->sb_hot)
+		return false;
+
+	limit = con->sb_count - con->sb_hot;
+	while (con->sb_cold < limit && screen_sb_line(con, con->sb_cold)->seg)
+		++con->sb_cold;
+	if (con->sb_cold + SB_SEGMENT_LINES > limit)
+		return false;
+
+	num = 0;
+	cell_num = 0;
+	for (end = con->sb_cold; end < limit && num < SB_SEGMENT_LINES &&
+	     end - con->sb_cold < SB_SEGMENT_SCAN; ++end) {
+		line = screen_sb_line(con, end);
+		if (line->seg)
+			continue;
+		lines[num++] = line;
+		cell_num += line->size;
+	}
+	if (num < SB_SEGMENT_LINES && end == limit)
+		return false;
+
+	raw = malloc(cell_num * SB_CELL_MAX_BYTES +
+		     num * SB_LINE_MAX_BYTES);
+	map = malloc(sizeof(*map) * con->attr_num);
+	attrs = malloc(sizeof(*attrs) * con->attr_num);
+	if (!raw || !map || !attrs)
+		goto err_free;
+
+	/* number the attributes in use by this segment from 0 */
+	memset(map, 0xff, sizeof(*map) * con->attr_num);
+	attr_num = 0;
+	for (i = 0; i < num; ++i) {
+		line = lines[i];
+		for (j = 0; j < line->size; ++j) {
+			if (map[line->cells[j].attr] != 0xffff)
+				continue;
+			attrs[attr_num] = *screen_attr(con,
+						       line->cells[j].attr);
+			map[line->cells[j].attr] = attr_num++;
+		}
+	}
+
+	p = raw;
+	for (i = 0; i < num; ++i)
+		p = pack_line(lines[i], p, map);
+	raw_size = p - raw;
+
+	data = malloc(lz_bound(raw_size));
+	if (!data)
+		goto err_free;
+	size = lz_compress(raw, raw_size, data);
+
+	seg = malloc(sizeof(*seg) + sizeof(*attrs) * attr_num + size);
+	if (!seg) {
+		free(data);
+		goto err_free;
+	}
+
+	seg->attrs = (void*)(seg + 1);
+	seg->data = (uint8_t*)(seg->attrs + attr_num);
+	memcpy(seg->attrs, attrs, sizeof(*attrs) * attr_num);
+	memcpy(seg->data, data, size);
+	memcpy(seg->lines, lines, sizeof(*lines) * num);
+	seg->line_num = num;
+	seg->refs = num;
+	seg->cell_num = cell_num;
+	seg->raw_size = raw_size;
+	seg->attr_num = attr_num;
+	seg->size = size;
+	seg->cells = NULL;
+	seg->used = 0;
+	free(data);
+
+	for (i = 0; i < num; ++i) {
+		screen_line_free_cells(con, lines[i]);
+		lines[i]->seg = seg;
+	}
+	con->sb_cold = end;
+
+	free(attrs);
+	free(map);
+	free(raw);
+	return true;
+
+err_free:
+	free(attrs);
+	free(map);
+	free(raw);
+	return false;
+}
+
+/* Unpack all lines of @seg. This interns their attributes, which might
+ * renumber the table; the ids interned so far are pinned so they are kept and
+ * renumbered, too. */
+int screen_sb_unpack(struct tsm_screen *con, struct sb_segment *seg)
+{
+	struct cell *cells;
+	struct line *line;
+	uint16_t *ids;
+	uint8_t *raw;
+	const uint8_t *p;
+	unsigned int i, off, offs[SB_SEGMENT_LINES];
+	uint32_t size;
+	int r;
+
+	if (!seg)
+		return -EINVAL;
+	if (seg->cells)
+		return 0;
+
+	raw = malloc(seg->raw_size);
+	ids = malloc(sizeof(*ids) * (seg->attr_num ? seg->attr_num : 1));
+	cells = malloc(sizeof(*cells) * (seg->cell_num ? seg->cell_num : 1));
+	if (!raw || !ids || !cells) {
+		r = -ENOMEM;
+		goto err_free;
+	}
+
+	r = lz_decompress(seg->data, seg->size, raw, seg->raw_size);
+	if (r)
+		goto err_corrupt;
+
+	con->attr_pins = ids;
+	for (i = 0; i < seg->attr_num; ++i) {
+		con->attr_pin_num = i;
+		ids[i] = screen_attr_intern(con, &seg->attrs[i]);
+	}
+	con->attr_pins = NULL;
+	con->attr_pin_num = 0;
+
+	p = raw;
+	off = 0;
+	for (i = 0; i < seg->line_num; ++i) {
+		r = -EINVAL;
+		if (get_varint(&p, raw + seg->raw_size, &size) ||
+		    size > seg->cell_num - off)
+			goto err_corrupt;
+		r = unpack_line(&p, raw + seg->raw_size, &cells[off], size,
+				ids, seg->attr_num);
+		if (r)
+			goto err_corrupt;
+		offs[i] = off;
+		off += size;
+	}
+
+	segment_cache(con, seg);
+	seg->cells = cells;
+
+	for (i = 0; i < seg->line_num; ++i) {
+		line = seg->lines[i];
+		if (line)
+			line->cells = &cells[offs[i]];
+	}
+
+	free(ids);
+	free(raw);
+	return 0;
+
+err_corrupt:
+	llog_warning(con, "cannot unpack scroll-back segment (%d)", r);
+err_free:
+	free(cells);
+	free(ids);
+	free(raw);
+	return r;
+}
+
+/* Detach @line, which is about to leave the scroll-back buffer, from its
+ * segment. It is left without cells. */
+void screen_sb_release(struct tsm_screen *con, struct line *line)
+{
+	struct sb_segment *seg = line->seg;
+	unsigned int i;
+
+	if (!seg)
+		return;
+
+	/* lines mostly leave in the order they were packed */
+	i = seg->line_num - seg->refs;
+	if (seg->lines[i] != line) {
+		for (i = 0; seg->lines[i] != line; ++i)
+			;
+	}
+	seg->lines[i] = NULL;
+
+	line->seg = NULL;
+	line->cells = NULL;
+	line->size = 0;
+
+	if (--seg->refs)
+		return;
+
+	segment_uncache(con, seg);
+	free(seg);
+}
@@ -41,12 +41,18 @@
 
 #define LLOG_SUBSYSTEM "tsm-render"
 
-SHL_EXPORT
-tsm_age_t tsm_screen_draw(struct tsm_screen *con, tsm_screen_draw_cb draw_cb,
-			  void *data)
+/*
+ * Push cells into the rendering pipeline. If @spans is NULL, all cells are
+ * drawn, otherwise only the given columns of each row. The selection state is
+ * tracked across every cell, so rows are only skipped if no selection is
+ * active.
+ */
+static tsm_age_t screen_draw(struct tsm_screen *con,
+			     const struct tsm_screen_span *spans,
+			     tsm_screen_draw_cb draw_cb, void *data)
 {
 	unsigned int cur_x, cur_y;
-	unsigned int i, j, k;
+	unsigned int i, j, k, from, to, size, arch;
 	struct line *iter, *line = NULL;
 	struct cell *cell, empty;
 	struct tsm_screen_attr attr;
@@ -57,9 +63,6 @@ tsm_age_t tsm_screen_draw(struct tsm_screen *con, tsm_screen_draw_cb draw_cb,
 	bool was_sel = false;
 	tsm_age_t age;
 
-	if (!con || !draw_cb)
-		return 0;
-
 	screen_cell_init(con, &empty);
 
 	cur_x = con->cursor_x;
@@ -72,6 +75,7 @@ tsm_age_t tsm_screen_draw(struct tsm_screen *con, tsm_screen_draw_cb draw_cb,
 	/* push each character into rendering pipeline */
 
 	iter = con->sb_pos;
+	arch = con->sb_arch_top;
 	k = 0;
 
 	if (con->sel_active) {
@@ -89,14 +93,26 @@ tsm_age_t tsm_screen_draw(struct tsm_screen *con, tsm_screen_draw_cb draw_cb,
 	}
 
 	for (i = 0; i < con->size_y; ++i) {
-		if (iter) {
+		if (iter == &con->sb_arch_line) {
+			/* archived lines are decoded one at a time */
+			line = iter;
+			screen_sb_archive_load(con, arch);
+			if (++arch >= screen_sb_archive_count(con))
+				iter = con->sb_count ? screen_sb_line(con, 0) :
+						       NULL;
+		} else if (iter) {
 			line = iter;
-			iter = iter->next;
+			iter = screen_sb_next(con, iter);
 		} else {
 			line = con->lines[k];
 			k++;
 		}
 
+		/* cells past the end of a line are blank; so is a compressed
+		 * line that cannot be unpacked */
+		size = screen_line_load(con, line) ? 0 : line->size;
+		empty.attr = line->fill;
+
 		if (con->sel_active) {
 			if (con->sel_start.line == line ||
 			    (!con->sel_start.line &&
@@ -114,13 +130,28 @@ tsm_age_t tsm_screen_draw(struct tsm_screen *con, tsm_screen_draw_cb draw_cb,
 			was_sel = false;
 		}
 
-		for (j = 0; j < con->size_x; ++j) {
-			if (j < line->size)
+		from = 0;
+		to = con->size_x - 1;
+		if (spans) {
+			from = spans[i].start;
+			to = spans[i].end;
+			if (from > to && !con->sel_active)
+				continue;
+
+			/* start at the head of a wide character */
+			while (from > 0 && from <= to && from < size &&
+			       !line->cells[from].width)
+				--from;
+		}
+
+		j = con->sel_active ? 0 : from;
+		for ( ; j < con->size_x; ++j) {
+			if (j < size)
 				cell = &line->cells[j];
 			else
 				cell = &empty;
 
-			memcpy(&attr, &cell->attr, sizeof(attr));
+			memcpy(&attr, screen_attr(con, cell->attr), sizeof(attr));
 
 			if (con->sel_active) {
 				if (sel_start &&
@@ -151,12 +182,13 @@ tsm_age_t tsm_screen_draw(struct tsm_screen *con, tsm_screen_draw_cb draw_cb,
 				attr.inverse = !attr.inverse;
 			}
 
+			if (j < from || j > to)
+				continue;
+
 			if (con->age_reset) {
 				age = 0;
 			} else {
-				age = cell->age;
-				if (line->age > age)
-					age = line->age;
+				age = line->age;
 				if (con->age > age)
 					age = con->age;
 			}
@@ -164,6 +196,7 @@ tsm_age_t tsm_screen_draw(struct tsm_screen *con, tsm_screen_draw_cb draw_cb,
 			ch = tsm_symbol_get(con->sym_table, &cell->ch, &len);
 			if (cell->ch == ' ' || cell->ch == 0)
 				len = 0;
+			con->draw_attr = cell->attr;
 			ret = draw_cb(con, cell->ch, ch, len, cell->width,
 				      j, i, &attr, age, data);
 			if (ret && warned++ < 3) {
@@ -177,6 +210,8 @@ tsm_age_t tsm_screen_draw(struct tsm_screen *con, tsm_screen_draw_cb draw_cb,
 		}
 	}
 
+	screen_damage_reset(con);
+
 	if (con->age_reset) {
 		con->age_reset = 0;
 		return 0;
@@ -184,3 +219,63 @@ tsm_age_t tsm_screen_draw(struct tsm_screen *con, tsm_screen_draw_cb draw_cb,
 		return con->age_cnt;
 	}
 }
+
+SHL_EXPORT
+tsm_age_t tsm_screen_draw(struct tsm_screen *con, tsm_screen_draw_cb draw_cb,
+			  void *data)
+{
+	if (!con || !draw_cb)
+		return 0;
+
+	return screen_draw(con, NULL, draw_cb, data);
+}
+
+/*
+ * Return what changed since the last tsm_screen_draw() or
+ * tsm_screen_draw_damage(). If @full is set, nothing else is valid. Otherwise,
+ * if @scroll is non-zero, the rows @scroll_top to @scroll_bottom moved by
+ * @scroll rows and the spans describe what changed after that. The spans are
+ * owned by the screen and valid until it is modified the next time.
+ */
+SHL_EXPORT
+int tsm_screen_get_damage(struct tsm_screen *con,
+			  struct tsm_screen_damage *out)
+{
+	if (!con || !out)
+		return -EINVAL;
+
+	out->full = con->damage_full;
+	out->scroll = out->full ? 0 : con->damage_scroll;
+	out->scroll_top = con->damage_scroll_top;
+	out->scroll_bottom = con->damage_scroll_bottom;
+	out->rows = con->size_y;
+	out->spans = con->damage;
+
+	return 0;
+}
+
+/*
+ * Like tsm_screen_draw() but only pushes damaged cells. Pass @scrolled if the
+ * framebuffer was already moved according to the scroll hint of
+ * tsm_screen_get_damage(); otherwise the whole scrolled region is redrawn.
+ */
+SHL_EXPORT
+tsm_age_t tsm_screen_draw_damage(struct tsm_screen *con, bool scrolled,
+				 tsm_screen_draw_cb draw_cb, void *data)
+{
+	unsigned int i;
+
+	if (!con || !draw_cb)
+		return 0;
+
+	if (con->damage_full)
+		return screen_draw(con, NULL, draw_cb, data);
+
+	if (con->damage_scroll && !scrolled) {
+		for (i = con->damage_scroll_top;
+		     i <= con->damage_scroll_bottom; ++i)
+			screen_damage(con, 0, con->size_x - 1, i);
+	}
+
+	return screen_draw(con, con->damage, draw_cb, data);
+}
@@ -44,20 +44,33 @@
  * they need.
  *
  * AGEING:
- * Each cell, line and screen has an "age" field. This field describes when it
- * was changed the last time. After drawing a screen, the current screen age is
- * returned. This allows users to skip drawing specific cells, if their
- * framebuffer was already drawn with a newer age than a given cell.
+ * Each line and screen has an "age" field. This field describes when it was
+ * changed the last time. Cells are passed to the draw callback with the age of
+ * their line. After drawing a screen, the current screen age is returned. This
+ * allows users to skip drawing specific cells, if their framebuffer was already
+ * drawn with a newer age than a given cell.
  * However, the screen-age might overflow. This is properly detected and causes
  * drawing functions to return "0" as age. Users must reset all their
  * framebuffer ages then. Otherwise, further drawing operations might
  * incorrectly skip cells.
  * Furthermore, if a cell has age "0", it means it _has_ to be drawn. No ageing
  * information is available.
+ *
+ * DAMAGE:
+ * Additionally to the ages, the screen records which columns of each row
+ * changed since the last draw, and whether a region was scrolled. Renderers
+ * that keep their framebuffer between frames can fetch this via
+ * tsm_screen_get_damage(), move the scrolled region themselves and then let
+ * tsm_screen_draw_damage() visit only the damaged cells. The damage is
+ * accumulated across any number of modifications and reset by each draw.
+ * Whenever something cannot be described this way (the scroll-back buffer is
+ * shown, the alternate screen is switched, ...), the whole screen is marked
+ * damaged.
  */
 
 #include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
@@ -67,25 +80,534 @@
 
 #define LLOG_SUBSYSTEM "tsm-screen"
 
-static struct cell *get_cursor_cell(struct tsm_screen *con)
+static struct line *get_cursor_line(struct tsm_screen *con)
 {
-	unsigned int cur_x, cur_y;
-
-	cur_x = con->cursor_x;
-	if (cur_x >= con->size_x)
-		cur_x = con->size_x - 1;
+	unsigned int cur_y;
 
 	cur_y = con->cursor_y;
 	if (cur_y >= con->size_y)
 		cur_y = con->size_y - 1;
 
-	return &con->lines[cur_y]->cells[cur_x];
+	return con->lines[cur_y];
 }
 
-static void move_cursor(struct tsm_screen *con, unsigned int x, unsigned int y)
+/*
+ * Scroll-back Cells
+ * Lines leave the scroll-back buffer in the order they entered it, so their
+ * trimmed cells are simply taken one after the other from chunks of
+ * SB_CHUNK_CELLS cells. A chunk is freed when no line uses it anymore. This
+ * saves an allocation of varying size per scrolled line, which is slow and
+ * fragments the heap.
+ * Progress bars, separators and redrawn frames push many equal lines into the
+ * scroll-back buffer. A line whose cells equal those of one of the recent
+ * lines remembered in sb_recent shares them instead of taking a copy. Cells of
+ * scroll-back lines are never written, except when attribute ids are
+ * renumbered; a header in front of the cells makes sure shared cells are
+ * renumbered only once.
+ */
+
+#define SB_CHUNK_CELLS 8192
+
+struct sb_chunk {
+	unsigned int refs;		/* lines using it, +1 while current */
+	unsigned int used;		/* cells handed out */
+	unsigned int size;		/* number of cells */
+	struct cell cells[];
+};
+
+struct sb_cells {
+	unsigned int attr_gen;		/* attr_gen of the attribute ids */
+};
+
+/* number of chunk cells taken by the header */
+#define SB_CELLS_HDR ((sizeof(struct sb_cells) + sizeof(struct cell) - 1) / \
+		      sizeof(struct cell))
+
+static struct sb_cells *sb_cells_hdr(struct cell *cells)
+{
+	return (struct sb_cells*)(cells - SB_CELLS_HDR);
+}
+
+static void sb_chunk_unref(struct sb_chunk *chunk)
+{
+	if (chunk && !--chunk->refs)
+		free(chunk);
+}
+
+/* take @num cells for the scroll-back line @line */
+static struct cell *sb_cells_get(struct tsm_screen *con, struct line *line,
+				 unsigned int num)
+{
+	struct sb_chunk *chunk = con->sb_chunk;
+	struct cell *cells;
+	unsigned int size;
+
+	num += SB_CELLS_HDR;
+	if (!chunk || chunk->size - chunk->used < num) {
+		size = num > SB_CHUNK_CELLS ? num : SB_CHUNK_CELLS;
+		chunk = malloc(sizeof(*chunk) + sizeof(*cells) * size);
+		if (!chunk)
+			return NULL;
+		chunk->refs = 1;
+		chunk->used = 0;
+		chunk->size = size;
+
+		sb_chunk_unref(con->sb_chunk);
+		con->sb_chunk = chunk;
+	}
+
+	cells = &chunk->cells[chunk->used + SB_CELLS_HDR];
+	chunk->used += num;
+	++chunk->refs;
+	line->chunk = chunk;
+	sb_cells_hdr(cells)->attr_gen = con->attr_gen;
+
+	return cells;
+}
+
+/* number of cells sampled by the hash */
+#define SB_HASH_CELLS 8
+
+/* Hash @num cells. Only a few of them are looked at; lines that differ
+ * elsewhere are told apart when compared. */
+static uint32_t sb_cells_hash(const struct cell *cells, unsigned int num)
+{
+	const struct cell *cell;
+	uint32_t h = num;
+	unsigned int i;
+
+	for (i = 0; i < SB_HASH_CELLS; ++i) {
+		cell = &cells[(num - 1) * i / (SB_HASH_CELLS - 1)];
+		h = (h ^ cell->ch ^ (uint32_t)cell->attr << 16 ^
+		     (uint32_t)cell->width << 30) * 0x9e3779b1;
+	}
+
+	return h ^ (h >> 16);
+}
+
+static bool sb_cells_equal(const struct cell *a, const struct cell *b,
+			   unsigned int num)
+{
+	unsigned int i;
+
+	for (i = 0; i < num; ++i) {
+		if (a[i].ch != b[i].ch || a[i].attr != b[i].attr ||
+		    a[i].width != b[i].width)
+			return false;
+	}
+
+	return true;
+}
+
+/* Let the scroll-back line @line share the @num cells with hash @hash if a
+ * recent line has equal ones. Returns them or NULL. */
+static struct cell *sb_cells_share(struct tsm_screen *con, struct line *line,
+				   const struct cell *cells, unsigned int num,
+				   uint32_t hash)
 {
-	struct cell *c;
+	struct sb_recent *recent = &con->sb_recent[hash % SB_RECENT_NUM];
+	struct line *other;
+	uint64_t first;
+
+	/* the newest lines might have been taken back by a resize */
+	first = con->sb_last_id + 1 - con->sb_count + con->sb_old_count;
+	if (recent->hash != hash || recent->sb_id < first ||
+	    recent->sb_id > con->sb_last_id)
+		return NULL;
+
+	/* compressed lines have no chunk and are not shared */
+	other = screen_sb_line(con, con->sb_old_count + recent->sb_id - first);
+	if (!other->chunk || other->size != num ||
+	    !sb_cells_equal(other->cells, cells, num))
+		return NULL;
 
+	++other->chunk->refs;
+	line->chunk = other->chunk;
+	return other->cells;
+}
+
+static void sb_cells_remember(struct tsm_screen *con, const struct line *line,
+			      uint32_t hash)
+{
+	struct sb_recent *recent = &con->sb_recent[hash % SB_RECENT_NUM];
+
+	recent->hash = hash;
+	recent->sb_id = line->sb_id;
+}
+
+/* free the cells of @line, which might come from a chunk */
+void screen_line_free_cells(struct tsm_screen *con, struct line *line)
+{
+	if (line->chunk)
+		sb_chunk_unref(line->chunk);
+	else
+		free(line->cells);
+
+	line->chunk = NULL;
+	line->cells = NULL;
+}
+
+/*
+ * Attribute Table
+ * Cells don't carry their attributes but the id of an entry in a per-screen
+ * table of all attributes in use, which are few in practice. The ids are found
+ * through an open-addressing hash table. When all 16-bit ids are taken, the
+ * ids that no cell uses anymore are dropped and the rest are renumbered,
+ * rewriting every cell of the screen and the scroll-back buffer. That sweep is
+ * only worth it if it frees enough ids; until ATTR_COLLECT_MIN new attributes
+ * were asked for since the last one, those that don't fit get the default id.
+ */
+
+#define ATTR_ID_NONE 0xffff
+#define ATTR_ID_MAX ATTR_ID_NONE
+#define ATTR_COLLECT_MIN 4096
+
+static bool attr_equal(const struct tsm_screen_attr *a,
+		       const struct tsm_screen_attr *b)
+{
+	return a->fccode == b->fccode &&
+	       a->bccode == b->bccode &&
+	       a->fr == b->fr && a->fg == b->fg && a->fb == b->fb &&
+	       a->br == b->br && a->bg == b->bg && a->bb == b->bb &&
+	       a->bold == b->bold &&
+	       a->underline == b->underline &&
+	       a->inverse == b->inverse &&
+	       a->protect == b->protect &&
+	       a->blink == b->blink;
+}
+
+static unsigned int attr_hash(const struct tsm_screen_attr *attr)
+{
+	uint32_t h;
+
+	h = (uint8_t)attr->fccode | (uint8_t)attr->bccode << 8 |
+	    attr->bold << 16 | attr->underline << 17 | attr->inverse << 18 |
+	    attr->protect << 19 | attr->blink << 20;
+	h = h * 0x9e3779b1 ^ (attr->fr | attr->fg << 8 | attr->fb << 16);
+	h = h * 0x9e3779b1 ^ (attr->br | attr->bg << 8 | attr->bb << 16);
+	h *= 0x9e3779b1;
+
+	return h ^ (h >> 16);
+}
+
+static int attr_rehash(struct tsm_screen *con, unsigned int size)
+{
+	uint16_t *hash;
+	unsigned int i, j;
+
+	hash = malloc(sizeof(*hash) * size);
+	if (!hash)
+		return -ENOMEM;
+
+	memset(hash, 0xff, sizeof(*hash) * size);
+	for (i = 0; i < con->attr_num; ++i) {
+		j = attr_hash(&con->attrs[i]) & (size - 1);
+		while (hash[j] != ATTR_ID_NONE)
+			j = (j + 1) & (size - 1);
+		hash[j] = i;
+	}
+
+	free(con->attr_hash);
+	con->attr_hash = hash;
+	con->attr_hash_size = size;
+	return 0;
+}
+
+/* the cells of compressed lines store their attributes by value and are
+ * skipped; shared scroll-back cells are renumbered once for generation @gen */
+static void attr_mark_line(const struct line *line, uint16_t *map)
+{
+	unsigned int i;
+
+	map[line->fill] = 0;
+	for (i = 0; line->cells && i < line->size; ++i)
+		map[line->cells[i].attr] = 0;
+}
+
+static void attr_remap_line(struct line *line, const uint16_t *map,
+			    unsigned int gen)
+{
+	struct sb_cells *hdr;
+	unsigned int i;
+
+	line->fill = map[line->fill];
+	if (line->chunk) {
+		hdr = sb_cells_hdr(line->cells);
+		if (hdr->attr_gen == gen)
+			return;
+		hdr->attr_gen = gen;
+	}
+
+	for (i = 0; line->cells && i < line->size; ++i)
+		line->cells[i].attr = map[line->cells[i].attr];
+}
+
+/* Drop the attributes no cell uses and renumber the others. */
+static int attr_collect(struct tsm_screen *con)
+{
+	uint16_t *map;
+	unsigned int i, num;
+
+	map = malloc(sizeof(*map) * ATTR_ID_MAX);
+	if (!map)
+		return -ENOMEM;
+
+	memset(map, 0xff, sizeof(*map) * ATTR_ID_MAX);
+	map[con->def_attr_id] = 0;
+	for (i = 0; i < con->line_num; ++i) {
+		attr_mark_line(con->main_lines[i], map);
+		attr_mark_line(con->alt_lines[i], map);
+	}
+	for (i = 0; i < con->sb_count; ++i)
+		attr_mark_line(screen_sb_line(con, i), map);
+	for (i = 0; i < con->attr_pin_num; ++i)
+		map[con->attr_pins[i]] = 0;
+	attr_mark_line(&con->sb_arch_line, map);
+
+	num = 0;
+	for (i = 0; i < con->attr_num; ++i) {
+		if (map[i] == ATTR_ID_NONE)
+			continue;
+		con->attrs[num] = con->attrs[i];
+		map[i] = num++;
+	}
+
+	/* back off until ATTR_COLLECT_MIN new attributes were asked for */
+	if (con->attr_num - num < ATTR_COLLECT_MIN)
+		con->attr_skip = ATTR_COLLECT_MIN - (con->attr_num - num);
+
+	/* all ids are in use; the table and its generation stay as they are */
+	if (num == con->attr_num) {
+		llog_debug(con, "attribute table collected: all %u in use",
+			   num);
+		free(map);
+		return 0;
+	}
+
+	for (i = 0; i < con->line_num; ++i) {
+		attr_remap_line(con->main_lines[i], map, con->attr_gen + 1);
+		attr_remap_line(con->alt_lines[i], map, con->attr_gen + 1);
+	}
+	for (i = 0; i < con->sb_count; ++i)
+		attr_remap_line(screen_sb_line(con, i), map,
+				con->attr_gen + 1);
+	for (i = 0; i < con->attr_pin_num; ++i)
+		con->attr_pins[i] = map[con->attr_pins[i]];
+	attr_remap_line(&con->sb_arch_line, map, con->attr_gen + 1);
+
+	llog_debug(con, "attribute table collected: %u of %u in use",
+		   num, con->attr_num);
+
+	con->def_attr_id = map[con->def_attr_id];
+	con->attr_last = con->def_attr_id;
+	con->attr_num = num;
+	++con->attr_gen;
+	free(map);
+
+	return attr_rehash(con, con->attr_hash_size);
+}
+
+/*
+ * Return the id of @attr in the attribute table, adding it if needed. If that
+ * is not possible, the id of the default attributes is returned.
+ */
+uint16_t screen_attr_intern(struct tsm_screen *con,
+			    const struct tsm_screen_attr *attr)
+{
+	struct tsm_screen_attr *attrs;
+	unsigned int i, mask, size;
+	uint16_t id;
+
+	if (con->attr_num &&
+	    attr_equal(&con->attrs[con->attr_last], attr))
+		return con->attr_last;
+
+	mask = con->attr_hash_size - 1;
+	for (i = attr_hash(attr) & mask;
+	     (id = con->attr_hash[i]) != ATTR_ID_NONE;
+	     i = (i + 1) & mask) {
+		if (attr_equal(&con->attrs[id], attr)) {
+			con->attr_last = id;
+			return id;
+		}
+	}
+
+	if (con->attr_num >= ATTR_ID_MAX) {
+		if (con->attr_skip) {
+			--con->attr_skip;
+			return con->def_attr_id;
+		}
+		if (attr_collect(con) < 0 || con->attr_num >= ATTR_ID_MAX) {
+			llog_warning(con, "out of attribute ids");
+			return con->def_attr_id;
+		}
+	}
+
+	if (con->attr_num >= con->attr_size) {
+		size = con->attr_size * 2;
+		if (size > ATTR_ID_MAX)
+			size = ATTR_ID_MAX;
+		attrs = realloc(con->attrs, sizeof(*attrs) * size);
+		if (!attrs)
+			return con->def_attr_id;
+		con->attrs = attrs;
+		con->attr_size = size;
+	}
+
+	/* keep the hash table at most half full */
+	if ((con->attr_num + 1) * 2 > con->attr_hash_size &&
+	    attr_rehash(con, con->attr_hash_size * 2) < 0)
+		return con->def_attr_id;
+
+	id = con->attr_num++;
+	con->attrs[id] = *attr;
+
+	mask = con->attr_hash_size - 1;
+	for (i = attr_hash(attr) & mask;
+	     con->attr_hash[i] != ATTR_ID_NONE;
+	     i = (i + 1) & mask)
+		;
+	con->attr_hash[i] = id;
+
+	con->attr_last = id;
+	return id;
+}
+
+void screen_damage(struct tsm_screen *con, unsigned int x_from,
+		   unsigned int x_to, unsigned int y)
+{
+	struct tsm_screen_span *span;
+
+	if (con->damage_full || y >= con->size_y)
+		return;
+
+	/* While the scroll-back buffer is shown, screen lines do not map to
+	 * viewport rows. This is rare enough to just redraw everything. */
+	if (con->sb_pos) {
+		con->damage_full = true;
+		return;
+	}
+
+	if (x_to >= con->size_x)
+		x_to = con->size_x - 1;
+	if (x_from > x_to)
+		return;
+
+	span = &con->damage[y];
+	if (x_from < span->start)
+		span->start = x_from;
+	if (x_to > span->end)
+		span->end = x_to;
+}
+
+void screen_damage_all(struct tsm_screen *con)
+{
+	con->damage_full = true;
+}
+
+void screen_damage_reset(struct tsm_screen *con)
+{
+	unsigned int i;
+
+	for (i = 0; i < con->line_num; ++i) {
+		con->damage[i].start = UINT_MAX;
+		con->damage[i].end = 0;
+	}
+
+	con->damage_full = false;
+	con->damage_scroll = 0;
+}
+
+static void screen_damage_rows(struct tsm_screen *con, unsigned int from,
+			       unsigned int to)
+{
+	for ( ; from <= to; ++from)
+		screen_damage(con, 0, con->size_x - 1, from);
+}
+
+/* like screen_damage_rows() but overwrites stale spans */
+static void screen_damage_set_rows(struct tsm_screen *con, unsigned int from,
+				   unsigned int to)
+{
+	for ( ; from <= to; ++from) {
+		con->damage[from].start = 0;
+		con->damage[from].end = con->size_x - 1;
+	}
+}
+
+static void screen_damage_cursor(struct tsm_screen *con)
+{
+	unsigned int x, y;
+
+	x = con->cursor_x;
+	if (x >= con->size_x)
+		x = con->size_x - 1;
+	y = con->cursor_y;
+	if (y >= con->size_y)
+		y = con->size_y - 1;
+
+	screen_damage(con, x, x, y);
+}
+
+/* Record that the rows @top to @bottom moved up by @num rows (down if @num is
+ * negative). The spans are moved along so they stay valid once the renderer
+ * applied the accumulated scroll to its framebuffer. Only one scroll region
+ * is remembered; scrolling another one just damages all its rows. The
+ * cursor does not move along with the content, so it is damaged on both sides
+ * of the move. */
+static void screen_damage_scroll(struct tsm_screen *con, unsigned int top,
+				 unsigned int bottom, int num)
+{
+	unsigned int rows, n;
+	int total;
+
+	if (con->damage_full || !num)
+		return;
+
+	/* the selection is moved by screen rows, not within the region */
+	if (con->sb_pos || con->sel_active) {
+		con->damage_full = true;
+		return;
+	}
+
+	rows = bottom + 1 - top;
+	total = con->damage_scroll + num;
+
+	if (con->damage_scroll && (con->damage_scroll_top != top ||
+				   con->damage_scroll_bottom != bottom)) {
+		screen_damage_rows(con, top, bottom);
+		return;
+	}
+
+	if ((unsigned int)abs(num) >= rows || (unsigned int)abs(total) >= rows) {
+		con->damage_scroll = 0;
+		screen_damage_rows(con, top, bottom);
+		return;
+	}
+
+	screen_damage_cursor(con);
+
+	if (num > 0) {
+		n = num;
+		memmove(&con->damage[top], &con->damage[top + n],
+			(rows - n) * sizeof(*con->damage));
+		screen_damage_set_rows(con, bottom + 1 - n, bottom);
+	} else {
+		n = -num;
+		memmove(&con->damage[top + n], &con->damage[top],
+			(rows - n) * sizeof(*con->damage));
+		screen_damage_set_rows(con, top, top + n - 1);
+	}
+
+	con->damage_scroll = total;
+	con->damage_scroll_top = top;
+	con->damage_scroll_bottom = bottom;
+
+	screen_damage_cursor(con);
+}
+
+static void move_cursor(struct tsm_screen *con, unsigned int x, unsigned int y)
+{
 	/* if cursor is hidden, just move it */
 	if (con->flags & TSM_SCREEN_HIDE_CURSOR) {
 		con->cursor_x = x;
@@ -94,28 +616,27 @@ static void move_cursor(struct tsm_screen *con, unsigned int x, unsigned int y)
 	}
 
 	/* If cursor is visible, we have to mark the current and the new cell
-	 * as changed by resetting their age. We skip it if the cursor-position
-	 * didn't actually change. */
+	 * as changed by resetting the age of their lines. We skip it if the
+	 * cursor-position didn't actually change. */
 
 	if (con->cursor_x == x && con->cursor_y == y)
 		return;
 
-	c = get_cursor_cell(con);
-	c->age = con->age_cnt;
+	get_cursor_line(con)->age = con->age_cnt;
+	screen_damage_cursor(con);
 
 	con->cursor_x = x;
 	con->cursor_y = y;
 
-	c = get_cursor_cell(con);
-	c->age = con->age_cnt;
+	get_cursor_line(con)->age = con->age_cnt;
+	screen_damage_cursor(con);
 }
 
 void screen_cell_init(struct tsm_screen *con, struct cell *cell)
 {
 	cell->ch = 0;
 	cell->width = 1;
-	cell->age = con->age_cnt;
-	memcpy(&cell->attr, &con->def_attr, sizeof(cell->attr));
+	cell->attr = con->def_attr_id;
 }
 
 static int line_new(struct tsm_screen *con, struct line **out,
@@ -130,10 +651,13 @@ static int line_new(struct tsm_screen *con, struct line **out,
 	line = malloc(sizeof(*line));
 	if (!line)
 		return -ENOMEM;
-	line->next = NULL;
-	line->prev = NULL;
 	line->size = width;
+	line->fill = con->def_attr_id;
+	line->sb_id = 0;
 	line->age = con->age_cnt;
+	line->seg = NULL;
+	line->chunk = NULL;
+	line->wrapped = false;
 
 	line->cells = malloc(sizeof(struct cell) * width);
 	if (!line->cells) {
@@ -148,9 +672,9 @@ static int line_new(struct tsm_screen *con, struct line **out,
 	return 0;
 }
 
-static void line_free(struct line *line)
+static void line_free(struct tsm_screen *con, struct line *line)
 {
-	free(line->cells);
+	screen_line_free_cells(con, line);
 	free(line);
 }
 
@@ -168,6 +692,7 @@ static int line_resize(struct tsm_screen *con, struct line *line,
 			return -ENOMEM;
 
 		line->cells = tmp;
+		line->age = con->age_cnt;
 
 		while (line->size < width) {
 			screen_cell_init(con, &line->cells[line->size]);
@@ -178,94 +703,259 @@ static int line_resize(struct tsm_screen *con, struct line *line,
 	return 0;
 }
 
-/* This links the given line into the scrollback-buffer */
-static void link_to_scrollback(struct tsm_screen *con, struct line *line)
+static void selection_forget(struct tsm_screen *con, struct line *line)
 {
-	struct line *tmp;
+	if (!con->sel_active)
+		return;
 
-	/* TODO: more sophisticated ageing */
-	con->age = con->age_cnt;
+	if (con->sel_start.line == line) {
+		con->sel_start.line = NULL;
+		con->sel_start.y = SELECTION_TOP;
+	}
+	if (con->sel_end.line == line) {
+		con->sel_end.line = NULL;
+		con->sel_end.y = SELECTION_TOP;
+	}
+}
 
-	if (con->sb_max == 0) {
-		if (con->sel_active) {
-			if (con->sel_start.line == line) {
-				con->sel_start.line = NULL;
-				con->sel_start.y = SELECTION_TOP;
-			}
-			if (con->sel_end.line == line) {
-				con->sel_end.line = NULL;
-				con->sel_end.y = SELECTION_TOP;
-			}
+/* Append @line, which is dropped from the scroll-back buffer, to the archive
+ * if there is one. If it was shown at the top of the screen, the archive is
+ * shown from there on. */
+static bool sb_archive(struct tsm_screen *con, struct line *line)
+{
+	if (!con->sb_arch || screen_line_load(con, line) ||
+	    screen_sb_archive_push(con, line))
+		return false;
+
+	if (con->sb_pos == line) {
+		con->sb_pos = &con->sb_arch_line;
+		con->sb_arch_top = screen_sb_archive_count(con) - 1;
+	}
+
+	return true;
+}
+
+/* Make room for @num more lines in the ring of the scroll-back buffer by
+ * doubling it, if possible not beyond sb_max. */
+static int sb_reserve(struct tsm_screen *con, unsigned int num)
+{
+	struct line **lines;
+	unsigned int size, count, i;
+
+	count = con->sb_count - con->sb_old_count;
+	if (count + num <= con->sb_size)
+		return 0;
+
+	size = con->sb_size ? con->sb_size * 2 : 64;
+	while (size < count + num)
+		size *= 2;
+	if (size > con->sb_max && count + num <= con->sb_max)
+		size = con->sb_max;
+
+	lines = malloc(sizeof(*lines) * size);
+	if (!lines)
+		return -ENOMEM;
+
+	for (i = 0; i < count; ++i)
+		lines[i] = screen_sb_line(con, con->sb_old_count + i);
+
+	free(con->sb_lines);
+	con->sb_lines = lines;
+	con->sb_size = size;
+	con->sb_head = 0;
+	return 0;
+}
+
+/* remove the oldest line from the scroll-back buffer; it is not freed */
+static void sb_pop(struct tsm_screen *con)
+{
+	if (con->sb_old_count) {
+		if (++con->sb_old_head == con->sb_old_size)
+			con->sb_old_head = 0;
+		--con->sb_old_count;
+		++con->sb_old_id;
+	} else if (++con->sb_head == con->sb_size) {
+		con->sb_head = 0;
+	}
+
+	--con->sb_count;
+	if (con->sb_cold)
+		--con->sb_cold;
+}
+
+/* drop the oldest line of the scroll-back buffer, or archive it */
+static void sb_drop(struct tsm_screen *con)
+{
+	struct line *line = screen_sb_line(con, 0);
+
+	/* We treat fixed/unfixed position the same here because we
+	 * remove lines from the TOP of the scrollback buffer. */
+	if (!sb_archive(con, line) && con->sb_pos == line)
+		con->sb_pos = screen_sb_next(con, line);
+
+	selection_forget(con, line);
+	screen_sb_release(con, line);
+	line_free(con, line);
+	sb_pop(con);
+}
+
+/* Return the number of cells of the screen line @line before its trailing
+ * blank cells, which all have the attribute @fill. Cells past the width of the
+ * screen are hidden and count as blank. A line that is continued in the next
+ * one keeps all its cells, as they are part of the text. */
+static unsigned int line_used(struct tsm_screen *con, const struct line *line,
+			      uint16_t *fill)
+{
+	const struct cell *cell;
+	unsigned int used, size;
+	uint16_t attr;
+
+	size = line->size < con->size_x ? line->size : con->size_x;
+	if (!size || line->wrapped) {
+		*fill = con->def_attr_id;
+		return size;
+	}
+
+	attr = line->cells[size - 1].attr;
+	for (used = size; used; --used) {
+		cell = &line->cells[used - 1];
+		if (cell->ch || cell->width != 1 || cell->attr != attr)
+			break;
+	}
+
+	*fill = used == size ? con->def_attr_id : attr;
+	return used;
+}
+
+/*
+ * This links the given line into the scroll-back buffer and returns the line
+ * that takes its place on the screen. That is a new line while the buffer
+ * grows and its oldest line once it is full. Scroll-back lines do not keep
+ * their trailing blank cells, only the attribute to draw them with, and blank
+ * lines no cells at all. So @line gets a trimmed copy of its cells, or shares
+ * the cells of an equal recent line, and hands the full row on to the returned
+ * line, cleared. If the line cannot be stored, NULL is returned and the caller
+ * has to reuse it.
+ */
+static struct line *link_to_scrollback(struct tsm_screen *con,
+				       struct line *line)
+{
+	struct line *tmp, *next;
+	struct cell *cells;
+	unsigned int i, used;
+	uint32_t hash;
+	uint16_t fill;
+	bool archived;
+
+	/* the line leaves the screen; it only stays visible if the scroll-back
+	 * buffer is shown, which then moves as a whole */
+	if (con->sb_pos) {
+		con->age = con->age_cnt;
+		screen_damage_all(con);
+	}
+
+	tmp = NULL;
+	if (con->sb_count < con->sb_max && !sb_reserve(con, 1))
+		tmp = calloc(1, sizeof(*tmp));
+
+	if (!tmp && !con->sb_count) {
+		sb_archive(con, line);
+		selection_forget(con, line);
+		return NULL;
+	}
+
+	/* while the buffer is reflowed, the oldest line leaves another ring */
+	if (!tmp && con->sb_old_count && sb_reserve(con, 1))
+		return NULL;
+
+	used = line_used(con, line, &fill);
+	cells = NULL;
+	hash = 0;
+	if (used) {
+		hash = sb_cells_hash(line->cells, used);
+		cells = sb_cells_share(con, line, line->cells, used, hash);
+	}
+	if (used && !cells) {
+		cells = sb_cells_get(con, line, used);
+		if (!cells) {
+			free(tmp);
+			return NULL;
 		}
-		line_free(line);
-		return;
+		memcpy(cells, line->cells, sizeof(*cells) * used);
 	}
 
-	/* Remove a line from the scrollback buffer if it reaches its maximum.
-	 * We must take care to correctly keep the current position as the new
-	 * line is linked in after we remove the top-most line here.
-	 * sb_max == 0 is tested earlier so we can assume sb_max > 0 here. In
-	 * other words, buf->sb_first is a valid line if sb_count >= sb_max. */
-	if (con->sb_count >= con->sb_max) {
-		tmp = con->sb_first;
-		con->sb_first = tmp->next;
-		if (tmp->next)
-			tmp->next->prev = NULL;
+	/* Remove the oldest line from the scrollback buffer if it reaches its
+	 * maximum (or no memory is left for another one) and recycle it. */
+	if (!tmp) {
+		tmp = screen_sb_line(con, 0);
+		archived = sb_archive(con, tmp);
+		if (tmp->seg)
+			screen_sb_release(con, tmp);
 		else
-			con->sb_last = NULL;
-		--con->sb_count;
+			screen_line_free_cells(con, tmp);
 
-		/* (position == tmp && !next) means we have sb_max=1 so set
-		 * position to the new line. Otherwise, set to new first line.
-		 * If position!=tmp and we have a fixed-position then nothing
+		/* If position==tmp we set the position to the next line,
+		 * which is "line" if the buffer holds a single line. If
+		 * position!=tmp and we have a fixed-position then nothing
 		 * needs to be done because we can stay at the same line. If we
 		 * have no fixed-position, we need to set the position to the
-		 * next inserted line, which can be "line", too. */
-		if (con->sb_pos) {
+		 * next inserted line, which can be "line", too. Nothing is lost
+		 * if the line went to the archive, so the position stays. */
+		if (con->sb_pos && !archived &&
+		    con->sb_pos != &con->sb_arch_line) {
 			if (con->sb_pos == tmp ||
 			    !(con->flags & TSM_SCREEN_FIXED_POS)) {
-				if (con->sb_pos->next)
-					con->sb_pos = con->sb_pos->next;
-				else
-					con->sb_pos = line;
+				next = screen_sb_next(con, con->sb_pos);
+				con->sb_pos = next ? next : line;
 			}
 		}
 
-		if (con->sel_active) {
-			if (con->sel_start.line == tmp) {
-				con->sel_start.line = NULL;
-				con->sel_start.y = SELECTION_TOP;
-			}
-			if (con->sel_end.line == tmp) {
-				con->sel_end.line = NULL;
-				con->sel_end.y = SELECTION_TOP;
-			}
-		}
-		line_free(tmp);
+		selection_forget(con, tmp);
+		sb_pop(con);
 	}
 
+	tmp->cells = line->cells;
+	tmp->size = line->size;
+	tmp->fill = con->def_attr_id;
+	tmp->age = con->age_cnt;
+	tmp->wrapped = false;
+	for (i = 0; i < tmp->size; ++i)
+		screen_cell_init(con, &tmp->cells[i]);
+
+	line->cells = cells;
+	line->size = used;
+	line->fill = fill;
+
+	i = con->sb_head + con->sb_count - con->sb_old_count;
+	if (i >= con->sb_size)
+		i -= con->sb_size;
+	con->sb_lines[i] = line;
 	line->sb_id = ++con->sb_last_id;
-	line->next = NULL;
-	line->prev = con->sb_last;
-	if (con->sb_last)
-		con->sb_last->next = line;
-	else
-		con->sb_first = line;
-	con->sb_last = line;
 	++con->sb_count;
+	if (used)
+		sb_cells_remember(con, line, hash);
+
+	screen_sb_compress(con);
+
+	return tmp;
+}
+
+/* return the scroll-back line @num lines above the screen, or NULL */
+static struct line *sb_line_above(struct tsm_screen *con, unsigned int num)
+{
+	if (!num || num > con->sb_count)
+		return NULL;
+
+	return screen_sb_line(con, con->sb_count - num);
 }
 
 static void screen_scroll_up(struct tsm_screen *con, unsigned int num)
 {
 	unsigned int i, j, max, pos;
-	int ret;
 
 	if (!num)
 		return;
 
-	/* TODO: more sophisticated ageing */
-	con->age = con->age_cnt;
-
 	max = con->margin_bottom + 1 - con->margin_top;
 	if (num > max)
 		num = max;
@@ -284,16 +974,15 @@ static void screen_scroll_up(struct tsm_screen *con, unsigned int num)
 	for (i = 0; i < num; ++i) {
 		pos = con->margin_top + i;
 		if (!(con->flags & TSM_SCREEN_ALTERNATE))
-			ret = line_new(con, &cache[i], con->size_x);
+			cache[i] = link_to_scrollback(con, con->lines[pos]);
 		else
-			ret = -EAGAIN;
+			cache[i] = NULL;
 
-		if (!ret) {
-			link_to_scrollback(con, con->lines[pos]);
-		} else {
+		if (!cache[i]) {
 			cache[i] = con->lines[pos];
 			for (j = 0; j < con->size_x; ++j)
 				screen_cell_init(con, &cache[i]->cells[j]);
+			cache[i]->wrapped = false;
 		}
 	}
 
@@ -306,22 +995,28 @@ static void screen_scroll_up(struct tsm_screen *con, unsigned int num)
 	memcpy(&con->lines[con->margin_top + (max - num)],
 	       cache, num * sizeof(struct line*));
 
+	/* only the scroll region moved, but the selection might have moved
+	 * in or out of the rows outside of it */
+	for (i = 0; i < max; ++i)
+		con->lines[con->margin_top + i]->age = con->age_cnt;
+	if (con->sel_active)
+		con->age = con->age_cnt;
+	screen_damage_scroll(con, con->margin_top, con->margin_bottom, num);
+
 	if (con->sel_active) {
 		if (!con->sel_start.line && con->sel_start.y >= 0) {
 			con->sel_start.y -= num;
 			if (con->sel_start.y < 0) {
-				con->sel_start.line = con->sb_last;
-				while (con->sel_start.line && ++con->sel_start.y < 0)
-					con->sel_start.line = con->sel_start.line->prev;
+				con->sel_start.line = sb_line_above(con,
+						-con->sel_start.y);
 				con->sel_start.y = SELECTION_TOP;
 			}
 		}
 		if (!con->sel_end.line && con->sel_end.y >= 0) {
 			con->sel_end.y -= num;
 			if (con->sel_end.y < 0) {
-				con->sel_end.line = con->sb_last;
-				while (con->sel_end.line && ++con->sel_end.y < 0)
-					con->sel_end.line = con->sel_end.line->prev;
+				con->sel_end.line = sb_line_above(con,
+						-con->sel_end.y);
 				con->sel_end.y = SELECTION_TOP;
 			}
 		}
@@ -335,9 +1030,6 @@ static void screen_scroll_down(struct tsm_screen *con, unsigned int num)
 	if (!num)
 		return;
 
-	/* TODO: more sophisticated ageing */
-	con->age = con->age_cnt;
-
 	max = con->margin_bottom + 1 - con->margin_top;
 	if (num > max)
 		num = max;
@@ -353,6 +1045,7 @@ static void screen_scroll_down(struct tsm_screen *con, unsigned int num)
 		cache[i] = con->lines[con->margin_bottom - i];
 		for (j = 0; j < con->size_x; ++j)
 			screen_cell_init(con, &cache[i]->cells[j]);
+		cache[i]->wrapped = false;
 	}
 
 	if (num < max) {
@@ -364,11 +1057,28 @@ static void screen_scroll_down(struct tsm_screen *con, unsigned int num)
 	memcpy(&con->lines[con->margin_top],
 	       cache, num * sizeof(struct line*));
 
+	for (i = 0; i < max; ++i)
+		con->lines[con->margin_top + i]->age = con->age_cnt;
+	if (con->sel_active)
+		con->age = con->age_cnt;
+	screen_damage_scroll(con, con->margin_top, con->margin_bottom,
+			     -(int)num);
+
 	if (con->sel_active) {
-		if (!con->sel_start.line && con->sel_start.y >= 0)
+		if (!con->sel_start.line && con->sel_start.y >= 0) {
 			con->sel_start.y += num;
-		if (!con->sel_end.line && con->sel_end.y >= 0)
+			if (con->sel_start.y >= (int)con->size_y) {
+				con->sel_start.x = con->size_x - 1;
+				con->sel_start.y = con->size_y - 1;
+			}
+		}
+		if (!con->sel_end.line && con->sel_end.y >= 0) {
 			con->sel_end.y += num;
+			if (con->sel_end.y >= (int)con->size_y) {
+				con->sel_end.x = con->size_x - 1;
+				con->sel_end.y = con->size_y - 1;
+			}
+		}
 	}
 }
 
@@ -394,69 +1104,627 @@ static void screen_write(struct tsm_screen *con, unsigned int x,
 		line->age = con->age_cnt;
 		memmove(&line->cells[x + len], &line->cells[x],
 			sizeof(struct cell) * (con->size_x - len - x));
+		screen_damage(con, x, con->size_x - 1, y);
 	}
 
-	line->cells[x].age = con->age_cnt;
-	line->cells[x].ch = ch;
-	line->cells[x].width = len;
-	memcpy(&line->cells[x].attr, attr, sizeof(*attr));
+	line->age = con->age_cnt;
+	line->cells[x].ch = ch;
+	line->cells[x].width = len;
+	line->cells[x].attr = screen_attr_intern(con, attr);
+
+	for (i = 1; i < len && i + x < con->size_x; ++i)
+		line->cells[x + i].width = 0;
+
+	screen_damage(con, x, x + len - 1, y);
+}
+
+static void screen_erase_region(struct tsm_screen *con,
+				 unsigned int x_from,
+				 unsigned int y_from,
+				 unsigned int x_to,
+				 unsigned int y_to,
+				 bool protect)
+{
+	unsigned int to;
+	struct line *line;
+
+	if (y_to >= con->size_y)
+		y_to = con->size_y - 1;
+	if (x_to >= con->size_x)
+		x_to = con->size_x - 1;
+
+	for ( ; y_from <= y_to; ++y_from) {
+		line = con->lines[y_from];
+		if (!line) {
+			x_from = 0;
+			continue;
+		}
+
+		if (y_from == y_to)
+			to = x_to;
+		else
+			to = con->size_x - 1;
+
+		line->age = con->age_cnt;
+		screen_damage(con, x_from, to, y_from);
+		if (to == con->size_x - 1)
+			line->wrapped = false;
+		for ( ; x_from <= to; ++x_from) {
+			if (protect &&
+			    screen_attr(con, line->cells[x_from].attr)->protect)
+				continue;
+
+			screen_cell_init(con, &line->cells[x_from]);
+		}
+		x_from = 0;
+	}
+}
+
+static inline unsigned int to_abs_x(struct tsm_screen *con, unsigned int x)
+{
+	return x;
+}
+
+static inline unsigned int to_abs_y(struct tsm_screen *con, unsigned int y)
+{
+	if (!(con->flags & TSM_SCREEN_REL_ORIGIN))
+		return y;
+
+	return con->margin_top + y;
+}
+
+/*
+ * Reflow
+ * Lines that are auto-wrapped are marked as continued in the next line. All
+ * lines up to one that is not continued form a logical line, which is laid out
+ * anew when the width of the screen changes. Rows are filled up completely;
+ * like when writing, a wide character is cut at the end of a row.
+ * tsm_screen_resize() reflows the main screen right away, together with the
+ * start of its first logical line if that is in the scroll-back buffer, and
+ * pushes what does not fit into the buffer. The rest of the buffer could be
+ * huge, so its lines are moved to sb_old_lines and reflowed in steps by
+ * tsm_screen_sb_reflow(), newest first. Until then they are shown as they are.
+ */
+
+/* distance of the sb IDs of reflowed lines from those of the old lines */
+#define SB_REFLOW_GAP ((uint64_t)1 << 32)
+
+/* longer logical lines in the scroll-back buffer are reflowed in pieces */
+#define SB_REFLOW_LINES_MAX 1024
+
+enum reflow_pos_type {
+	REFLOW_CURSOR,
+	REFLOW_SEL_START,
+	REFLOW_SEL_END,
+	REFLOW_SB_POS,
+	REFLOW_POS_NUM,
+};
+
+/* a position that is kept while reflowing */
+struct reflow_pos {
+	bool set;
+	unsigned int line;		/* logical line */
+	unsigned int off;		/* cell in the logical line */
+	unsigned int row;		/* row after reflowing */
+	unsigned int col;		/* column after reflowing */
+	struct line *sb_line;		/* scroll-back line holding row */
+};
+
+struct reflow_line {
+	unsigned int start;		/* first cell in reflow.cells */
+	unsigned int len;		/* number of cells */
+	uint16_t fill;			/* attribute of the cells after them */
+	bool wrapped;			/* continued after the last one */
+};
+
+struct reflow {
+	struct cell *cells;		/* cells of all logical lines */
+	unsigned int cell_num;
+	struct reflow_line *lines;	/* logical lines */
+	unsigned int line_num;
+	struct reflow_pos pos[REFLOW_POS_NUM];
+};
+
+/* Append the @num cells of a line to the cells of @rf. A wide character that
+ * was cut at the end of a continued line gets its missing cell back. */
+static void reflow_append(struct reflow *rf, const struct cell *cells,
+			  unsigned int num, bool wrapped)
+{
+	struct cell *cell;
+
+	if (!num)
+		return;
+
+	memcpy(&rf->cells[rf->cell_num], cells, sizeof(*cells) * num);
+	rf->cell_num += num;
+
+	if (wrapped && cells[num - 1].width > 1) {
+		cell = &rf->cells[rf->cell_num++];
+		*cell = cells[num - 1];
+		cell->ch = 0;
+		cell->width = 0;
+	}
+}
+
+static void reflow_set(struct reflow *rf, enum reflow_pos_type type,
+		       unsigned int off)
+{
+	rf->pos[type].set = true;
+	rf->pos[type].line = rf->line_num;
+	rf->pos[type].off = off;
+}
+
+/* Remember the selection and the scroll-back position if they are in @line,
+ * the screen row @y if @line is NULL. Its @num cells start at @off of the
+ * current logical line. */
+static void reflow_mark(struct tsm_screen *con, struct reflow *rf,
+			const struct line *line, int y, unsigned int off,
+			unsigned int num)
+{
+	const struct selection_pos *sel;
+
+	if (line && con->sb_pos == line)
+		reflow_set(rf, REFLOW_SB_POS, off);
+	if (!con->sel_active)
+		return;
+
+	sel = &con->sel_start;
+	if (sel->line == line && (line || sel->y == y))
+		reflow_set(rf, REFLOW_SEL_START,
+			   off + (sel->x < num ? sel->x : num));
+	sel = &con->sel_end;
+	if (sel->line == line && (line || sel->y == y))
+		reflow_set(rf, REFLOW_SEL_END,
+			   off + (sel->x < num ? sel->x : num));
+}
+
+/* return the first cell of the row after the one that starts at @start */
+static unsigned int reflow_next(const struct cell *cells, unsigned int len,
+				unsigned int start, unsigned int width)
+{
+	unsigned int end = start + width;
+
+	if (end >= len)
+		return len;
+
+	/* skip the rest of a wide character that was cut */
+	while (end < len && !cells[end].width)
+		++end;
+
+	return end;
+}
+
+/* Return the number of rows of @width the @len cells take. If @pos is given,
+ * its row and column are set. */
+static unsigned int reflow_layout(const struct cell *cells, unsigned int len,
+				  unsigned int width, struct reflow_pos *pos)
+{
+	unsigned int start = 0, next, num = 0;
+
+	do {
+		next = reflow_next(cells, len, start, width);
+		if (pos && pos->off >= start && (pos->off < next ||
+						 next >= len)) {
+			pos->row = num;
+			pos->col = pos->off - start;
+			if (pos->col > width)
+				pos->col = width;
+		}
+		++num;
+		start = next;
+	} while (start < len);
+
+	return num;
+}
+
+/* Move the selection @sel to the reflowed position @type of @rf. Rows from
+ * @top on are on the screen. */
+static void reflow_sel(struct tsm_screen *con, struct reflow *rf,
+		       enum reflow_pos_type type, struct selection_pos *sel,
+		       unsigned int top)
+{
+	struct reflow_pos *pos = &rf->pos[type];
+
+	if (!pos->set)
+		return;
+
+	sel->x = pos->col < con->size_x ? pos->col : con->size_x - 1;
+	if (pos->sb_line) {
+		sel->line = pos->sb_line;
+		sel->y = 0;
+	} else if (pos->row >= top) {
+		sel->line = NULL;
+		sel->y = pos->row - top;
+	} else {
+		sel->line = NULL;
+		sel->y = SELECTION_TOP;
+	}
+}
+
+/* end the current logical line of @rf */
+static void reflow_close(struct reflow *rf, uint16_t fill, bool wrapped)
+{
+	struct reflow_line *rl = &rf->lines[rf->line_num++];
+
+	rl->len = rf->cell_num - rl->start;
+	rl->fill = fill;
+	rl->wrapped = wrapped;
+	rf->lines[rf->line_num].start = rf->cell_num;
+}
+
+/*
+ * Collect the logical lines of the main screen in @rf, with the cursor, the
+ * selection and the scroll-back position in them. The start of a logical line
+ * that continues on the screen is taken out of the scroll-back buffer.
+ */
+static int screen_reflow_save(struct tsm_screen *con, struct reflow *rf)
+{
+	struct line *line;
+	unsigned int i, k, end, num, used, x;
+	uint16_t fill;
+	bool main = con->lines == con->main_lines, open;
+
+	memset(rf, 0, sizeof(*rf));
+
+	/* the blank rows below the text, the cursor and the selection go */
+	end = 0;
+	for (i = 0; i < con->size_y; ++i) {
+		line = con->main_lines[i];
+		if (line_used(con, line, &fill) || fill != con->def_attr_id ||
+		    line->wrapped)
+			end = i + 1;
+	}
+	if (main && con->cursor_y >= end)
+		end = con->cursor_y + 1;
+	if (main && con->sel_active) {
+		if (!con->sel_start.line && con->sel_start.y >= (int)end)
+			end = con->sel_start.y + 1;
+		if (!con->sel_end.line && con->sel_end.y >= (int)end)
+			end = con->sel_end.y + 1;
+	}
+	/* the selection can be set below the screen */
+	if (end > con->size_y)
+		end = con->size_y;
+
+	/* newest scroll-back lines that are continued on the screen */
+	for (k = 0; k < con->sb_count && k < con->size_y; ++k) {
+		if (!screen_sb_line(con, con->sb_count - 1 - k)->wrapped)
+			break;
+	}
+
+	num = end * (con->size_x + 1);
+	for (i = 0; i < k; ++i)
+		num += screen_sb_line(con, con->sb_count - k + i)->size + 1;
+
+	rf->cells = malloc(sizeof(*rf->cells) * (num ? num : 1));
+	rf->lines = malloc(sizeof(*rf->lines) * (end + 2));
+	if (!rf->cells || !rf->lines) {
+		free(rf->cells);
+		free(rf->lines);
+		return -ENOMEM;
+	}
+	rf->lines[0].start = 0;
+
+	for (i = 0; i < k; ++i) {
+		line = screen_sb_line(con, con->sb_count - k + i);
+		num = screen_line_load(con, line) ? 0 : line->size;
+		reflow_mark(con, rf, line, 0, rf->cell_num, num);
+		reflow_append(rf, line->cells, num, true);
+	}
+
+	for (i = 0; i < k; ++i) {
+		line = screen_sb_line(con, con->sb_count - 1);
+		if (con->sb_count > con->sb_old_count)
+			--con->sb_last_id;
+		else
+			--con->sb_old_count;
+		--con->sb_count;
+
+		/* restored by screen_reflow_restore() */
+		if (con->sb_pos == line)
+			con->sb_pos = NULL;
+		selection_forget(con, line);
+		screen_sb_release(con, line);
+		line_free(con, line);
+	}
+	if (con->sb_cold > con->sb_count)
+		con->sb_cold = con->sb_count;
+
+	open = k;
+	for (i = 0; i < end; ++i) {
+		line = con->main_lines[i];
+		used = line_used(con, line, &fill);
+		x = con->cursor_x < con->size_x ? con->cursor_x : con->size_x;
+		if (main && i == con->cursor_y) {
+			if (x > used)
+				used = x;
+			reflow_set(rf, REFLOW_CURSOR,
+				   rf->cell_num - rf->lines[rf->line_num].start +
+				   x);
+		}
+		if (main)
+			reflow_mark(con, rf, NULL, i, rf->cell_num -
+				    rf->lines[rf->line_num].start, used);
+
+		reflow_append(rf, line->cells, used, line->wrapped);
+		open = line->wrapped;
+		if (!open)
+			reflow_close(rf, fill, false);
+	}
+	if (open)
+		reflow_close(rf, con->def_attr_id, true);
+
+	return 0;
+}
+
+/* Lay the logical lines of @rf out on the cleared main screen, which has its
+ * new size already. Rows that do not fit go to the scroll-back buffer. */
+static void screen_reflow_restore(struct tsm_screen *con, struct reflow *rf)
+{
+	struct reflow_line *rl;
+	struct reflow_pos *pos;
+	struct line *line, *tmp;
+	const struct cell *cells;
+	unsigned int i, j, start, end, next, row, num, top, keep;
+
+	/* find the rows of the remembered positions */
+	num = 0;
+	for (i = 0; i < rf->line_num; ++i) {
+		rl = &rf->lines[i];
+		cells = &rf->cells[rl->start];
+		for (j = 0; j < REFLOW_POS_NUM; ++j) {
+			pos = &rf->pos[j];
+			if (pos->set && pos->line == i) {
+				reflow_layout(cells, rl->len, con->size_x, pos);
+				pos->row += num;
+			}
+		}
+		num += reflow_layout(cells, rl->len, con->size_x, NULL);
+	}
+
+	/* keep the cursor on the screen; the rows below it go if needed */
+	top = num > con->size_y ? num - con->size_y : 0;
+	pos = &rf->pos[REFLOW_CURSOR];
+	if (pos->set && pos->row < top)
+		top = pos->row;
+	keep = num - top > con->size_y ? top + con->size_y : num;
+
+	for (j = 0; j < REFLOW_POS_NUM; ++j) {
+		pos = &rf->pos[j];
+		if (pos->set && pos->row >= keep) {
+			pos->row = keep - 1;
+			pos->col = con->size_x;
+		}
+	}
+
+	row = 0;
+	for (i = 0; i < rf->line_num && row < keep; ++i) {
+		rl = &rf->lines[i];
+		cells = &rf->cells[rl->start];
+		start = 0;
+		do {
+			next = reflow_next(cells, rl->len, start, con->size_x);
+			end = start + con->size_x;
+			if (end > rl->len)
+				end = rl->len;
+
+			line = con->main_lines[row < top ? 0 : row - top];
+			memcpy(line->cells, &cells[start],
+			       sizeof(*cells) * (end - start));
+			for (j = end - start; j < line->size; ++j) {
+				screen_cell_init(con, &line->cells[j]);
+				if (next >= rl->len)
+					line->cells[j].attr = rl->fill;
+			}
+			line->wrapped = next < rl->len || rl->wrapped;
+			line->age = con->age_cnt;
+
+			if (row < top) {
+				tmp = link_to_scrollback(con, line);
+				for (j = 0; j < REFLOW_POS_NUM; ++j) {
+					pos = &rf->pos[j];
+					if (pos->set && pos->row == row && tmp)
+						pos->sb_line = line;
+				}
+				if (tmp)
+					con->main_lines[0] = tmp;
+			}
+
+			++row;
+			start = next;
+		} while (start < rl->len && row < keep);
+	}
+
+	pos = &rf->pos[REFLOW_CURSOR];
+	if (pos->set) {
+		con->cursor_x = pos->col;
+		if (con->cursor_x >= con->size_x)
+			con->cursor_x = con->size_x - 1;
+		con->cursor_y = pos->row - top;
+	}
+
+	if (con->sel_active) {
+		reflow_sel(con, rf, REFLOW_SEL_START, &con->sel_start, top);
+		reflow_sel(con, rf, REFLOW_SEL_END, &con->sel_end, top);
+	}
+
+	pos = &rf->pos[REFLOW_SB_POS];
+	if (pos->set)
+		con->sb_pos = pos->sb_line;
+
+	free(rf->cells);
+	free(rf->lines);
+}
+
+/* Queue the lines of the scroll-back buffer for tsm_screen_sb_reflow(). Lines
+ * that were reflowed to another width already are queued again. */
+static void sb_reflow_start(struct tsm_screen *con)
+{
+	struct line **lines;
+	unsigned int i, num;
+
+	num = con->sb_count - con->sb_old_count;
+	if (!num)
+		return;
 
-	for (i = 1; i < len && i + x < con->size_x; ++i) {
-		line->cells[x + i].age = con->age_cnt;
-		line->cells[x + i].width = 0;
+	if (!con->sb_old_count) {
+		free(con->sb_old_lines);
+		con->sb_old_lines = con->sb_lines;
+		con->sb_old_size = con->sb_size;
+		con->sb_old_head = con->sb_head;
+		con->sb_old_id = con->sb_last_id + 1 - num;
+		con->sb_lines = NULL;
+		con->sb_size = 0;
+	} else {
+		lines = malloc(sizeof(*lines) * con->sb_count);
+		if (!lines)
+			return;
+
+		for (i = 0; i < con->sb_count; ++i) {
+			lines[i] = screen_sb_line(con, i);
+			lines[i]->sb_id = con->sb_old_id + i;
+		}
+
+		free(con->sb_old_lines);
+		con->sb_old_lines = lines;
+		con->sb_old_size = con->sb_count;
+		con->sb_old_head = 0;
 	}
+
+	con->sb_head = 0;
+	con->sb_old_count = con->sb_count;
+	con->sb_last_id = con->sb_old_id + con->sb_count - 1 + SB_REFLOW_GAP;
+	memset(con->sb_recent, 0, sizeof(con->sb_recent));
 }
 
-static void screen_erase_region(struct tsm_screen *con,
-				 unsigned int x_from,
-				 unsigned int y_from,
-				 unsigned int x_to,
-				 unsigned int y_to,
-				 bool protect)
+/* put @line in front of the reflowed lines of the scroll-back buffer */
+static void sb_prepend(struct tsm_screen *con, struct line *line)
 {
-	unsigned int to;
-	struct line *line;
+	line->sb_id = con->sb_last_id - (con->sb_count - con->sb_old_count);
+	con->sb_head = con->sb_head ? con->sb_head - 1 : con->sb_size - 1;
+	con->sb_lines[con->sb_head] = line;
+	++con->sb_count;
+}
 
-	/* TODO: more sophisticated ageing */
-	con->age = con->age_cnt;
+/* Reflow the newest logical line of the old scroll-back lines and put it in
+ * front of the reflowed ones. Returns the number of old lines that are done
+ * or a negative error code. */
+static int sb_reflow_line(struct tsm_screen *con)
+{
+	struct reflow rf;
+	struct reflow_pos *pos;
+	struct line *line, **lines;
+	unsigned int i, a, m, n, num, start, end, row;
+	uint16_t fill;
+	bool wrapped;
+
+	/* a line that fits and is not continued is taken as it is, even if it
+	 * is compressed */
+	a = con->sb_old_count - 1;
+	line = screen_sb_line(con, a);
+	if (line->size <= con->size_x &&
+	    (!a || !screen_sb_line(con, a - 1)->wrapped)) {
+		if (sb_reserve(con, 1))
+			return -ENOMEM;
+		--con->sb_old_count;
+		--con->sb_count;
+		sb_prepend(con, line);
+		return 1;
+	}
 
-	if (y_to >= con->size_y)
-		y_to = con->size_y - 1;
-	if (x_to >= con->size_x)
-		x_to = con->size_x - 1;
+	for ( ; a && con->sb_old_count - a < SB_REFLOW_LINES_MAX; --a) {
+		if (!screen_sb_line(con, a - 1)->wrapped)
+			break;
+	}
+	m = con->sb_old_count - a;
+
+	memset(&rf, 0, sizeof(rf));
+	num = 0;
+	for (i = a; i < con->sb_old_count; ++i)
+		num += screen_sb_line(con, i)->size + 1;
+	rf.cells = malloc(sizeof(*rf.cells) * num);
+	if (!rf.cells)
+		return -ENOMEM;
 
-	for ( ; y_from <= y_to; ++y_from) {
-		line = con->lines[y_from];
-		if (!line) {
-			x_from = 0;
-			continue;
+	for (i = a; i < con->sb_old_count; ++i) {
+		line = screen_sb_line(con, i);
+		num = screen_line_load(con, line) ? 0 : line->size;
+		reflow_mark(con, &rf, line, 0, rf.cell_num, num);
+		reflow_append(&rf, line->cells, num, line->wrapped);
+	}
+	fill = line->fill;
+	wrapped = line->wrapped;
+
+	n = reflow_layout(rf.cells, rf.cell_num, con->size_x, NULL);
+	lines = calloc(n, sizeof(*lines));
+	if (!lines || sb_reserve(con, n))
+		goto err_free;
+
+	start = 0;
+	for (row = 0; row < n; ++row) {
+		line = calloc(1, sizeof(*line));
+		if (!line)
+			goto err_free;
+		lines[row] = line;
+
+		end = start + con->size_x;
+		if (end > rf.cell_num)
+			end = rf.cell_num;
+		line->size = end - start;
+		line->fill = row + 1 < n ? con->def_attr_id : fill;
+		line->wrapped = row + 1 < n || wrapped;
+		line->age = con->age_cnt;
+		if (line->size) {
+			line->cells = sb_cells_get(con, line, line->size);
+			if (!line->cells)
+				goto err_free;
+			memcpy(line->cells, &rf.cells[start],
+			       sizeof(*line->cells) * line->size);
 		}
 
-		if (y_from == y_to)
-			to = x_to;
-		else
-			to = con->size_x - 1;
-		for ( ; x_from <= to; ++x_from) {
-			if (protect && line->cells[x_from].attr.protect)
-				continue;
+		start = reflow_next(rf.cells, rf.cell_num, start,
+				    con->size_x);
+	}
 
-			screen_cell_init(con, &line->cells[x_from]);
+	for (i = 0; i < REFLOW_POS_NUM; ++i) {
+		pos = &rf.pos[i];
+		if (pos->set) {
+			reflow_layout(rf.cells, rf.cell_num, con->size_x, pos);
+			pos->sb_line = lines[pos->row];
 		}
-		x_from = 0;
 	}
-}
 
-static inline unsigned int to_abs_x(struct tsm_screen *con, unsigned int x)
-{
-	return x;
-}
+	for (i = a; i < con->sb_old_count; ++i) {
+		line = screen_sb_line(con, i);
+		screen_sb_release(con, line);
+		line_free(con, line);
+	}
+	con->sb_count -= m;
+	con->sb_old_count = a;
+	if (con->sb_cold > a)
+		con->sb_cold = a;
+	for (row = n; row--; )
+		sb_prepend(con, lines[row]);
 
-static inline unsigned int to_abs_y(struct tsm_screen *con, unsigned int y)
-{
-	if (!(con->flags & TSM_SCREEN_REL_ORIGIN))
-		return y;
+	if (con->sel_active) {
+		reflow_sel(con, &rf, REFLOW_SEL_START, &con->sel_start, 0);
+		reflow_sel(con, &rf, REFLOW_SEL_END, &con->sel_end, 0);
+	}
+	if (rf.pos[REFLOW_SB_POS].set)
+		con->sb_pos = rf.pos[REFLOW_SB_POS].sb_line;
 
-	return con->margin_top + y;
+	free(lines);
+	free(rf.cells);
+	return m;
+
+err_free:
+	for (row = 0; lines && row < n; ++row) {
+		if (lines[row])
+			line_free(con, lines[row]);
+	}
+	free(lines);
+	free(rf.cells);
+	return -ENOMEM;
 }
 
 SHL_EXPORT
@@ -483,6 +1751,17 @@ int tsm_screen_new(struct tsm_screen **out, tsm_log_t log, void *log_data)
 	con->def_attr.fg = 255;
 	con->def_attr.fb = 255;
 
+	con->attr_size = 16;
+	con->attrs = malloc(sizeof(*con->attrs) * con->attr_size);
+	if (!con->attrs) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+	ret = attr_rehash(con, 64);
+	if (ret)
+		goto err_free;
+	con->def_attr_id = screen_attr_intern(con, &con->def_attr);
+
 	ret = tsm_symbol_table_new(&con->sym_table);
 	if (ret)
 		goto err_free;
@@ -498,12 +1777,15 @@ int tsm_screen_new(struct tsm_screen **out, tsm_log_t log, void *log_data)
 
 err_free:
 	for (i = 0; i < con->line_num; ++i) {
-		line_free(con->main_lines[i]);
-		line_free(con->alt_lines[i]);
+		line_free(con, con->main_lines[i]);
+		line_free(con, con->alt_lines[i]);
 	}
 	free(con->main_lines);
 	free(con->alt_lines);
+	free(con->damage);
 	free(con->tab_ruler);
+	free(con->attr_hash);
+	free(con->attrs);
 	tsm_symbol_table_unref(con->sym_table);
 	free(con);
 	return ret;
@@ -529,12 +1811,23 @@ void tsm_screen_unref(struct tsm_screen *con)
 	llog_debug(con, "destroying screen");
 
 	for (i = 0; i < con->line_num; ++i) {
-		line_free(con->main_lines[i]);
-		line_free(con->alt_lines[i]);
+		line_free(con, con->main_lines[i]);
+		line_free(con, con->alt_lines[i]);
+	}
+	for (i = 0; i < con->sb_count; ++i) {
+		screen_sb_release(con, screen_sb_line(con, i));
+		line_free(con, screen_sb_line(con, i));
 	}
+	sb_chunk_unref(con->sb_chunk);
+	screen_sb_archive_free(con);
+	free(con->sb_old_lines);
+	free(con->sb_lines);
 	free(con->main_lines);
 	free(con->alt_lines);
+	free(con->damage);
 	free(con->tab_ruler);
+	free(con->attr_hash);
+	free(con->attrs);
 	tsm_symbol_table_unref(con->sym_table);
 	free(con);
 }
@@ -586,9 +1879,11 @@ int tsm_screen_resize(struct tsm_screen *con, unsigned int x,
 		      unsigned int y)
 {
 	struct line **cache;
+	struct tsm_screen_span *damage;
+	struct reflow rf;
 	unsigned int i, j, width, diff, start;
 	int ret;
-	bool *tab_ruler;
+	bool *tab_ruler, reflow;
 
 	if (!con || !x || !y)
 		return -EINVAL;
@@ -622,6 +1917,12 @@ int tsm_screen_resize(struct tsm_screen *con, unsigned int x,
 			con->lines = cache;
 		con->alt_lines = cache;
 
+		/* resize damage spans; they are reset by the next draw */
+		damage = realloc(con->damage, sizeof(*damage) * y);
+		if (!damage)
+			return -ENOMEM;
+		con->damage = damage;
+
 		/* allocate new lines */
 		if (x > con->size_x)
 			width = x;
@@ -637,7 +1938,7 @@ int tsm_screen_resize(struct tsm_screen *con, unsigned int x,
 			ret = line_new(con, &con->alt_lines[con->line_num],
 				       width);
 			if (ret) {
-				line_free(con->main_lines[con->line_num]);
+				line_free(con, con->main_lines[con->line_num]);
 				return ret;
 			}
 
@@ -665,7 +1966,11 @@ int tsm_screen_resize(struct tsm_screen *con, unsigned int x,
 		}
 	}
 
+	/* the text of the main screen is rewrapped if the width changes */
+	reflow = x != con->size_x && !screen_reflow_save(con, &rf);
+
 	screen_inc_age(con);
+	screen_damage_all(con);
 
 	/* clear expansion/padding area */
 	start = x;
@@ -674,17 +1979,21 @@ int tsm_screen_resize(struct tsm_screen *con, unsigned int x,
 	for (j = 0; j < con->line_num; ++j) {
 		/* main-lines may go into SB, so clear all cells */
 		i = 0;
-		if (j < con->size_y)
+		if (j < con->size_y && !reflow)
 			i = start;
 
+		con->main_lines[j]->age = con->age_cnt;
 		for ( ; i < con->main_lines[j]->size; ++i)
 			screen_cell_init(con, &con->main_lines[j]->cells[i]);
+		if (reflow)
+			con->main_lines[j]->wrapped = false;
 
 		/* alt-lines never go into SB, only clear visible cells */
 		i = 0;
 		if (j < con->size_y)
 			i = con->size_x;
 
+		con->alt_lines[j]->age = con->age_cnt;
 		for ( ; i < x; ++i)
 			screen_cell_init(con, &con->alt_lines[j]->cells[i]);
 	}
@@ -707,12 +2016,16 @@ int tsm_screen_resize(struct tsm_screen *con, unsigned int x,
 	 * We need to carefully look for the functions that we call here as they
 	 * have stronger invariants as when called normally. */
 
+	if (x != con->size_x)
+		sb_reflow_start(con);
+
 	con->size_x = x;
 	if (con->cursor_x >= con->size_x)
 		move_cursor(con, con->size_x - 1, con->cursor_y);
 
-	/* scroll buffer if screen height shrinks */
-	if (y < con->size_y) {
+	/* scroll buffer if screen height shrinks; the reflowed main screen
+	 * is laid out for the new height right away */
+	if (y < con->size_y && !(reflow && con->lines == con->main_lines)) {
 		diff = con->size_y - y;
 		screen_scroll_up(con, diff);
 		if (con->cursor_y > diff)
@@ -723,12 +2036,50 @@ int tsm_screen_resize(struct tsm_screen *con, unsigned int x,
 
 	con->size_y = y;
 	con->margin_bottom = con->size_y - 1;
+	if (reflow)
+		screen_reflow_restore(con, &rf);
 	if (con->cursor_y >= con->size_y)
 		move_cursor(con, con->cursor_x, con->size_y - 1);
 
 	return 0;
 }
 
+/* After the width of the screen changed, reflow up to @num of the scroll-back
+ * lines that still have the old width, newest first. Returns the number of
+ * lines that are left. */
+SHL_EXPORT
+unsigned int tsm_screen_sb_reflow(struct tsm_screen *con, unsigned int num)
+{
+	unsigned int done;
+	int r;
+
+	if (!con)
+		return 0;
+
+	for (done = 0; con->sb_old_count && done < num; done += r) {
+		r = sb_reflow_line(con);
+		if (r < 0)
+			break;
+	}
+	if (!done)
+		return con->sb_old_count;
+
+	/* rewrapped lines might not fit anymore, and those that were
+	 * compressed are compressed again */
+	while (con->sb_count > con->sb_max)
+		sb_drop(con);
+	while (screen_sb_compress(con))
+		;
+
+	if (con->sb_pos) {
+		screen_inc_age(con);
+		con->age = con->age_cnt;
+		screen_damage_all(con);
+	}
+
+	return con->sb_old_count;
+}
+
 SHL_EXPORT
 int tsm_screen_set_margins(struct tsm_screen *con,
 			       unsigned int top, unsigned int bottom)
@@ -762,50 +2113,66 @@ SHL_EXPORT
 void tsm_screen_set_max_sb(struct tsm_screen *con,
 			       unsigned int max)
 {
-	struct line *line;
-
 	if (!con)
 		return;
 
 	screen_inc_age(con);
 	/* TODO: more sophisticated ageing */
 	con->age = con->age_cnt;
+	screen_damage_all(con);
 
-	while (con->sb_count > max) {
-		line = con->sb_first;
-		con->sb_first = line->next;
-		if (line->next)
-			line->next->prev = NULL;
-		else
-			con->sb_last = NULL;
-		con->sb_count--;
+	while (con->sb_count > max)
+		sb_drop(con);
 
-		/* We treat fixed/unfixed position the same here because we
-		 * remove lines from the TOP of the scrollback buffer. */
-		if (con->sb_pos == line)
-			con->sb_pos = con->sb_first;
+	con->sb_max = max;
+}
 
-		if (con->sel_active) {
-			if (con->sel_start.line == line) {
-				con->sel_start.line = NULL;
-				con->sel_start.y = SELECTION_TOP;
-			}
-			if (con->sel_end.line == line) {
-				con->sel_end.line = NULL;
-				con->sel_end.y = SELECTION_TOP;
-			}
-		}
-		line_free(line);
+/* Keep lines that are dropped from the scroll-back buffer in a file instead,
+ * which makes the history unlimited, as far as the file system has room. Once
+ * it is full, lines are dropped as if there was no archive. Disabling it drops
+ * the archived lines. */
+SHL_EXPORT
+int tsm_screen_set_sb_archive(struct tsm_screen *con, bool enable)
+{
+	int r;
+
+	if (!con)
+		return -EINVAL;
+
+	if (enable) {
+		r = screen_sb_archive_new(con);
+		if (r)
+			return r;
+	} else if (con->sb_arch) {
+		screen_inc_age(con);
+		con->age = con->age_cnt;
+		screen_damage_all(con);
+
+		if (con->sb_pos == &con->sb_arch_line)
+			con->sb_pos = con->sb_count ? screen_sb_line(con, 0) :
+						      NULL;
+		screen_sb_archive_free(con);
 	}
 
-	con->sb_max = max;
+	return 0;
+}
+
+/* Compress scroll-back lines once @hot newer lines follow them. 0 disables
+ * compression of further lines, which is the default. */
+SHL_EXPORT
+void tsm_screen_set_sb_compress(struct tsm_screen *con, unsigned int hot)
+{
+	if (!con)
+		return;
+
+	con->sb_hot = hot;
 }
 
 /* clear scrollback buffer */
 SHL_EXPORT
 void tsm_screen_clear_sb(struct tsm_screen *con)
 {
-	struct line *iter, *tmp;
+	unsigned int i;
 
 	if (!con)
 		return;
@@ -813,16 +2180,23 @@ void tsm_screen_clear_sb(struct tsm_screen *con)
 	screen_inc_age(con);
 	/* TODO: more sophisticated ageing */
 	con->age = con->age_cnt;
+	screen_damage_all(con);
 
-	for (iter = con->sb_first; iter; ) {
-		tmp = iter;
-		iter = iter->next;
-		line_free(tmp);
+	for (i = 0; i < con->sb_count; ++i) {
+		screen_sb_release(con, screen_sb_line(con, i));
+		line_free(con, screen_sb_line(con, i));
 	}
+	sb_chunk_unref(con->sb_chunk);
+	con->sb_chunk = NULL;
+
+	screen_sb_archive_clear(con);
 
-	con->sb_first = NULL;
-	con->sb_last = NULL;
+	free(con->sb_old_lines);
+	con->sb_old_lines = NULL;
+	con->sb_old_count = 0;
+	con->sb_head = 0;
 	con->sb_count = 0;
+	con->sb_cold = 0;
 	con->sb_pos = NULL;
 
 	if (con->sel_active) {
@@ -837,46 +2211,103 @@ void tsm_screen_clear_sb(struct tsm_screen *con)
 	}
 }
 
+/*
+ * The scroll-back position is the number of the line shown at the top of the
+ * screen, counting the oldest archived line, or the oldest line of the
+ * scroll-back buffer if there is no archive, as 0. When the buffer is not
+ * shown, it is the number of lines in the archive and the buffer.
+ */
+static unsigned int sb_get_total(struct tsm_screen *con)
+{
+	return screen_sb_archive_count(con) + con->sb_count;
+}
+
+static unsigned int sb_get_pos(struct tsm_screen *con)
+{
+	if (!con->sb_pos)
+		return sb_get_total(con);
+	if (con->sb_pos == &con->sb_arch_line)
+		return con->sb_arch_top;
+
+	return screen_sb_archive_count(con) + screen_sb_index(con, con->sb_pos);
+}
+
+static void sb_set_pos(struct tsm_screen *con, unsigned int pos)
+{
+	unsigned int arch = screen_sb_archive_count(con);
+
+	if (pos < arch) {
+		con->sb_pos = &con->sb_arch_line;
+		con->sb_arch_top = pos;
+	} else if (pos - arch < con->sb_count) {
+		con->sb_pos = screen_sb_line(con, pos - arch);
+	} else {
+		con->sb_pos = NULL;
+	}
+}
+
+SHL_EXPORT
+unsigned int tsm_screen_sb_get_pos(struct tsm_screen *con)
+{
+	if (!con)
+		return 0;
+
+	return sb_get_pos(con);
+}
+
+SHL_EXPORT
+void tsm_screen_sb_set_pos(struct tsm_screen *con, unsigned int pos)
+{
+	if (!con)
+		return;
+
+	if (pos > sb_get_total(con))
+		pos = sb_get_total(con);
+	if (pos == sb_get_pos(con))
+		return;
+
+	screen_inc_age(con);
+	con->age = con->age_cnt;
+	screen_damage_all(con);
+
+	sb_set_pos(con, pos);
+}
+
 SHL_EXPORT
 void tsm_screen_sb_up(struct tsm_screen *con, unsigned int num)
 {
+	unsigned int pos;
+
 	if (!con || !num)
 		return;
 
 	screen_inc_age(con);
 	/* TODO: more sophisticated ageing */
 	con->age = con->age_cnt;
+	screen_damage_all(con);
 
-	while (num--) {
-		if (con->sb_pos) {
-			if (!con->sb_pos->prev)
-				return;
-
-			con->sb_pos = con->sb_pos->prev;
-		} else if (!con->sb_last) {
-			return;
-		} else {
-			con->sb_pos = con->sb_last;
-		}
-	}
+	pos = sb_get_pos(con);
+	sb_set_pos(con, pos > num ? pos - num : 0);
 }
 
 SHL_EXPORT
 void tsm_screen_sb_down(struct tsm_screen *con, unsigned int num)
 {
+	unsigned int pos;
+
 	if (!con || !num)
 		return;
 
 	screen_inc_age(con);
 	/* TODO: more sophisticated ageing */
 	con->age = con->age_cnt;
+	screen_damage_all(con);
 
-	while (num--) {
-		if (con->sb_pos)
-			con->sb_pos = con->sb_pos->next;
-		else
-			return;
-	}
+	pos = sb_get_pos(con);
+	if (num < sb_get_total(con) - pos)
+		sb_set_pos(con, pos + num);
+	else
+		sb_set_pos(con, sb_get_total(con));
 }
 
 SHL_EXPORT
@@ -908,6 +2339,7 @@ void tsm_screen_sb_reset(struct tsm_screen *con)
 	screen_inc_age(con);
 	/* TODO: more sophisticated ageing */
 	con->age = con->age_cnt;
+	screen_damage_all(con);
 
 	con->sb_pos = NULL;
 }
@@ -920,6 +2352,7 @@ void tsm_screen_set_def_attr(struct tsm_screen *con,
 		return;
 
 	memcpy(&con->def_attr, attr, sizeof(*attr));
+	con->def_attr_id = screen_attr_intern(con, &con->def_attr);
 }
 
 SHL_EXPORT
@@ -932,6 +2365,7 @@ void tsm_screen_reset(struct tsm_screen *con)
 
 	screen_inc_age(con);
 	con->age = con->age_cnt;
+	screen_damage_all(con);
 
 	con->flags = 0;
 	con->margin_top = 0;
@@ -950,7 +2384,6 @@ SHL_EXPORT
 void tsm_screen_set_flags(struct tsm_screen *con, unsigned int flags)
 {
 	unsigned int old;
-	struct cell *c;
 
 	if (!con || !flags)
 		return;
@@ -962,24 +2395,26 @@ void tsm_screen_set_flags(struct tsm_screen *con, unsigned int flags)
 
 	if (!(old & TSM_SCREEN_ALTERNATE) && (flags & TSM_SCREEN_ALTERNATE)) {
 		con->age = con->age_cnt;
+		screen_damage_all(con);
 		con->lines = con->alt_lines;
 	}
 
 	if (!(old & TSM_SCREEN_HIDE_CURSOR) &&
 	    (flags & TSM_SCREEN_HIDE_CURSOR)) {
-		c = get_cursor_cell(con);
-		c->age = con->age_cnt;
+		get_cursor_line(con)->age = con->age_cnt;
+		screen_damage_cursor(con);
 	}
 
-	if (!(old & TSM_SCREEN_INVERSE) && (flags & TSM_SCREEN_INVERSE))
+	if (!(old & TSM_SCREEN_INVERSE) && (flags & TSM_SCREEN_INVERSE)) {
 		con->age = con->age_cnt;
+		screen_damage_all(con);
+	}
 }
 
 SHL_EXPORT
 void tsm_screen_reset_flags(struct tsm_screen *con, unsigned int flags)
 {
 	unsigned int old;
-	struct cell *c;
 
 	if (!con || !flags)
 		return;
@@ -991,17 +2426,20 @@ void tsm_screen_reset_flags(struct tsm_screen *con, unsigned int flags)
 
 	if ((old & TSM_SCREEN_ALTERNATE) && (flags & TSM_SCREEN_ALTERNATE)) {
 		con->age = con->age_cnt;
+		screen_damage_all(con);
 		con->lines = con->main_lines;
 	}
 
 	if ((old & TSM_SCREEN_HIDE_CURSOR) &&
 	    (flags & TSM_SCREEN_HIDE_CURSOR)) {
-		c = get_cursor_cell(con);
-		c->age = con->age_cnt;
+		get_cursor_line(con)->age = con->age_cnt;
+		screen_damage_cursor(con);
 	}
 
-	if ((old & TSM_SCREEN_INVERSE) && (flags & TSM_SCREEN_INVERSE))
+	if ((old & TSM_SCREEN_INVERSE) && (flags & TSM_SCREEN_INVERSE)) {
 		con->age = con->age_cnt;
+		screen_damage_all(con);
+	}
 }
 
 SHL_EXPORT
@@ -1013,6 +2451,36 @@ unsigned int tsm_screen_get_flags(struct tsm_screen *con)
 	return con->flags;
 }
 
+/*
+ * Draw callbacks can ask for the id of the attributes of the cell they are
+ * drawing, see tsm_screen_get_draw_attr_id(), so renderers can cache what they
+ * derive from them. The ids are only renumbered when the table is compacted,
+ * which changes the value returned here.
+ */
+SHL_EXPORT
+unsigned int tsm_screen_get_attr_generation(struct tsm_screen *con)
+{
+	if (!con)
+		return 0;
+
+	return con->attr_gen;
+}
+
+/*
+ * Only meaningful inside a draw callback: the id in the attribute table of the
+ * cell that is being drawn. The attributes passed to the callback may differ
+ * from the table entry in their inverse flag (cursor, selection, inverse
+ * screen), but in nothing else.
+ */
+SHL_EXPORT
+unsigned int tsm_screen_get_draw_attr_id(struct tsm_screen *con)
+{
+	if (!con)
+		return 0;
+
+	return con->draw_attr;
+}
+
 SHL_EXPORT
 unsigned int tsm_screen_get_cursor_x(struct tsm_screen *con)
 {
@@ -1061,20 +2529,10 @@ void tsm_screen_reset_all_tabstops(struct tsm_screen *con)
 		con->tab_ruler[i] = false;
 }
 
-SHL_EXPORT
-void tsm_screen_write(struct tsm_screen *con, tsm_symbol_t ch,
-			  const struct tsm_screen_attr *attr)
+/* perform pending line-wrap and scrolling before writing at the cursor */
+static void screen_write_prepare(struct tsm_screen *con)
 {
-	unsigned int last, len;
-
-	if (!con)
-		return;
-
-	len = tsm_symbol_get_width(con->sym_table, ch);
-	if (!len)
-		return;
-
-	screen_inc_age(con);
+	unsigned int last;
 
 	if (con->cursor_y <= con->margin_bottom ||
 	    con->cursor_y >= con->size_y)
@@ -1083,21 +2541,112 @@ void tsm_screen_write(struct tsm_screen *con, tsm_symbol_t ch,
 		last = con->size_y - 1;
 
 	if (con->cursor_x >= con->size_x) {
-		if (con->flags & TSM_SCREEN_AUTO_WRAP)
+		if (con->flags & TSM_SCREEN_AUTO_WRAP) {
+			/* remember the soft wrap for reflowing the text */
+			get_cursor_line(con)->wrapped = true;
 			move_cursor(con, 0, con->cursor_y + 1);
-		else
+		} else {
 			move_cursor(con, con->size_x - 1, con->cursor_y);
+		}
 	}
 
 	if (con->cursor_y > last) {
 		move_cursor(con, con->cursor_x, last);
 		screen_scroll_up(con, 1);
 	}
+}
+
+SHL_EXPORT
+void tsm_screen_write(struct tsm_screen *con, tsm_symbol_t ch,
+			  const struct tsm_screen_attr *attr)
+{
+	unsigned int len;
+
+	if (!con)
+		return;
+
+	len = tsm_symbol_get_width(con->sym_table, ch);
+	if (!len)
+		return;
 
+	screen_inc_age(con);
+
+	screen_write_prepare(con);
 	screen_write(con, con->cursor_x, con->cursor_y, ch, len, attr);
 	move_cursor(con, con->cursor_x + len, con->cursor_y);
 }
 
+/*
+ * Write a run of symbols which share the same attributes. The result is the
+ * same as calling tsm_screen_write() for each symbol, but line-wrapping and
+ * scrolling are only handled once per line segment and the cells of a segment
+ * are filled in a single loop. All cells of a run share the same age.
+ */
+SHL_EXPORT
+void tsm_screen_write_run(struct tsm_screen *con, const tsm_symbol_t *syms,
+			  size_t num, const struct tsm_screen_attr *attr)
+{
+	struct line *line;
+	struct cell *cell;
+	unsigned int x, len, i;
+	size_t pos;
+	uint16_t id;
+
+	if (!con || !syms || !attr || !num)
+		return;
+
+	screen_inc_age(con);
+	id = screen_attr_intern(con, attr);
+
+	pos = 0;
+	while (pos < num) {
+		len = tsm_symbol_get_width(con->sym_table, syms[pos]);
+		if (!len) {
+			++pos;
+			continue;
+		}
+
+		screen_write_prepare(con);
+
+		/* insert-mode shifts the line for every symbol so there is
+		 * nothing to gain; write it the slow way */
+		if ((con->flags & TSM_SCREEN_INSERT_MODE) ||
+		    con->cursor_y >= con->size_y) {
+			screen_write(con, con->cursor_x, con->cursor_y,
+				     syms[pos], len, attr);
+			move_cursor(con, con->cursor_x + len, con->cursor_y);
+			++pos;
+			continue;
+		}
+
+		line = con->lines[con->cursor_y];
+		line->age = con->age_cnt;
+		x = con->cursor_x;
+		while (1) {
+			cell = &line->cells[x];
+			cell->ch = syms[pos];
+			cell->width = len;
+			cell->attr = id;
+			for (i = 1; i < len && x + i < con->size_x; ++i)
+				cell[i].width = 0;
+			x += len;
+
+			/* skip zero-width symbols like tsm_screen_write() */
+			for (++pos; pos < num; ++pos) {
+				len = tsm_symbol_get_width(con->sym_table,
+							   syms[pos]);
+				if (len)
+					break;
+			}
+			if (pos >= num || x >= con->size_x)
+				break;
+		}
+
+		screen_damage(con, con->cursor_x, x - 1, con->cursor_y);
+		move_cursor(con, x, con->cursor_y);
+	}
+}
+
 SHL_EXPORT
 void tsm_screen_newline(struct tsm_screen *con)
 {
@@ -1345,8 +2894,6 @@ void tsm_screen_insert_lines(struct tsm_screen *con, unsigned int num)
 		return;
 
 	screen_inc_age(con);
-	/* TODO: more sophisticated ageing */
-	con->age = con->age_cnt;
 
 	max = con->margin_bottom - con->cursor_y + 1;
 	if (num > max)
@@ -1358,6 +2905,7 @@ void tsm_screen_insert_lines(struct tsm_screen *con, unsigned int num)
 		cache[i] = con->lines[con->margin_bottom - i];
 		for (j = 0; j < con->size_x; ++j)
 			screen_cell_init(con, &cache[i]->cells[j]);
+		cache[i]->wrapped = false;
 	}
 
 	if (num < max) {
@@ -1369,6 +2917,10 @@ void tsm_screen_insert_lines(struct tsm_screen *con, unsigned int num)
 		       cache, num * sizeof(struct line*));
 	}
 
+	for (i = con->cursor_y; i <= con->margin_bottom; ++i)
+		con->lines[i]->age = con->age_cnt;
+	screen_damage_rows(con, con->cursor_y, con->margin_bottom);
+
 	con->cursor_x = 0;
 }
 
@@ -1385,8 +2937,6 @@ void tsm_screen_delete_lines(struct tsm_screen *con, unsigned int num)
 		return;
 
 	screen_inc_age(con);
-	/* TODO: more sophisticated ageing */
-	con->age = con->age_cnt;
 
 	max = con->margin_bottom - con->cursor_y + 1;
 	if (num > max)
@@ -1398,6 +2948,7 @@ void tsm_screen_delete_lines(struct tsm_screen *con, unsigned int num)
 		cache[i] = con->lines[con->cursor_y + i];
 		for (j = 0; j < con->size_x; ++j)
 			screen_cell_init(con, &cache[i]->cells[j]);
+		cache[i]->wrapped = false;
 	}
 
 	if (num < max) {
@@ -1409,6 +2960,10 @@ void tsm_screen_delete_lines(struct tsm_screen *con, unsigned int num)
 		       cache, num * sizeof(struct line*));
 	}
 
+	for (i = con->cursor_y; i <= con->margin_bottom; ++i)
+		con->lines[i]->age = con->age_cnt;
+	screen_damage_rows(con, con->cursor_y, con->margin_bottom);
+
 	con->cursor_x = 0;
 }
 
@@ -1422,8 +2977,6 @@ void tsm_screen_insert_chars(struct tsm_screen *con, unsigned int num)
 		return;
 
 	screen_inc_age(con);
-	/* TODO: more sophisticated ageing */
-	con->age = con->age_cnt;
 
 	if (con->cursor_x >= con->size_x)
 		con->cursor_x = con->size_x - 1;
@@ -1435,6 +2988,9 @@ void tsm_screen_insert_chars(struct tsm_screen *con, unsigned int num)
 		num = max;
 	mv = max - num;
 
+	con->lines[con->cursor_y]->age = con->age_cnt;
+	screen_damage(con, con->cursor_x, con->size_x - 1, con->cursor_y);
+
 	cells = con->lines[con->cursor_y]->cells;
 	if (mv)
 		memmove(&cells[con->cursor_x + num],
@@ -1455,8 +3011,6 @@ void tsm_screen_delete_chars(struct tsm_screen *con, unsigned int num)
 		return;
 
 	screen_inc_age(con);
-	/* TODO: more sophisticated ageing */
-	con->age = con->age_cnt;
 
 	if (con->cursor_x >= con->size_x)
 		con->cursor_x = con->size_x - 1;
@@ -1468,6 +3022,9 @@ void tsm_screen_delete_chars(struct tsm_screen *con, unsigned int num)
 		num = max;
 	mv = max - num;
 
+	con->lines[con->cursor_y]->age = con->age_cnt;
+	screen_damage(con, con->cursor_x, con->size_x - 1, con->cursor_y);
+
 	cells = con->lines[con->cursor_y]->cells;
 	if (mv)
 		memmove(&cells[con->cursor_x],
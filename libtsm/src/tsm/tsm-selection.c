@@ -65,13 +65,26 @@ static void selection_set(struct tsm_screen *con, struct selection_pos *sel,
 			  unsigned int x, unsigned int y)
 {
 	struct line *pos;
+	unsigned int num;
 
 	sel->line = NULL;
 	pos = con->sb_pos;
 
+	/* archived lines cannot be selected; they count as the top */
+	if (pos == &con->sb_arch_line) {
+		num = screen_sb_archive_count(con) - con->sb_arch_top;
+		if (y < num) {
+			sel->x = 0;
+			sel->y = SELECTION_TOP;
+			return;
+		}
+		y -= num;
+		pos = con->sb_count ? screen_sb_line(con, 0) : NULL;
+	}
+
 	while (y && pos) {
 		--y;
-		pos = pos->next;
+		pos = screen_sb_next(con, pos);
 	}
 
 	if (pos)
@@ -90,6 +103,7 @@ void tsm_screen_selection_reset(struct tsm_screen *con)
 	screen_inc_age(con);
 	/* TODO: more sophisticated ageing */
 	con->age = con->age_cnt;
+	screen_damage_all(con);
 
 	con->sel_active = false;
 }
@@ -105,6 +119,7 @@ void tsm_screen_selection_start(struct tsm_screen *con,
 	screen_inc_age(con);
 	/* TODO: more sophisticated ageing */
 	con->age = con->age_cnt;
+	screen_damage_all(con);
 
 	con->sel_active = true;
 	selection_set(con, &con->sel_start, posx, posy);
@@ -122,6 +137,7 @@ void tsm_screen_selection_target(struct tsm_screen *con,
 	screen_inc_age(con);
 	/* TODO: more sophisticated ageing */
 	con->age = con->age_cnt;
+	screen_damage_all(con);
 
 	selection_set(con, &con->sel_end, posx, posy);
 }
@@ -129,29 +145,36 @@ void tsm_screen_selection_target(struct tsm_screen *con,
 /* TODO: tsm_ucs4_to_utf8 expects UCS4 characters, but a cell contains a
  * tsm-symbol (which can contain multiple UCS4 chars). Fix this when introducing
  * support for combining characters. */
-static unsigned int copy_line(struct line *line, char *buf,
-			      unsigned int start, unsigned int len)
+static unsigned int copy_line(struct tsm_screen *con, struct line *line,
+			      char *buf, unsigned int start, unsigned int len)
 {
-	unsigned int i, end;
+	unsigned int i, end, size;
 	char *pos = buf;
 
+	/* cells past the end of a line are blank, like tsm_screen_draw() shows
+	 * them; so is a compressed line that cannot be unpacked */
+	size = screen_line_load(con, line) ? 0 : line->size;
+
 	end = start + len;
-	for (i = start; i < line->size && i < end; ++i) {
-		if (i < line->size || !line->cells[i].ch)
-			pos += tsm_ucs4_to_utf8(line->cells[i].ch, pos);
-		else
-			pos += tsm_ucs4_to_utf8(' ', pos);
-	}
+	for (i = start; i < end; ++i)
+		pos += tsm_ucs4_to_utf8(i < size ? line->cells[i].ch : 0, pos);
 
 	return pos - buf;
 }
 
+/* Scroll-back lines do not store their trailing blank cells, but they are
+ * shown as wide as the screen, so they are copied that way. */
+static unsigned int line_width(struct tsm_screen *con, struct line *line)
+{
+	return line->size > con->size_x ? line->size : con->size_x;
+}
+
 /* TODO: This beast definitely needs some "beautification", however, it's meant
  * as a "proof-of-concept" so its enough for now. */
 SHL_EXPORT
 int tsm_screen_selection_copy(struct tsm_screen *con, char **out)
 {
-	unsigned int len, i;
+	unsigned int len, i, width;
 	struct selection_pos *start, *end;
 	struct line *iter;
 	char *str, *pos;
@@ -214,32 +237,33 @@ int tsm_screen_selection_copy(struct tsm_screen *con, char **out)
 	len = 0;
 	iter = start->line;
 	if (!iter && start->y == SELECTION_TOP)
-		iter = con->sb_first;
+		iter = con->sb_count ? screen_sb_line(con, 0) : NULL;
 
 	while (iter) {
+		width = line_width(con, iter);
 		if (iter == start->line && iter == end->line) {
-			if (iter->size > start->x) {
-				if (iter->size > end->x)
+			if (width > start->x) {
+				if (width > end->x)
 					len += end->x - start->x + 1;
 				else
-					len += iter->size - start->x;
+					len += width - start->x;
 			}
 			break;
 		} else if (iter == start->line) {
-			if (iter->size > start->x)
-				len += iter->size - start->x;
+			if (width > start->x)
+				len += width - start->x;
 		} else if (iter == end->line) {
-			if (iter->size > end->x)
+			if (width > end->x)
 				len += end->x + 1;
 			else
-				len += iter->size;
+				len += width;
 			break;
 		} else {
-			len += iter->size;
+			len += width;
 		}
 
 		++len;
-		iter = iter->next;
+		iter = screen_sb_next(con, iter);
 	}
 
 	if (!end->line) {
@@ -284,35 +308,38 @@ int tsm_screen_selection_copy(struct tsm_screen *con, char **out)
 	/* copy data into buffer */
 	iter = start->line;
 	if (!iter && start->y == SELECTION_TOP)
-		iter = con->sb_first;
+		iter = con->sb_count ? screen_sb_line(con, 0) : NULL;
 
 	while (iter) {
+		width = line_width(con, iter);
 		if (iter == start->line && iter == end->line) {
-			if (iter->size > start->x) {
-				if (iter->size > end->x)
+			if (width > start->x) {
+				if (width > end->x)
 					len = end->x - start->x + 1;
 				else
-					len = iter->size - start->x;
-				pos += copy_line(iter, pos, start->x, len);
+					len = width - start->x;
+				pos += copy_line(con, iter, pos, start->x, len);
 			}
 			break;
 		} else if (iter == start->line) {
-			if (iter->size > start->x)
-				pos += copy_line(iter, pos, start->x,
-						 iter->size - start->x);
+			if (width > start->x)
+				pos += copy_line(con, iter, pos, start->x,
+						      width - start->x);
 		} else if (iter == end->line) {
-			if (iter->size > end->x)
+			if (width > end->x)
 				len = end->x + 1;
 			else
-				len = iter->size;
-			pos += copy_line(iter, pos, 0, len);
+				len = width;
+			pos += copy_line(con, iter, pos, 0, len);
 			break;
 		} else {
-			pos += copy_line(iter, pos, 0, iter->size);
+			pos += copy_line(con, iter, pos, 0, width);
 		}
 
-		*pos++ = '\n';
-		iter = iter->next;
+		/* soft-wrapped lines are joined again */
+		if (!iter->wrapped)
+			*pos++ = '\n';
+		iter = screen_sb_next(con, iter);
 	}
 
 	if (!end->line) {
@@ -328,25 +355,26 @@ int tsm_screen_selection_copy(struct tsm_screen *con, char **out)
 						len = end->x - start->x + 1;
 					else
 						len = con->size_x - start->x;
-					pos += copy_line(iter, pos, start->x, len);
+					pos += copy_line(con, iter, pos, start->x, len);
 				}
 				break;
 			} else if (!start->line && start->y == i) {
 				if (con->size_x > start->x)
-					pos += copy_line(iter, pos, start->x,
-							 con->size_x - start->x);
+					pos += copy_line(con, iter, pos, start->x,
+							      con->size_x - start->x);
 			} else if (end->y == i) {
 				if (con->size_x > end->x)
 					len = end->x + 1;
 				else
 					len = con->size_x;
-				pos += copy_line(iter, pos, 0, len);
+				pos += copy_line(con, iter, pos, 0, len);
 				break;
 			} else {
-				pos += copy_line(iter, pos, 0, con->size_x);
+				pos += copy_line(con, iter, pos, 0, con->size_x);
 			}
 
-			*pos++ = '\n';
+			if (!iter->wrapped)
+				*pos++ = '\n';
 		}
 	}
 
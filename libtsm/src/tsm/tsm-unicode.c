@@ -63,6 +63,16 @@
 #include "shl-array.h"
 #include "shl-htable.h"
 
+/* The SSSE3 and AVX2 decoders are built regardless of the compiler flags and
+ * picked at run time; SSE2 is part of the x86-64 baseline. */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#  include <immintrin.h>
+#  define UTF8_X86_DISPATCH 1
+#  define utf8_target_(_t) __attribute__((__target__(_t)))
+#elif defined(__SSE2__)
+#  include <emmintrin.h>
+#endif
+
 /*
  * Unicode Symbol Handling
  * The main goal of the tsm_symbol_* functions is to provide a datatype which
@@ -444,6 +454,8 @@ char *tsm_ucs4_to_utf8_alloc(const uint32_t *ucs4, size_t len, size_t *len_out)
  * tsm_utf8_mach_get(): Returns the last parsed character. It has no effect on
  * the state machine so you can call it multiple times.
  *
+ * tsm_utf8_mach_decode(): Block decoder, see below.
+ *
  * Internally, we use TSM_UTF8_START whenever the state-machine is reset. This
  * can be used to ignore the last read input or to simply reset the machine.
  * TSM_UTF8_EXPECT* is used to remember how many bytes are still to be read to
@@ -579,3 +591,471 @@ void tsm_utf8_mach_reset(struct tsm_utf8_mach *mach)
 
 	mach->state = TSM_UTF8_START;
 }
+
+/*
+ * UTF8 Block Decoder
+ * tsm_utf8_mach_decode() decodes a whole block of UTF8 input at once. It
+ * produces exactly the same UCS4 stream as feeding each byte into
+ * tsm_utf8_mach_feed() and reading tsm_utf8_mach_get() on every ACCEPT or
+ * REJECT, including all replacement characters. The machine keeps the state of
+ * sequences which are split across blocks.
+ *
+ * @num must contain the size of @out and is set to the number of decoded
+ * characters on return. Decoding stops when the input is exhausted, when @out
+ * is full or right after a control character (C0, DEL or C1) was decoded, as
+ * those might change how the following input has to be interpreted. The number
+ * of consumed bytes is returned.
+ *
+ * While the machine is idle, runs of printable ASCII are widened with SSE2 or
+ * AVX2, and with SSSE3, utf8_decode_block() validates and decodes mixed text
+ * 16 bytes at a time, see below. Only what is left at the end of the input or
+ * in front of invalid bytes is decoded one sequence at a time by
+ * utf8_decode_seq(), and partial or invalid sequences go through the byte-wise
+ * machine. tsm_utf8_mach_decode_ref() is the plain byte-wise reference
+ * implementation with the same interface.
+ *
+ * On x86 the AVX2 and SSSE3 paths are used if the CPU supports them; tests can
+ * turn them off with tsm_utf8_set_simd() to check the scalar path, too.
+ */
+
+#if defined(UTF8_X86_DISPATCH)
+
+static bool utf8_avx2;
+static bool utf8_ssse3;
+
+__attribute__((__constructor__))
+static void utf8_cpu_init(void)
+{
+	tsm_utf8_set_simd(true);
+}
+
+bool tsm_utf8_set_simd(bool enable)
+{
+	__builtin_cpu_init();
+	utf8_avx2 = enable && __builtin_cpu_supports("avx2");
+	utf8_ssse3 = enable && __builtin_cpu_supports("ssse3");
+
+	return utf8_avx2 || utf8_ssse3;
+}
+
+#else
+
+bool tsm_utf8_set_simd(bool enable)
+{
+	return false;
+}
+
+#endif
+
+static inline bool utf8_is_idle(const struct tsm_utf8_mach *mach)
+{
+	return mach->state == TSM_UTF8_START ||
+	       mach->state == TSM_UTF8_ACCEPT ||
+	       mach->state == TSM_UTF8_REJECT;
+}
+
+#if defined(UTF8_X86_DISPATCH)
+
+/* utf8_decode_ascii() for blocks of 32 bytes */
+utf8_target_("avx2")
+static size_t utf8_decode_ascii_avx2(const unsigned char *u8, size_t len,
+				     uint32_t *out)
+{
+	const __m256i lo32 = _mm256_set1_epi8(0x20);
+	const __m256i del32 = _mm256_set1_epi8(0x7f);
+	__m256i v32;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		v32 = _mm256_loadu_si256((const __m256i*)&u8[i]);
+		if (_mm256_movemask_epi8(_mm256_or_si256(
+				_mm256_cmpgt_epi8(lo32, v32),
+				_mm256_cmpeq_epi8(v32, del32))))
+			break;
+
+		_mm256_storeu_si256((__m256i*)&out[i],
+			_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)&u8[i])));
+		_mm256_storeu_si256((__m256i*)&out[i + 8],
+			_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)&u8[i + 8])));
+		_mm256_storeu_si256((__m256i*)&out[i + 16],
+			_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)&u8[i + 16])));
+		_mm256_storeu_si256((__m256i*)&out[i + 24],
+			_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)&u8[i + 24])));
+	}
+
+	return i;
+}
+
+#endif
+
+/* convert the leading printable ASCII (0x20-0x7e) of @u8 to UCS4 */
+static size_t utf8_decode_ascii(const unsigned char *u8, size_t len,
+				uint32_t *out)
+{
+	size_t i = 0;
+
+	/* Signed byte comparison against 0x20 catches both 0x00-0x1f and
+	 * 0x80-0xff, so only DEL needs an extra test. */
+#if defined(UTF8_X86_DISPATCH)
+	if (utf8_avx2 && len >= 32)
+		i = utf8_decode_ascii_avx2(u8, len, out);
+#endif
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i lo = _mm_set1_epi8(0x20);
+	const __m128i del = _mm_set1_epi8(0x7f);
+	__m128i v, w;
+
+	for ( ; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i*)&u8[i]);
+		if (_mm_movemask_epi8(_mm_or_si128(_mm_cmplt_epi8(v, lo),
+						   _mm_cmpeq_epi8(v, del))))
+			break;
+
+		w = _mm_unpacklo_epi8(v, zero);
+		_mm_storeu_si128((__m128i*)&out[i],
+				 _mm_unpacklo_epi16(w, zero));
+		_mm_storeu_si128((__m128i*)&out[i + 4],
+				 _mm_unpackhi_epi16(w, zero));
+		w = _mm_unpackhi_epi8(v, zero);
+		_mm_storeu_si128((__m128i*)&out[i + 8],
+				 _mm_unpacklo_epi16(w, zero));
+		_mm_storeu_si128((__m128i*)&out[i + 12],
+				 _mm_unpackhi_epi16(w, zero));
+	}
+#endif
+
+	for ( ; i < len; ++i) {
+		if (u8[i] < 0x20 || u8[i] >= 0x7f)
+			break;
+		out[i] = u8[i];
+	}
+
+	return i;
+}
+
+/* Decode one complete multi-byte sequence. Returns its length or 0 if it is
+ * truncated or malformed and needs to go through the byte-wise machine. */
+static size_t utf8_decode_seq(const unsigned char *u8, size_t len,
+			      uint32_t *out)
+{
+	uint32_t ch;
+	size_t i, num;
+
+	/* 0xc0 and 0xc1 are left to tsm_utf8_mach_feed() as its handling of
+	 * them depends on the signedness of "char". */
+	if (u8[0] >= 0xc2 && u8[0] <= 0xdf) {
+		ch = u8[0] & 0x1f;
+		num = 2;
+	} else if ((u8[0] & 0xf0) == 0xe0) {
+		ch = u8[0] & 0x0f;
+		num = 3;
+	} else if ((u8[0] & 0xf8) == 0xf0) {
+		ch = u8[0] & 0x07;
+		num = 4;
+	} else {
+		return 0;
+	}
+
+	if (num > len)
+		return 0;
+
+	for (i = 1; i < num; ++i) {
+		if ((u8[i] & 0xc0) != 0x80)
+			return 0;
+		ch = (ch << 6) | (u8[i] & 0x3f);
+	}
+
+	*out = ch;
+	return num;
+}
+
+#if defined(UTF8_X86_DISPATCH)
+
+/*
+ * Block decoding
+ * A lookup of the high nibble of each byte of a 16-byte block gives the length
+ * of the sequence it starts: 1 for ASCII, 2 to 4 for lead bytes and 0 for
+ * continuation bytes. From those, bit masks tell which bytes have to be
+ * continuation bytes; the block is valid up to the first byte where that does
+ * not match, or where a lead byte is one the machine rejects (0xc0, 0xc1 and
+ * 0xf8 to 0xff). Just like the machine, nothing else is checked: overlong
+ * forms, surrogates and values above U+10FFFF are decoded, too.
+ *
+ * The valid part is decoded four sequences at a time. A second lookup strips
+ * the length bits off every byte. A shuffle gathers the bytes of each sequence
+ * into its own 32-bit lane, last byte lowest, so the payload of byte k is
+ * shifted into place by 6 * k bits in all lanes at once.
+ *
+ * Control characters stop the decoder like everywhere else; lanes are checked
+ * for them after decoding, as overlong forms and C2 80 to C2 9F produce them
+ * as well.
+ */
+
+static inline unsigned int utf8_ctz(unsigned int v)
+{
+	return __builtin_ctz(v);
+}
+
+static inline unsigned int utf8_last_bit(unsigned int v)
+{
+	return 31 - __builtin_clz(v);
+}
+
+/* Shuffle control that moves the sequences starting at @s[0] to @s[3] and
+ * ending in front of @s[1] to @s[4] into one lane each, last byte lowest. */
+utf8_target_("ssse3")
+static inline __m128i utf8_gather(const unsigned int *s)
+{
+	const __m128i byte = _mm_setr_epi8(0, 1, 2, 3, 0, 1, 2, 3,
+					   0, 1, 2, 3, 0, 1, 2, 3);
+	__m128i end, len;
+
+	/* byte k of lane j is at s[j + 1] - 1 - k, or 0 past the lead byte */
+	end = _mm_setr_epi32((s[1] - 1) * 0x01010101u,
+			     (s[2] - 1) * 0x01010101u,
+			     (s[3] - 1) * 0x01010101u,
+			     (s[4] - 1) * 0x01010101u);
+	len = _mm_setr_epi32((s[1] - s[0]) * 0x01010101u,
+			     (s[2] - s[1]) * 0x01010101u,
+			     (s[3] - s[2]) * 0x01010101u,
+			     (s[4] - s[3]) * 0x01010101u);
+	return _mm_or_si128(_mm_sub_epi8(end, byte),
+			    _mm_andnot_si128(_mm_cmpgt_epi8(len, byte),
+					     _mm_set1_epi8((char)0x80)));
+}
+
+/* Decode the 4 sequences that @ctl gathers from the masked block @v. Returns a
+ * bit for each control character. */
+utf8_target_("ssse3")
+static inline unsigned int utf8_decode4(__m128i v, __m128i ctl, uint32_t *out)
+{
+	__m128i cp, c0, c1;
+
+	v = _mm_shuffle_epi8(v, ctl);
+	cp = _mm_or_si128(
+		_mm_or_si128(_mm_and_si128(v, _mm_set1_epi32(0xff)),
+			     _mm_srli_epi32(_mm_and_si128(v,
+					_mm_set1_epi32(0xff00)), 2)),
+		_mm_or_si128(_mm_srli_epi32(_mm_and_si128(v,
+					_mm_set1_epi32(0xff0000)), 4),
+			     _mm_srli_epi32(_mm_and_si128(v,
+					_mm_set1_epi32(0xff000000)), 6)));
+	_mm_storeu_si128((__m128i*)out, cp);
+
+	/* C0, DEL and C1, see tsm_ucs4_is_control() */
+	c0 = _mm_cmplt_epi32(cp, _mm_set1_epi32(0x20));
+	c1 = _mm_and_si128(_mm_cmpgt_epi32(cp, _mm_set1_epi32(0x7e)),
+			   _mm_cmplt_epi32(cp, _mm_set1_epi32(0xa0)));
+	return _mm_movemask_ps(_mm_castsi128_ps(_mm_or_si128(c0, c1)));
+}
+
+/* Decode complete sequences of @u8 16 bytes at a time. Stops at the last 16
+ * bytes, in front of invalid input, when @out has no room for 4 more characters
+ * or right after a control character. Returns the number of consumed bytes and
+ * adds the number of decoded characters to @cnt. */
+utf8_target_("ssse3")
+static size_t utf8_decode_block(const unsigned char *u8, size_t len,
+				uint32_t *out, size_t max, size_t *cnt)
+{
+	const __m128i lengths = _mm_setr_epi8(1, 1, 1, 1, 1, 1, 1, 1,
+					      0, 0, 0, 0, 2, 2, 3, 4);
+	const __m128i payload = _mm_setr_epi8(0x7f, 0x7f, 0x7f, 0x7f,
+					      0x7f, 0x7f, 0x7f, 0x7f,
+					      0x3f, 0x3f, 0x3f, 0x3f,
+					      0x1f, 0x1f, 0x0f, 0x07);
+	const __m128i two_lo = _mm_setr_epi8(1, 0, -1, -1, 3, 2, -1, -1,
+					     5, 4, -1, -1, 7, 6, -1, -1);
+	const __m128i two_hi = _mm_setr_epi8(9, 8, -1, -1, 11, 10, -1, -1,
+					     13, 12, -1, -1, 15, 14, -1, -1);
+	const __m128i three = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1,
+					    8, 7, 6, -1, 11, 10, 9, -1);
+	const __m128i nibble = _mm_set1_epi8(0x0f);
+	__m128i v, hi, l, bad;
+	unsigned int cont, must, inv, err, start, k, s[5], ctrl;
+	size_t pos = 0, n = *cnt;
+
+	while (pos + 16 <= len && n + 4 <= max) {
+		v = _mm_loadu_si128((const __m128i*)&u8[pos]);
+		hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+		l = _mm_shuffle_epi8(lengths, hi);
+
+		/* a lead byte of length n needs n - 1 continuation bytes */
+		cont = _mm_movemask_epi8(_mm_cmpeq_epi8(l, _mm_setzero_si128()));
+		must = _mm_movemask_epi8(_mm_cmpgt_epi8(l, _mm_set1_epi8(1)));
+		must = must << 1 |
+		       _mm_movemask_epi8(_mm_cmpgt_epi8(l, _mm_set1_epi8(2))) << 2;
+		must |= _mm_movemask_epi8(_mm_cmpgt_epi8(l, _mm_set1_epi8(3))) << 3;
+		bad = _mm_or_si128(
+			_mm_cmpeq_epi8(_mm_and_si128(v,
+					_mm_set1_epi8((char)0xfe)),
+				       _mm_set1_epi8((char)0xc0)),
+			_mm_cmpeq_epi8(_mm_max_epu8(v,
+					_mm_set1_epi8((char)0xf8)), v));
+		inv = _mm_movemask_epi8(bad);
+
+		/* @k is the number of bytes of complete, valid sequences */
+		start = ~cont & 0xffff;
+		err = ((must ^ cont) | inv) & 0xffff;
+		if (err) {
+			k = utf8_ctz(err);
+			if (must >> k & 1)
+				k = utf8_last_bit(start & ((1u << k) - 1));
+		} else if (must >> 16) {
+			k = utf8_last_bit(start);
+		} else {
+			k = 16;
+		}
+
+		/* with a stop bit at @k, each group takes 5 set bits */
+		start = (start & ((1u << k) - 1)) | 1u << k;
+		if (__builtin_popcount(start) < 5)
+			break;
+
+		v = _mm_and_si128(v, _mm_shuffle_epi8(payload, hi));
+
+		/* Runs of 2-byte and of 3-byte sequences, as in most non-Latin
+		 * scripts, have a fixed layout and skip utf8_gather(). */
+		if (start == 0x15555 && n + 8 <= max) {
+			ctrl = utf8_decode4(v, two_lo, &out[n]);
+			ctrl |= utf8_decode4(v, two_hi, &out[n + 4]) << 4;
+			if (ctrl) {
+				k = utf8_ctz(ctrl);
+				*cnt = n + k + 1;
+				return pos + 2 * k + 2;
+			}
+			n += 8;
+			pos += 16;
+			continue;
+		} else if ((start & 0x1fff) == 0x1249) {
+			ctrl = utf8_decode4(v, three, &out[n]);
+			if (ctrl) {
+				k = utf8_ctz(ctrl);
+				*cnt = n + k + 1;
+				return pos + 3 * k + 3;
+			}
+			n += 4;
+			pos += 12;
+			continue;
+		}
+
+		s[0] = 0;
+		do {
+			start &= start - 1;
+			s[1] = utf8_ctz(start);
+			start &= start - 1;
+			s[2] = utf8_ctz(start);
+			start &= start - 1;
+			s[3] = utf8_ctz(start);
+			start &= start - 1;
+			s[4] = utf8_ctz(start);
+
+			ctrl = utf8_decode4(v, utf8_gather(s), &out[n]);
+			if (ctrl) {
+				k = utf8_ctz(ctrl);
+				*cnt = n + k + 1;
+				return pos + s[k + 1];
+			}
+
+			n += 4;
+			s[0] = s[4];
+		} while (n + 4 <= max && __builtin_popcount(start) >= 5);
+
+		pos += s[0];
+	}
+
+	*cnt = n;
+	return pos;
+}
+
+#endif
+
+size_t tsm_utf8_mach_decode(struct tsm_utf8_mach *mach, const char *u8,
+			    size_t len, uint32_t *out, size_t *num)
+{
+	const unsigned char *p = (const unsigned char*)u8;
+	size_t pos = 0, cnt = 0, max, n;
+	uint32_t ch;
+	int state;
+
+	if (!mach || !num)
+		return 0;
+
+	max = *num;
+	while (pos < len && cnt < max) {
+		if (utf8_is_idle(mach)) {
+			n = len - pos;
+			if (n > max - cnt)
+				n = max - cnt;
+			n = utf8_decode_ascii(&p[pos], n, &out[cnt]);
+			if (n) {
+				pos += n;
+				cnt += n;
+				mach->ch = out[cnt - 1];
+				mach->state = TSM_UTF8_ACCEPT;
+				continue;
+			}
+
+#if defined(UTF8_X86_DISPATCH)
+			if (utf8_ssse3 && p[pos] >= 0xc2) {
+				n = cnt;
+				pos += utf8_decode_block(&p[pos], len - pos,
+							 out, max, &cnt);
+				if (cnt > n) {
+					mach->ch = out[cnt - 1];
+					mach->state = TSM_UTF8_ACCEPT;
+					if (tsm_ucs4_is_control(out[cnt - 1]))
+						break;
+					continue;
+				}
+			}
+#endif
+
+			n = utf8_decode_seq(&p[pos], len - pos, &ch);
+			if (n) {
+				pos += n;
+				out[cnt++] = ch;
+				mach->ch = ch;
+				mach->state = TSM_UTF8_ACCEPT;
+				if (tsm_ucs4_is_control(ch))
+					break;
+				continue;
+			}
+		}
+
+		state = tsm_utf8_mach_feed(mach, u8[pos++]);
+		if (state == TSM_UTF8_ACCEPT || state == TSM_UTF8_REJECT) {
+			ch = tsm_utf8_mach_get(mach);
+			out[cnt++] = ch;
+			if (tsm_ucs4_is_control(ch))
+				break;
+		}
+	}
+
+	*num = cnt;
+	return pos;
+}
+
+size_t tsm_utf8_mach_decode_ref(struct tsm_utf8_mach *mach, const char *u8,
+				size_t len, uint32_t *out, size_t *num)
+{
+	size_t pos = 0, cnt = 0;
+	uint32_t ch;
+	int state;
+
+	if (!mach || !num)
+		return 0;
+
+	while (pos < len && cnt < *num) {
+		state = tsm_utf8_mach_feed(mach, u8[pos++]);
+		if (state == TSM_UTF8_ACCEPT || state == TSM_UTF8_REJECT) {
+			ch = tsm_utf8_mach_get(mach);
+			out[cnt++] = ch;
+			if (tsm_ucs4_is_control(ch))
+				break;
+		}
+	}
+
+	*num = cnt;
+	return pos;
+}
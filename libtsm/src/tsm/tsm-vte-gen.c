@@ -0,0 +1,369 @@
+/*
+ * libtsm - VT Emulator
+ *
+ * Copyright (c) 2011-2013 David Herrmann <dh.herrmann@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * VTE Transition Table Generator
+ * The DEC ANSI parser of tsm-vte.c is driven by a lookup table. This program
+ * is run at build time and writes that table as C source to stdout. The
+ * transitions are written down below as plain switch statements, following the
+ * state-diagram from Paul Williams: http://vt100.net/emu/
+ *
+ * Every input byte is first mapped to a byte-class. Bytes which cause the same
+ * transitions in every state share a class. Characters above 0xff behave like
+ * the default case of each state and get a class of their own. The second
+ * table is indexed by [state][class] and contains the next state and the
+ * action, packed via VTE_TRANS_PACK(). STATE_NONE as next state means the
+ * state is kept and no entry/exit actions are run.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tsm-vte-parser.h"
+
+/* pseudo-byte used for all characters above 0xff */
+#define GEN_OTHER 0x100
+#define GEN_NUM (GEN_OTHER + 1)
+
+#define TRANS(_state, _action) \
+	return VTE_TRANS_PACK((_state), (_action))
+
+static uint8_t trans(unsigned int state, unsigned int raw)
+{
+	/* events that may occur in any state */
+	switch (raw) {
+		case 0x18:
+		case 0x1a:
+		case 0x80 ... 0x8f:
+		case 0x91 ... 0x97:
+		case 0x99:
+		case 0x9a:
+		case 0x9c:
+			TRANS(STATE_GROUND, ACTION_EXECUTE);
+		case 0x1b:
+			TRANS(STATE_ESC, ACTION_NONE);
+		case 0x98:
+		case 0x9e:
+		case 0x9f:
+			TRANS(STATE_ST_IGNORE, ACTION_NONE);
+		case 0x90:
+			TRANS(STATE_DCS_ENTRY, ACTION_NONE);
+		case 0x9d:
+			TRANS(STATE_OSC_STRING, ACTION_NONE);
+		case 0x9b:
+			TRANS(STATE_CSI_ENTRY, ACTION_NONE);
+	}
+
+	/* events that depend on the current state */
+	switch (state) {
+	case STATE_GROUND:
+		switch (raw) {
+		case 0x00 ... 0x17:
+		case 0x19:
+		case 0x1c ... 0x1f:
+		case 0x80 ... 0x8f:
+		case 0x91 ... 0x9a:
+		case 0x9c:
+			TRANS(STATE_NONE, ACTION_EXECUTE);
+		case 0x20 ... 0x7f:
+			TRANS(STATE_NONE, ACTION_PRINT);
+		}
+		TRANS(STATE_NONE, ACTION_PRINT);
+	case STATE_ESC:
+		switch (raw) {
+		case 0x00 ... 0x17:
+		case 0x19:
+		case 0x1c ... 0x1f:
+			TRANS(STATE_NONE, ACTION_EXECUTE);
+		case 0x7f:
+			TRANS(STATE_NONE, ACTION_IGNORE);
+		case 0x20 ... 0x2f:
+			TRANS(STATE_ESC_INT, ACTION_COLLECT);
+		case 0x30 ... 0x4f:
+		case 0x51 ... 0x57:
+		case 0x59:
+		case 0x5a:
+		case 0x5c:
+		case 0x60 ... 0x7e:
+			TRANS(STATE_GROUND, ACTION_ESC_DISPATCH);
+		case 0x5b:
+			TRANS(STATE_CSI_ENTRY, ACTION_NONE);
+		case 0x5d:
+			TRANS(STATE_OSC_STRING, ACTION_NONE);
+		case 0x50:
+			TRANS(STATE_DCS_ENTRY, ACTION_NONE);
+		case 0x58:
+		case 0x5e:
+		case 0x5f:
+			TRANS(STATE_ST_IGNORE, ACTION_NONE);
+		}
+		TRANS(STATE_ESC_INT, ACTION_COLLECT);
+	case STATE_ESC_INT:
+		switch (raw) {
+		case 0x00 ... 0x17:
+		case 0x19:
+		case 0x1c ... 0x1f:
+			TRANS(STATE_NONE, ACTION_EXECUTE);
+		case 0x20 ... 0x2f:
+			TRANS(STATE_NONE, ACTION_COLLECT);
+		case 0x7f:
+			TRANS(STATE_NONE, ACTION_IGNORE);
+		case 0x30 ... 0x7e:
+			TRANS(STATE_GROUND, ACTION_ESC_DISPATCH);
+		}
+		TRANS(STATE_NONE, ACTION_COLLECT);
+	case STATE_CSI_ENTRY:
+		switch (raw) {
+		case 0x00 ... 0x17:
+		case 0x19:
+		case 0x1c ... 0x1f:
+			TRANS(STATE_NONE, ACTION_EXECUTE);
+		case 0x7f:
+			TRANS(STATE_NONE, ACTION_IGNORE);
+		case 0x20 ... 0x2f:
+			TRANS(STATE_CSI_INT, ACTION_COLLECT);
+		case 0x3a:
+			TRANS(STATE_CSI_IGNORE, ACTION_NONE);
+		case 0x30 ... 0x39:
+		case 0x3b:
+			TRANS(STATE_CSI_PARAM, ACTION_PARAM);
+		case 0x3c ... 0x3f:
+			TRANS(STATE_CSI_PARAM, ACTION_COLLECT);
+		case 0x40 ... 0x7e:
+			TRANS(STATE_GROUND, ACTION_CSI_DISPATCH);
+		}
+		TRANS(STATE_CSI_IGNORE, ACTION_NONE);
+	case STATE_CSI_PARAM:
+		switch (raw) {
+		case 0x00 ... 0x17:
+		case 0x19:
+		case 0x1c ... 0x1f:
+			TRANS(STATE_NONE, ACTION_EXECUTE);
+		case 0x30 ... 0x39:
+		case 0x3b:
+			TRANS(STATE_NONE, ACTION_PARAM);
+		case 0x7f:
+			TRANS(STATE_NONE, ACTION_IGNORE);
+		case 0x3a:
+		case 0x3c ... 0x3f:
+			TRANS(STATE_CSI_IGNORE, ACTION_NONE);
+		case 0x20 ... 0x2f:
+			TRANS(STATE_CSI_INT, ACTION_COLLECT);
+		case 0x40 ... 0x7e:
+			TRANS(STATE_GROUND, ACTION_CSI_DISPATCH);
+		}
+		TRANS(STATE_CSI_IGNORE, ACTION_NONE);
+	case STATE_CSI_INT:
+		switch (raw) {
+		case 0x00 ... 0x17:
+		case 0x19:
+		case 0x1c ... 0x1f:
+			TRANS(STATE_NONE, ACTION_EXECUTE);
+		case 0x20 ... 0x2f:
+			TRANS(STATE_NONE, ACTION_COLLECT);
+		case 0x7f:
+			TRANS(STATE_NONE, ACTION_IGNORE);
+		case 0x30 ... 0x3f:
+			TRANS(STATE_CSI_IGNORE, ACTION_NONE);
+		case 0x40 ... 0x7e:
+			TRANS(STATE_GROUND, ACTION_CSI_DISPATCH);
+		}
+		TRANS(STATE_CSI_IGNORE, ACTION_NONE);
+	case STATE_CSI_IGNORE:
+		switch (raw) {
+		case 0x00 ... 0x17:
+		case 0x19:
+		case 0x1c ... 0x1f:
+			TRANS(STATE_NONE, ACTION_EXECUTE);
+		case 0x20 ... 0x3f:
+		case 0x7f:
+			TRANS(STATE_NONE, ACTION_IGNORE);
+		case 0x40 ... 0x7e:
+			TRANS(STATE_GROUND, ACTION_NONE);
+		}
+		TRANS(STATE_NONE, ACTION_IGNORE);
+	case STATE_DCS_ENTRY:
+		switch (raw) {
+		case 0x00 ... 0x17:
+		case 0x19:
+		case 0x1c ... 0x1f:
+		case 0x7f:
+			TRANS(STATE_NONE, ACTION_IGNORE);
+		case 0x3a:
+			TRANS(STATE_DCS_IGNORE, ACTION_NONE);
+		case 0x20 ... 0x2f:
+			TRANS(STATE_DCS_INT, ACTION_COLLECT);
+		case 0x30 ... 0x39:
+		case 0x3b:
+			TRANS(STATE_DCS_PARAM, ACTION_PARAM);
+		case 0x3c ... 0x3f:
+			TRANS(STATE_DCS_PARAM, ACTION_COLLECT);
+		case 0x40 ... 0x7e:
+			TRANS(STATE_DCS_PASS, ACTION_NONE);
+		}
+		TRANS(STATE_DCS_PASS, ACTION_NONE);
+	case STATE_DCS_PARAM:
+		switch (raw) {
+		case 0x00 ... 0x17:
+		case 0x19:
+		case 0x1c ... 0x1f:
+		case 0x7f:
+			TRANS(STATE_NONE, ACTION_IGNORE);
+		case 0x30 ... 0x39:
+		case 0x3b:
+			TRANS(STATE_NONE, ACTION_PARAM);
+		case 0x3a:
+		case 0x3c ... 0x3f:
+			TRANS(STATE_DCS_IGNORE, ACTION_NONE);
+		case 0x20 ... 0x2f:
+			TRANS(STATE_DCS_INT, ACTION_COLLECT);
+		case 0x40 ... 0x7e:
+			TRANS(STATE_DCS_PASS, ACTION_NONE);
+		}
+		TRANS(STATE_DCS_PASS, ACTION_NONE);
+	case STATE_DCS_INT:
+		switch (raw) {
+		case 0x00 ... 0x17:
+		case 0x19:
+		case 0x1c ... 0x1f:
+		case 0x7f:
+			TRANS(STATE_NONE, ACTION_IGNORE);
+		case 0x20 ... 0x2f:
+			TRANS(STATE_NONE, ACTION_COLLECT);
+		case 0x30 ... 0x3f:
+			TRANS(STATE_DCS_IGNORE, ACTION_NONE);
+		case 0x40 ... 0x7e:
+			TRANS(STATE_DCS_PASS, ACTION_NONE);
+		}
+		TRANS(STATE_DCS_PASS, ACTION_NONE);
+	case STATE_DCS_PASS:
+		switch (raw) {
+		case 0x00 ... 0x17:
+		case 0x19:
+		case 0x1c ... 0x1f:
+		case 0x20 ... 0x7e:
+			TRANS(STATE_NONE, ACTION_DCS_COLLECT);
+		case 0x7f:
+			TRANS(STATE_NONE, ACTION_IGNORE);
+		case 0x9c:
+			TRANS(STATE_GROUND, ACTION_NONE);
+		}
+		TRANS(STATE_NONE, ACTION_DCS_COLLECT);
+	case STATE_DCS_IGNORE:
+		switch (raw) {
+		case 0x00 ... 0x17:
+		case 0x19:
+		case 0x1c ... 0x1f:
+		case 0x20 ... 0x7f:
+			TRANS(STATE_NONE, ACTION_IGNORE);
+		case 0x9c:
+			TRANS(STATE_GROUND, ACTION_NONE);
+		}
+		TRANS(STATE_NONE, ACTION_IGNORE);
+	case STATE_OSC_STRING:
+		switch (raw) {
+		case 0x00 ... 0x06:
+		case 0x08 ... 0x17:
+		case 0x19:
+		case 0x1c ... 0x1f:
+			TRANS(STATE_NONE, ACTION_IGNORE);
+		case 0x20 ... 0x7f:
+			TRANS(STATE_NONE, ACTION_OSC_COLLECT);
+		case 0x07:
+		case 0x9c:
+			TRANS(STATE_GROUND, ACTION_NONE);
+		}
+		TRANS(STATE_NONE, ACTION_OSC_COLLECT);
+	case STATE_ST_IGNORE:
+		switch (raw) {
+		case 0x00 ... 0x17:
+		case 0x19:
+		case 0x1c ... 0x1f:
+		case 0x20 ... 0x7f:
+			TRANS(STATE_NONE, ACTION_IGNORE);
+		case 0x9c:
+			TRANS(STATE_GROUND, ACTION_NONE);
+		}
+		TRANS(STATE_NONE, ACTION_IGNORE);
+	}
+
+	return VTE_TRANS_PACK(STATE_NONE, ACTION_NONE);
+}
+
+int main(void)
+{
+	static uint8_t table[GEN_NUM][STATE_NUM];
+	static unsigned int class[GEN_NUM];
+	unsigned int num, raw, i, s;
+
+	if (STATE_NUM > 16 || ACTION_NUM > 16) {
+		fprintf(stderr, "tsm-vte-gen: states/actions do not fit into 4 bits\n");
+		return EXIT_FAILURE;
+	}
+
+	/* merge all bytes with identical transitions into one class */
+	num = 0;
+	for (raw = 0; raw < GEN_NUM; ++raw) {
+		for (s = 0; s < STATE_NUM; ++s)
+			table[raw][s] = trans(s, raw);
+
+		for (i = 0; i < raw; ++i) {
+			if (!memcmp(table[i], table[raw], sizeof(table[raw])))
+				break;
+		}
+
+		class[raw] = (i < raw) ? class[i] : num++;
+	}
+
+	if (num > 256) {
+		fprintf(stderr, "tsm-vte-gen: too many byte classes\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("/* generated by tsm-vte-gen, do not edit */\n\n");
+	printf("#define VTE_CLASS_OTHER %u\n", class[GEN_OTHER]);
+	printf("#define VTE_CLASS_NUM %u\n\n", num);
+
+	printf("static const uint8_t vte_byte_class[256] = {");
+	for (raw = 0; raw < 256; ++raw)
+		printf("%s%u,", (raw % 16) ? " " : "\n\t", class[raw]);
+	printf("\n};\n\n");
+
+	printf("static const uint8_t vte_trans_table[STATE_NUM][VTE_CLASS_NUM] = {\n");
+	for (s = 0; s < STATE_NUM; ++s) {
+		printf("\t{");
+		for (i = 0; i < num; ++i) {
+			for (raw = 0; class[raw] != i; ++raw)
+				/* empty */ ;
+			printf("%s0x%02x,", (i % 12) ? " " : "\n\t\t",
+			       table[raw][s]);
+		}
+		printf("\n\t},\n");
+	}
+	printf("};\n");
+
+	return EXIT_SUCCESS;
+}
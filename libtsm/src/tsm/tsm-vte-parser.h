@@ -0,0 +1,80 @@
+/*
+ * libtsm - VT Emulator
+ *
+ * Copyright (c) 2011-2013 David Herrmann <dh.herrmann@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Parser States and Actions
+ * These are shared between the VT emulator and the generator of its transition
+ * table (tsm-vte-gen.c). The table packs a state and an action into a single
+ * byte, so neither enum may grow beyond 16 entries.
+ */
+
+#ifndef TSM_VTE_PARSER_H
+#define TSM_VTE_PARSER_H
+
+/* Input parser states */
+enum parser_state {
+	STATE_NONE,		/* placeholder */
+	STATE_GROUND,		/* initial state and ground */
+	STATE_ESC,		/* ESC sequence was started */
+	STATE_ESC_INT,		/* intermediate escape characters */
+	STATE_CSI_ENTRY,	/* starting CSI sequence */
+	STATE_CSI_PARAM,	/* CSI parameters */
+	STATE_CSI_INT,		/* intermediate CSI characters */
+	STATE_CSI_IGNORE,	/* CSI error; ignore this CSI sequence */
+	STATE_DCS_ENTRY,	/* starting DCS sequence */
+	STATE_DCS_PARAM,	/* DCS parameters */
+	STATE_DCS_INT,		/* intermediate DCS characters */
+	STATE_DCS_PASS,		/* DCS data passthrough */
+	STATE_DCS_IGNORE,	/* DCS error; ignore this DCS sequence */
+	STATE_OSC_STRING,	/* parsing OCS sequence */
+	STATE_ST_IGNORE,	/* unimplemented seq; ignore until ST */
+	STATE_NUM
+};
+
+/* Input parser actions */
+enum parser_action {
+	ACTION_NONE,		/* placeholder */
+	ACTION_IGNORE,		/* ignore the character entirely */
+	ACTION_PRINT,		/* print the character on the console */
+	ACTION_EXECUTE,		/* execute single control character (C0/C1) */
+	ACTION_CLEAR,		/* clear current parameter state */
+	ACTION_COLLECT,		/* collect intermediate character */
+	ACTION_PARAM,		/* collect parameter character */
+	ACTION_ESC_DISPATCH,	/* dispatch escape sequence */
+	ACTION_CSI_DISPATCH,	/* dispatch csi sequence */
+	ACTION_DCS_START,	/* start of DCS data */
+	ACTION_DCS_COLLECT,	/* collect DCS data */
+	ACTION_DCS_END,		/* end of DCS data */
+	ACTION_OSC_START,	/* start of OSC data */
+	ACTION_OSC_COLLECT,	/* collect OSC data */
+	ACTION_OSC_END,		/* end of OSC data */
+	ACTION_NUM
+};
+
+#define VTE_TRANS_PACK(_state, _action) (((_state) << 4) | (_action))
+#define VTE_TRANS_STATE(_trans) ((_trans) >> 4)
+#define VTE_TRANS_ACTION(_trans) ((_trans) & 0x0f)
+
+#endif /* TSM_VTE_PARSER_H */
@@ -52,6 +52,8 @@
 #include "libtsm.h"
 #include "libtsm-int.h"
 #include "shl-llog.h"
+#include "tsm-vte-parser.h"
+#include "tsm-vte-table.h"
 
 #ifdef BUILD_HAVE_XKBCOMMON
 #  include <xkbcommon/xkbcommon-keysyms.h>
@@ -61,46 +63,6 @@
 
 #define LLOG_SUBSYSTEM "tsm-vte"
 
-/* Input parser states */
-enum parser_state {
-	STATE_NONE,		/* placeholder */
-	STATE_GROUND,		/* initial state and ground */
-	STATE_ESC,		/* ESC sequence was started */
-	STATE_ESC_INT,		/* intermediate escape characters */
-	STATE_CSI_ENTRY,	/* starting CSI sequence */
-	STATE_CSI_PARAM,	/* CSI parameters */
-	STATE_CSI_INT,		/* intermediate CSI characters */
-	STATE_CSI_IGNORE,	/* CSI error; ignore this CSI sequence */
-	STATE_DCS_ENTRY,	/* starting DCS sequence */
-	STATE_DCS_PARAM,	/* DCS parameters */
-	STATE_DCS_INT,		/* intermediate DCS characters */
-	STATE_DCS_PASS,		/* DCS data passthrough */
-	STATE_DCS_IGNORE,	/* DCS error; ignore this DCS sequence */
-	STATE_OSC_STRING,	/* parsing OCS sequence */
-	STATE_ST_IGNORE,	/* unimplemented seq; ignore until ST */
-	STATE_NUM
-};
-
-/* Input parser actions */
-enum parser_action {
-	ACTION_NONE,		/* placeholder */
-	ACTION_IGNORE,		/* ignore the character entirely */
-	ACTION_PRINT,		/* print the character on the console */
-	ACTION_EXECUTE,		/* execute single control character (C0/C1) */
-	ACTION_CLEAR,		/* clear current parameter state */
-	ACTION_COLLECT,		/* collect intermediate character */
-	ACTION_PARAM,		/* collect parameter character */
-	ACTION_ESC_DISPATCH,	/* dispatch escape sequence */
-	ACTION_CSI_DISPATCH,	/* dispatch csi sequence */
-	ACTION_DCS_START,	/* start of DCS data */
-	ACTION_DCS_COLLECT,	/* collect DCS data */
-	ACTION_DCS_END,		/* end of DCS data */
-	ACTION_OSC_START,	/* start of OSC data */
-	ACTION_OSC_COLLECT,	/* collect OSC data */
-	ACTION_OSC_END,		/* end of OSC data */
-	ACTION_NUM
-};
-
 /* CSI flags */
 #define CSI_BANG	0x0001		/* CSI: ! */
 #define CSI_CASH	0x0002		/* CSI: $ */
@@ -136,6 +98,7 @@ enum parser_action {
 #define FLAG_BACKGROUND_COLOR_ERASE_MODE	0x00008000 /* Set background color on erase (bce) */
 #define FLAG_PREPEND_ESCAPE			0x00010000 /* Prepend escape character to next output */
 #define FLAG_TITE_INHIBIT_MODE			0x00020000 /* Prevent switching to alternate screen buffer */
+#define FLAG_SYNC_UPDATE_MODE			0x00040000 /* Synchronized output; renderers hold back frames */
 
 struct vte_saved_state {
 	unsigned int cursor_x;
@@ -549,6 +512,14 @@ static void write_console(struct tsm_vte *vte, tsm_symbol_t sym)
 	tsm_screen_write(vte->con, sym, &vte->cattr);
 }
 
+/* write a run of symbols with the current attributes to the console */
+static void write_console_run(struct tsm_vte *vte, const tsm_symbol_t *syms,
+			      size_t num)
+{
+	to_rgb(vte, &vte->cattr);
+	tsm_screen_write_run(vte->con, syms, num, &vte->cattr);
+}
+
 static void reset_state(struct tsm_vte *vte)
 {
 	vte->saved_state.cursor_x = 0;
@@ -1484,6 +1455,15 @@ static void csi_mode(struct tsm_vte *vte, bool set)
 						   vte->alt_cursor_y);
 			}
 			continue;
+		case 2026: /* Synchronized output (BSU/ESU) */
+			set_reset_flag(vte, set, FLAG_SYNC_UPDATE_MODE);
+			if (set)
+				tsm_screen_set_flags(vte->con,
+						     TSM_SCREEN_SYNC_UPDATE);
+			else
+				tsm_screen_reset_flags(vte->con,
+						       TSM_SCREEN_SYNC_UPDATE);
+			continue;
 		default:
 			llog_debug(vte, "unknown DEC %set-Mode %d",
 				   set?"S":"Res", vte->csi_argv[i]);
@@ -1526,6 +1506,16 @@ static void csi_dsr(struct tsm_vte *vte)
 	}
 }
 
+/* DECRQM: Request DEC Private Mode
+ * Only synchronized output is reported, so applications can detect it. */
+static void csi_request_sync_mode(struct tsm_vte *vte)
+{
+	if (vte->flags & FLAG_SYNC_UPDATE_MODE)
+		vte_write(vte, "\e[?2026;1$y", 11);
+	else
+		vte_write(vte, "\e[?2026;2$y", 11);
+}
+
 static void do_csi(struct tsm_vte *vte, uint32_t data)
 {
 	int num, x, y, upper, lower;
@@ -1650,6 +1640,10 @@ static void do_csi(struct tsm_vte *vte, uint32_t data)
 		} else if (vte->csi_flags & CSI_BANG) {
 			/* DECSTR: Soft Reset */
 			csi_soft_reset(vte);
+		} else if ((vte->csi_flags & CSI_CASH) &&
+			   (vte->csi_flags & CSI_WHAT) &&
+			   vte->csi_argv[0] == 2026) {
+			csi_request_sync_mode(vte);
 		} else if (vte->csi_flags & CSI_CASH) {
 			/* DECRQM: Request DEC Private Mode */
 			/* If CSI_WHAT is set, then enable,
@@ -1871,376 +1865,72 @@ static void do_trans(struct tsm_vte *vte, uint32_t data, int state, int act)
 /*
  * Escape sequence parser
  * This parses the new input character \data. It performs state transition and
- * calls the right callbacks for each action.
+ * calls the right callbacks for each action. The transitions are looked up in
+ * the tables generated by tsm-vte-gen.c.
  */
 static void parse_data(struct tsm_vte *vte, uint32_t raw)
 {
-	/* events that may occur in any state */
-	switch (raw) {
-		case 0x18:
-		case 0x1a:
-		case 0x80 ... 0x8f:
-		case 0x91 ... 0x97:
-		case 0x99:
-		case 0x9a:
-		case 0x9c:
-			do_trans(vte, raw, STATE_GROUND, ACTION_EXECUTE);
-			return;
-		case 0x1b:
-			do_trans(vte, raw, STATE_ESC, ACTION_NONE);
-			return;
-		case 0x98:
-		case 0x9e:
-		case 0x9f:
-			do_trans(vte, raw, STATE_ST_IGNORE, ACTION_NONE);
-			return;
-		case 0x90:
-			do_trans(vte, raw, STATE_DCS_ENTRY, ACTION_NONE);
-			return;
-		case 0x9d:
-			do_trans(vte, raw, STATE_OSC_STRING, ACTION_NONE);
-			return;
-		case 0x9b:
-			do_trans(vte, raw, STATE_CSI_ENTRY, ACTION_NONE);
-			return;
-	}
+	unsigned int class;
+	uint8_t trans;
 
-	/* events that depend on the current state */
-	switch (vte->state) {
-	case STATE_GROUND:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-		case 0x80 ... 0x8f:
-		case 0x91 ... 0x9a:
-		case 0x9c:
-			do_trans(vte, raw, STATE_NONE, ACTION_EXECUTE);
-			return;
-		case 0x20 ... 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_PRINT);
-			return;
-		}
-		do_trans(vte, raw, STATE_NONE, ACTION_PRINT);
-		return;
-	case STATE_ESC:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-			do_trans(vte, raw, STATE_NONE, ACTION_EXECUTE);
-			return;
-		case 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x20 ... 0x2f:
-			do_trans(vte, raw, STATE_ESC_INT, ACTION_COLLECT);
-			return;
-		case 0x30 ... 0x4f:
-		case 0x51 ... 0x57:
-		case 0x59:
-		case 0x5a:
-		case 0x5c:
-		case 0x60 ... 0x7e:
-			do_trans(vte, raw, STATE_GROUND, ACTION_ESC_DISPATCH);
-			return;
-		case 0x5b:
-			do_trans(vte, raw, STATE_CSI_ENTRY, ACTION_NONE);
-			return;
-		case 0x5d:
-			do_trans(vte, raw, STATE_OSC_STRING, ACTION_NONE);
-			return;
-		case 0x50:
-			do_trans(vte, raw, STATE_DCS_ENTRY, ACTION_NONE);
-			return;
-		case 0x58:
-		case 0x5e:
-		case 0x5f:
-			do_trans(vte, raw, STATE_ST_IGNORE, ACTION_NONE);
-			return;
-		}
-		do_trans(vte, raw, STATE_ESC_INT, ACTION_COLLECT);
-		return;
-	case STATE_ESC_INT:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-			do_trans(vte, raw, STATE_NONE, ACTION_EXECUTE);
-			return;
-		case 0x20 ... 0x2f:
-			do_trans(vte, raw, STATE_NONE, ACTION_COLLECT);
-			return;
-		case 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x30 ... 0x7e:
-			do_trans(vte, raw, STATE_GROUND, ACTION_ESC_DISPATCH);
-			return;
-		}
-		do_trans(vte, raw, STATE_NONE, ACTION_COLLECT);
-		return;
-	case STATE_CSI_ENTRY:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-			do_trans(vte, raw, STATE_NONE, ACTION_EXECUTE);
-			return;
-		case 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x20 ... 0x2f:
-			do_trans(vte, raw, STATE_CSI_INT, ACTION_COLLECT);
-			return;
-		case 0x3a:
-			do_trans(vte, raw, STATE_CSI_IGNORE, ACTION_NONE);
-			return;
-		case 0x30 ... 0x39:
-		case 0x3b:
-			do_trans(vte, raw, STATE_CSI_PARAM, ACTION_PARAM);
-			return;
-		case 0x3c ... 0x3f:
-			do_trans(vte, raw, STATE_CSI_PARAM, ACTION_COLLECT);
-			return;
-		case 0x40 ... 0x7e:
-			do_trans(vte, raw, STATE_GROUND, ACTION_CSI_DISPATCH);
-			return;
-		}
-		do_trans(vte, raw, STATE_CSI_IGNORE, ACTION_NONE);
-		return;
-	case STATE_CSI_PARAM:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-			do_trans(vte, raw, STATE_NONE, ACTION_EXECUTE);
-			return;
-		case 0x30 ... 0x39:
-		case 0x3b:
-			do_trans(vte, raw, STATE_NONE, ACTION_PARAM);
-			return;
-		case 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x3a:
-		case 0x3c ... 0x3f:
-			do_trans(vte, raw, STATE_CSI_IGNORE, ACTION_NONE);
-			return;
-		case 0x20 ... 0x2f:
-			do_trans(vte, raw, STATE_CSI_INT, ACTION_COLLECT);
-			return;
-		case 0x40 ... 0x7e:
-			do_trans(vte, raw, STATE_GROUND, ACTION_CSI_DISPATCH);
-			return;
-		}
-		do_trans(vte, raw, STATE_CSI_IGNORE, ACTION_NONE);
-		return;
-	case STATE_CSI_INT:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-			do_trans(vte, raw, STATE_NONE, ACTION_EXECUTE);
-			return;
-		case 0x20 ... 0x2f:
-			do_trans(vte, raw, STATE_NONE, ACTION_COLLECT);
-			return;
-		case 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x30 ... 0x3f:
-			do_trans(vte, raw, STATE_CSI_IGNORE, ACTION_NONE);
-			return;
-		case 0x40 ... 0x7e:
-			do_trans(vte, raw, STATE_GROUND, ACTION_CSI_DISPATCH);
-			return;
-		}
-		do_trans(vte, raw, STATE_CSI_IGNORE, ACTION_NONE);
-		return;
-	case STATE_CSI_IGNORE:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-			do_trans(vte, raw, STATE_NONE, ACTION_EXECUTE);
-			return;
-		case 0x20 ... 0x3f:
-		case 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x40 ... 0x7e:
-			do_trans(vte, raw, STATE_GROUND, ACTION_NONE);
-			return;
-		}
-		do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-		return;
-	case STATE_DCS_ENTRY:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-		case 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x3a:
-			do_trans(vte, raw, STATE_DCS_IGNORE, ACTION_NONE);
-			return;
-		case 0x20 ... 0x2f:
-			do_trans(vte, raw, STATE_DCS_INT, ACTION_COLLECT);
-			return;
-		case 0x30 ... 0x39:
-		case 0x3b:
-			do_trans(vte, raw, STATE_DCS_PARAM, ACTION_PARAM);
-			return;
-		case 0x3c ... 0x3f:
-			do_trans(vte, raw, STATE_DCS_PARAM, ACTION_COLLECT);
-			return;
-		case 0x40 ... 0x7e:
-			do_trans(vte, raw, STATE_DCS_PASS, ACTION_NONE);
-			return;
-		}
-		do_trans(vte, raw, STATE_DCS_PASS, ACTION_NONE);
-		return;
-	case STATE_DCS_PARAM:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-		case 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x30 ... 0x39:
-		case 0x3b:
-			do_trans(vte, raw, STATE_NONE, ACTION_PARAM);
-			return;
-		case 0x3a:
-		case 0x3c ... 0x3f:
-			do_trans(vte, raw, STATE_DCS_IGNORE, ACTION_NONE);
-			return;
-		case 0x20 ... 0x2f:
-			do_trans(vte, raw, STATE_DCS_INT, ACTION_COLLECT);
-			return;
-		case 0x40 ... 0x7e:
-			do_trans(vte, raw, STATE_DCS_PASS, ACTION_NONE);
-			return;
-		}
-		do_trans(vte, raw, STATE_DCS_PASS, ACTION_NONE);
-		return;
-	case STATE_DCS_INT:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-		case 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x20 ... 0x2f:
-			do_trans(vte, raw, STATE_NONE, ACTION_COLLECT);
-			return;
-		case 0x30 ... 0x3f:
-			do_trans(vte, raw, STATE_DCS_IGNORE, ACTION_NONE);
-			return;
-		case 0x40 ... 0x7e:
-			do_trans(vte, raw, STATE_DCS_PASS, ACTION_NONE);
-			return;
-		}
-		do_trans(vte, raw, STATE_DCS_PASS, ACTION_NONE);
-		return;
-	case STATE_DCS_PASS:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-		case 0x20 ... 0x7e:
-			do_trans(vte, raw, STATE_NONE, ACTION_DCS_COLLECT);
-			return;
-		case 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x9c:
-			do_trans(vte, raw, STATE_GROUND, ACTION_NONE);
-			return;
-		}
-		do_trans(vte, raw, STATE_NONE, ACTION_DCS_COLLECT);
-		return;
-	case STATE_DCS_IGNORE:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-		case 0x20 ... 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x9c:
-			do_trans(vte, raw, STATE_GROUND, ACTION_NONE);
-			return;
-		}
-		do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-		return;
-	case STATE_OSC_STRING:
-		switch (raw) {
-		case 0x00 ... 0x06:
-		case 0x08 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x20 ... 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_OSC_COLLECT);
-			return;
-		case 0x07:
-		case 0x9c:
-			do_trans(vte, raw, STATE_GROUND, ACTION_NONE);
-			return;
-		}
-		do_trans(vte, raw, STATE_NONE, ACTION_OSC_COLLECT);
-		return;
-	case STATE_ST_IGNORE:
-		switch (raw) {
-		case 0x00 ... 0x17:
-		case 0x19:
-		case 0x1c ... 0x1f:
-		case 0x20 ... 0x7f:
-			do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-			return;
-		case 0x9c:
-			do_trans(vte, raw, STATE_GROUND, ACTION_NONE);
-			return;
-		}
-		do_trans(vte, raw, STATE_NONE, ACTION_IGNORE);
-		return;
+	class = (raw < 256) ? vte_byte_class[raw] : VTE_CLASS_OTHER;
+	trans = vte_trans_table[vte->state][class];
+	do_trans(vte, raw, VTE_TRANS_STATE(trans), VTE_TRANS_ACTION(trans));
+}
+
+/*
+ * UTF8 input is decoded in blocks of up to VTE_DECODE_MAX characters. The
+ * decoder stops right after each control character, so in ground state
+ * everything in front of it is printable and can be written to the screen as a
+ * single run. Outside of ground state we decode one character at a time as the
+ * escape sequence might switch to 7bit/8bit mode or reset the UTF8 machine.
+ */
+#define VTE_DECODE_MAX 256
+
+static size_t parse_utf8(struct tsm_vte *vte, const char *u8, size_t len)
+{
+	uint32_t ucs4[VTE_DECODE_MAX];
+	tsm_symbol_t syms[VTE_DECODE_MAX];
+	size_t ret, num, i;
+
+	num = (vte->state == STATE_GROUND) ? VTE_DECODE_MAX : 1;
+	ret = tsm_utf8_mach_decode(vte->mach, u8, len, ucs4, &num);
+	if (!num)
+		return ret;
+
+	if (vte->state == STATE_GROUND) {
+		for (i = 0; i < num && !tsm_ucs4_is_control(ucs4[i]); ++i)
+			syms[i] = tsm_symbol_make(vte_map(vte, ucs4[i]));
+		if (i)
+			write_console_run(vte, syms, i);
+		if (i < num)
+			parse_data(vte, ucs4[i]);
+	} else {
+		parse_data(vte, ucs4[0]);
 	}
 
-	llog_warning(vte, "unhandled input %u in state %d", raw, vte->state);
+	return ret;
 }
 
 SHL_EXPORT
 void tsm_vte_input(struct tsm_vte *vte, const char *u8, size_t len)
 {
-	int state;
-	uint32_t ucs4;
 	size_t i;
 
 	if (!vte || !vte->con)
 		return;
 
 	++vte->parse_cnt;
-	for (i = 0; i < len; ++i) {
+	for (i = 0; i < len; ) {
 		if (vte->flags & FLAG_7BIT_MODE) {
 			if (u8[i] & 0x80)
 				llog_debug(vte, "receiving 8bit character U+%d from pty while in 7bit mode",
 					   (int)u8[i]);
-			parse_data(vte, u8[i] & 0x7f);
+			parse_data(vte, u8[i++] & 0x7f);
 		} else if (vte->flags & FLAG_8BIT_MODE) {
-			parse_data(vte, u8[i]);
+			parse_data(vte, u8[i++]);
 		} else {
-			state = tsm_utf8_mach_feed(vte->mach, u8[i]);
-			if (state == TSM_UTF8_ACCEPT ||
-			    state == TSM_UTF8_REJECT) {
-				ucs4 = tsm_utf8_mach_get(vte->mach);
-				parse_data(vte, ucs4);
-			}
+			i += parse_utf8(vte, &u8[i], len - i);
 		}
 	}
 	--vte->parse_cnt;
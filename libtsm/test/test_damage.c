@@ -0,0 +1,279 @@
+/*
+ * TSM - Screen Damage Tests
+ *
+ * Copyright (c) 2012-2013 David Herrmann <dh.herrmann@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include <string.h>
+#include "test_common.h"
+
+/* Copy of what a renderer put into its framebuffer */
+struct shadow {
+	unsigned int cols;
+	unsigned int rows;
+	unsigned int calls;
+	struct {
+		tsm_symbol_t id;
+		unsigned int width;
+		bool inverse;
+		unsigned int attr;
+	} *cells;
+};
+
+static int shadow_draw(struct tsm_screen *con, uint32_t id,
+		       const uint32_t *ch, size_t len, unsigned int width,
+		       unsigned int posx, unsigned int posy,
+		       const struct tsm_screen_attr *attr, tsm_age_t age,
+		       void *data)
+{
+	struct shadow *s = data;
+	unsigned int i = posy * s->cols + posx;
+
+	ck_assert(posx < s->cols && posy < s->rows);
+
+	++s->calls;
+	s->cells[i].id = id;
+	s->cells[i].width = width;
+	s->cells[i].inverse = attr->inverse;
+	s->cells[i].attr = tsm_screen_get_draw_attr_id(con);
+	return 0;
+}
+
+static void shadow_init(struct shadow *s, unsigned int cols,
+			unsigned int rows)
+{
+	s->cols = cols;
+	s->rows = rows;
+	s->calls = 0;
+	s->cells = calloc(cols * rows, sizeof(*s->cells));
+	ck_assert(s->cells != NULL);
+}
+
+/* move the scrolled region like a renderer would do with its framebuffer */
+static void shadow_scroll(struct shadow *s, const struct tsm_screen_damage *d)
+{
+	unsigned int top = d->scroll_top, rows, n;
+
+	rows = d->scroll_bottom + 1 - top;
+	if (d->scroll > 0) {
+		n = d->scroll;
+		memmove(&s->cells[top * s->cols],
+			&s->cells[(top + n) * s->cols],
+			(rows - n) * s->cols * sizeof(*s->cells));
+	} else if (d->scroll < 0) {
+		n = -d->scroll;
+		memmove(&s->cells[(top + n) * s->cols],
+			&s->cells[top * s->cols],
+			(rows - n) * s->cols * sizeof(*s->cells));
+	}
+}
+
+START_TEST(test_damage_null)
+{
+	struct tsm_screen_damage d;
+	int r;
+
+	r = tsm_screen_get_damage(NULL, &d);
+	ck_assert(r == -EINVAL);
+
+	tsm_screen_draw_damage(NULL, false, shadow_draw, NULL);
+}
+END_TEST
+
+START_TEST(test_damage_write)
+{
+	struct tsm_screen *con;
+	struct tsm_screen_damage d;
+	struct tsm_screen_attr attr;
+	struct shadow s;
+	unsigned int def;
+	int r;
+
+	r = tsm_screen_new(&con, NULL, NULL);
+	ck_assert(!r);
+	shadow_init(&s, 80, 24);
+
+	r = tsm_screen_get_damage(con, &d);
+	ck_assert(!r);
+	ck_assert(d.full);
+
+	tsm_screen_draw_damage(con, false, shadow_draw, &s);
+	ck_assert(s.calls == 80 * 24);
+	def = s.cells[0].attr;
+
+	r = tsm_screen_get_damage(con, &d);
+	ck_assert(!r);
+	ck_assert(!d.full && !d.scroll);
+	ck_assert(d.rows == 24);
+	ck_assert(d.spans[0].start > d.spans[0].end);
+
+	/* one character and the cursor that moved on */
+	memset(&attr, 0, sizeof(attr));
+	attr.fccode = 1;
+	tsm_screen_write(con, 'a', &attr);
+	r = tsm_screen_get_damage(con, &d);
+	ck_assert(!r);
+	ck_assert(!d.full);
+	ck_assert(d.spans[0].start == 0 && d.spans[0].end == 1);
+	ck_assert(d.spans[1].start > d.spans[1].end);
+
+	s.calls = 0;
+	tsm_screen_draw_damage(con, false, shadow_draw, &s);
+	ck_assert(s.calls == 2);
+	ck_assert(s.cells[0].id == 'a');
+	ck_assert(s.cells[1].inverse);
+
+	/* the cursor only inverts the attributes, they keep their id */
+	ck_assert(s.cells[0].attr != def);
+	ck_assert(s.cells[1].attr == def);
+
+	free(s.cells);
+	tsm_screen_unref(con);
+}
+END_TEST
+
+START_TEST(test_damage_scroll)
+{
+	struct tsm_screen *con;
+	struct tsm_screen_damage d;
+	struct shadow s;
+	unsigned int i;
+	int r;
+
+	r = tsm_screen_new(&con, NULL, NULL);
+	ck_assert(!r);
+	shadow_init(&s, 80, 24);
+	tsm_screen_draw_damage(con, false, shadow_draw, &s);
+
+	tsm_screen_move_to(con, 0, 23);
+	for (i = 0; i < 3; ++i)
+		tsm_screen_newline(con);
+
+	r = tsm_screen_get_damage(con, &d);
+	ck_assert(!r);
+	ck_assert(!d.full);
+	ck_assert(d.scroll == 3);
+	ck_assert(d.scroll_top == 0 && d.scroll_bottom == 23);
+	ck_assert(d.spans[0].start > d.spans[0].end);
+	ck_assert(d.spans[21].start == 0 && d.spans[21].end == 79);
+
+	/* without moving the framebuffer, all scrolled rows are redrawn */
+	s.calls = 0;
+	tsm_screen_draw_damage(con, false, shadow_draw, &s);
+	ck_assert(s.calls == 80 * 24);
+
+	free(s.cells);
+	tsm_screen_unref(con);
+}
+END_TEST
+
+/* Modify two screens the same way and keep one shadow up to date with
+ * damage-draws and the other one with full draws. */
+START_TEST(test_damage_random)
+{
+	struct tsm_screen *con[2];
+	struct tsm_screen_damage d;
+	struct tsm_screen_attr attr;
+	struct shadow s[2];
+	unsigned int i, j, op, x, y;
+	int r;
+
+	for (i = 0; i < 2; ++i) {
+		r = tsm_screen_new(&con[i], NULL, NULL);
+		ck_assert(!r);
+		r = tsm_screen_resize(con[i], 20, 8);
+		ck_assert(!r);
+		shadow_init(&s[i], 20, 8);
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	srand(1);
+	for (j = 0; j < 5000; ++j) {
+		op = rand() % 10;
+		x = rand() % 25;
+		y = rand() % 10;
+		for (i = 0; i < 2; ++i) {
+			switch (op) {
+			case 0:
+				tsm_screen_move_to(con[i], x, y);
+				break;
+			case 1:
+				tsm_screen_newline(con[i]);
+				break;
+			case 2:
+				tsm_screen_set_margins(con[i], y, y + x % 6);
+				break;
+			case 3:
+				tsm_screen_scroll_down(con[i], y % 3 + 1);
+				break;
+			case 4:
+				tsm_screen_insert_lines(con[i], y % 3 + 1);
+				break;
+			case 5:
+				tsm_screen_delete_chars(con[i], x % 4 + 1);
+				break;
+			case 6:
+				tsm_screen_erase_cursor_to_end(con[i], false);
+				break;
+			default:
+				tsm_screen_write(con[i], 'a' + x, &attr);
+				break;
+			}
+		}
+
+		tsm_screen_get_damage(con[0], &d);
+		if (!d.full)
+			shadow_scroll(&s[0], &d);
+		tsm_screen_draw_damage(con[0], true, shadow_draw, &s[0]);
+		tsm_screen_draw(con[1], shadow_draw, &s[1]);
+
+		ck_assert(!memcmp(s[0].cells, s[1].cells,
+				  20 * 8 * sizeof(*s[0].cells)));
+	}
+
+	ck_assert(s[0].calls < s[1].calls / 2);
+
+	for (i = 0; i < 2; ++i) {
+		free(s[i].cells);
+		tsm_screen_unref(con[i]);
+	}
+}
+END_TEST
+
+TEST_DEFINE_CASE(misc)
+	TEST(test_damage_null)
+	TEST(test_damage_write)
+	TEST(test_damage_scroll)
+TEST_END_CASE
+
+TEST_DEFINE_CASE(diff)
+	TEST(test_damage_random)
+TEST_END_CASE
+
+TEST_DEFINE(
+	TEST_SUITE(damage,
+		TEST_CASE(misc),
+		TEST_CASE(diff),
+		TEST_END
+	)
+)
@@ -0,0 +1,736 @@
+/*
+ * TSM - Scroll-back Buffer Tests
+ *
+ * Copyright (c) 2012-2013 David Herrmann <dh.herrmann@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include "test_common.h"
+
+static int top_draw(struct tsm_screen *con, uint32_t id,
+		    const uint32_t *ch, size_t len, unsigned int width,
+		    unsigned int posx, unsigned int posy,
+		    const struct tsm_screen_attr *attr, tsm_age_t age,
+		    void *data)
+{
+	uint32_t *top = data;
+
+	if (!posx && !posy)
+		*top = id;
+	return 0;
+}
+
+static int bg_draw(struct tsm_screen *con, uint32_t id,
+		   const uint32_t *ch, size_t len, unsigned int width,
+		   unsigned int posx, unsigned int posy,
+		   const struct tsm_screen_attr *attr, tsm_age_t age,
+		   void *data)
+{
+	int8_t *bg = data;
+
+	if (posx == 9 && !posy)
+		*bg = attr->bccode;
+	return 0;
+}
+
+/* return the background of the top-right cell of the screen */
+static int8_t top_bg(struct tsm_screen *con)
+{
+	int8_t bg = -1;
+
+	tsm_screen_draw(con, bg_draw, &bg);
+	return bg;
+}
+
+/* return the symbol in the top-left cell of the screen */
+static uint32_t top_symbol(struct tsm_screen *con)
+{
+	uint32_t top = 0;
+
+	tsm_screen_draw(con, top_draw, &top);
+	return top;
+}
+
+/* write @num lines, each marked with a letter in its first cell */
+static void write_lines(struct tsm_screen *con, unsigned int num)
+{
+	struct tsm_screen_attr attr;
+	unsigned int i;
+
+	memset(&attr, 0, sizeof(attr));
+	for (i = 0; i < num; ++i) {
+		tsm_screen_write(con, 'a' + i % 26, &attr);
+		tsm_screen_newline(con);
+	}
+}
+
+/* write @num lines, each filled with a letter, on a screen 10 cells wide */
+static void write_rows(struct tsm_screen *con, unsigned int num)
+{
+	struct tsm_screen_attr attr;
+	unsigned int i, j;
+
+	memset(&attr, 0, sizeof(attr));
+	for (i = 0; i < num; ++i) {
+		for (j = 0; j < 10; ++j)
+			tsm_screen_write(con, 'a' + i % 26, &attr);
+		tsm_screen_newline(con);
+	}
+}
+
+START_TEST(test_scrollback_null)
+{
+	ck_assert(tsm_screen_sb_get_pos(NULL) == 0);
+	tsm_screen_sb_set_pos(NULL, 0);
+}
+END_TEST
+
+START_TEST(test_scrollback_pos)
+{
+	struct tsm_screen *con;
+	int r;
+
+	r = tsm_screen_new(&con, NULL, NULL);
+	ck_assert(r == 0);
+	r = tsm_screen_resize(con, 10, 4);
+	ck_assert(r == 0);
+	tsm_screen_set_max_sb(con, 100);
+
+	/* 30 lines and the empty cursor line, 4 of them are on the screen */
+	write_lines(con, 30);
+	ck_assert(tsm_screen_sb_get_pos(con) == 27);
+	ck_assert(top_symbol(con) == 'a' + 27 % 26);
+
+	tsm_screen_sb_set_pos(con, 0);
+	ck_assert(tsm_screen_sb_get_pos(con) == 0);
+	ck_assert(top_symbol(con) == 'a');
+
+	tsm_screen_sb_down(con, 5);
+	ck_assert(tsm_screen_sb_get_pos(con) == 5);
+	ck_assert(top_symbol(con) == 'f');
+
+	tsm_screen_sb_up(con, 100);
+	ck_assert(tsm_screen_sb_get_pos(con) == 0);
+
+	tsm_screen_sb_set_pos(con, 1000);
+	ck_assert(tsm_screen_sb_get_pos(con) == 27);
+	ck_assert(top_symbol(con) == 'a' + 27 % 26);
+
+	tsm_screen_sb_up(con, 1);
+	ck_assert(tsm_screen_sb_get_pos(con) == 26);
+	tsm_screen_sb_reset(con);
+	ck_assert(tsm_screen_sb_get_pos(con) == 27);
+
+	tsm_screen_unref(con);
+}
+END_TEST
+
+START_TEST(test_scrollback_recycle)
+{
+	struct tsm_screen *con;
+	unsigned int i;
+	int r;
+
+	r = tsm_screen_new(&con, NULL, NULL);
+	ck_assert(r == 0);
+	r = tsm_screen_resize(con, 10, 4);
+	ck_assert(r == 0);
+	tsm_screen_set_max_sb(con, 10);
+
+	/* only the newest 10 of the 97 lines that left the screen are kept */
+	write_lines(con, 100);
+	ck_assert(tsm_screen_sb_get_pos(con) == 10);
+	tsm_screen_sb_set_pos(con, 0);
+	ck_assert(top_symbol(con) == 'a' + 87 % 26);
+
+	/* lines dropped from the buffer are reused on the screen, cleared */
+	tsm_screen_sb_reset(con);
+	tsm_screen_newline(con);
+	tsm_screen_newline(con);
+	tsm_screen_newline(con);
+	ck_assert(top_symbol(con) == 0);
+
+	/* the position stays valid while the buffer shrinks */
+	tsm_screen_sb_set_pos(con, 5);
+	tsm_screen_set_max_sb(con, 3);
+	ck_assert(tsm_screen_sb_get_pos(con) <= 3);
+
+	for (i = 0; i < 3; ++i) {
+		tsm_screen_sb_set_pos(con, i);
+		ck_assert(tsm_screen_sb_get_pos(con) == i);
+	}
+
+	tsm_screen_clear_sb(con);
+	ck_assert(tsm_screen_sb_get_pos(con) == 0);
+
+	tsm_screen_unref(con);
+}
+END_TEST
+
+START_TEST(test_scrollback_compress)
+{
+	struct tsm_screen *con;
+	unsigned int i, pos;
+	char *str;
+	int r;
+
+	r = tsm_screen_new(&con, NULL, NULL);
+	ck_assert(r == 0);
+	r = tsm_screen_resize(con, 10, 4);
+	ck_assert(r == 0);
+	tsm_screen_set_max_sb(con, 1000);
+	tsm_screen_set_sb_compress(con, 4);
+
+	/* all but the newest lines of the buffer are compressed */
+	write_rows(con, 600);
+	ck_assert(tsm_screen_sb_get_pos(con) == 597);
+	for (i = 0; i < 20; ++i) {
+		pos = i * 31 % 597;
+		tsm_screen_sb_set_pos(con, pos);
+		ck_assert(top_symbol(con) == 'a' + pos % 26);
+	}
+
+	/* copy a selection from the middle of the compressed lines */
+	tsm_screen_sb_set_pos(con, 300);
+	tsm_screen_selection_start(con, 0, 0);
+	tsm_screen_selection_target(con, 0, 2);
+	r = tsm_screen_selection_copy(con, &str);
+	ck_assert(r == 23);
+	ck_assert(!strcmp(str, "oooooooooo\npppppppppp\nq"));
+	free(str);
+	tsm_screen_selection_reset(con);
+
+	/* compressed lines are recycled and dropped like others; the oldest
+	 * line left is row 597 of the first 600, and after shrinking the
+	 * buffer row 797 of the next 1000 */
+	write_rows(con, 1000);
+	tsm_screen_sb_set_pos(con, 0);
+	ck_assert(top_symbol(con) == 'a' + 597 % 26);
+	tsm_screen_set_max_sb(con, 200);
+	tsm_screen_sb_set_pos(con, 0);
+	ck_assert(top_symbol(con) == 'a' + 797 % 26);
+
+	tsm_screen_clear_sb(con);
+	ck_assert(tsm_screen_sb_get_pos(con) == 0);
+
+	tsm_screen_unref(con);
+}
+END_TEST
+
+START_TEST(test_scrollback_compress_attrs)
+{
+	struct tsm_screen *con;
+	struct tsm_screen_attr attr;
+	unsigned int i, j, c;
+	int r;
+
+	r = tsm_screen_new(&con, NULL, NULL);
+	ck_assert(r == 0);
+	r = tsm_screen_resize(con, 400, 4);
+	ck_assert(r == 0);
+	tsm_screen_set_max_sb(con, 1000);
+	tsm_screen_set_sb_compress(con, 200);
+
+	/* compressed lines of distinct attributes, then so many live ones that
+	 * unpacking them finds the attribute table full */
+	memset(&attr, 0, sizeof(attr));
+	attr.fccode = -1;
+	for (i = 0, c = 0; i < 570; ++i) {
+		for (j = 0; j < 400; ++j) {
+			if (i < 100 || i >= 400) {
+				attr.fr = c;
+				attr.fg = c >> 8;
+				attr.fb = c >> 16;
+				++c;
+			}
+			tsm_screen_write(con, 'a' + i % 26, &attr);
+		}
+		tsm_screen_newline(con);
+	}
+	ck_assert(tsm_screen_get_attr_generation(con) < 100);
+
+	/* the lines are unpacked, if with default attributes */
+	tsm_screen_sb_set_pos(con, 0);
+	ck_assert(top_symbol(con) == 'a');
+	ck_assert(tsm_screen_get_attr_generation(con) < 100);
+
+	tsm_screen_unref(con);
+}
+END_TEST
+
+START_TEST(test_scrollback_trim)
+{
+	struct tsm_screen *con;
+	struct tsm_screen_attr attr;
+	unsigned int i;
+	char *str;
+	int r;
+
+	r = tsm_screen_new(&con, NULL, NULL);
+	ck_assert(r == 0);
+	r = tsm_screen_resize(con, 10, 4);
+	ck_assert(r == 0);
+	tsm_screen_set_max_sb(con, 3);
+
+	/* scroll-back lines end with their last cell that is not blank */
+	memset(&attr, 0, sizeof(attr));
+	tsm_screen_write(con, 'a', &attr);
+	tsm_screen_write(con, 'b', &attr);
+	tsm_screen_newline(con);
+	tsm_screen_newline(con);
+	for (i = 0; i < 10; ++i)
+		tsm_screen_write(con, 'c', &attr);
+	tsm_screen_newline(con);
+	write_lines(con, 3);
+	ck_assert(tsm_screen_sb_get_pos(con) == 3);
+
+	/* but they are copied like screen lines, with their blank cells */
+	tsm_screen_sb_set_pos(con, 0);
+	tsm_screen_selection_start(con, 0, 0);
+	tsm_screen_selection_target(con, 9, 2);
+	r = tsm_screen_selection_copy(con, &str);
+	ck_assert(r == 32);
+	ck_assert(!memcmp(str, "ab\0\0\0\0\0\0\0\0\n"
+			       "\0\0\0\0\0\0\0\0\0\0\n"
+			       "cccccccccc", 33));
+	free(str);
+	tsm_screen_selection_reset(con);
+
+	tsm_screen_selection_start(con, 5, 0);
+	tsm_screen_selection_target(con, 7, 0);
+	r = tsm_screen_selection_copy(con, &str);
+	ck_assert(r == 3);
+	ck_assert(!memcmp(str, "\0\0\0", 4));
+	free(str);
+	tsm_screen_selection_reset(con);
+
+	/* trimmed blanks keep their attribute */
+	tsm_screen_sb_reset(con);
+	attr.bccode = 1;
+	tsm_screen_set_def_attr(con, &attr);
+	tsm_screen_write(con, 'e', &attr);
+	tsm_screen_erase_cursor_to_end(con, false);
+	tsm_screen_newline(con);
+	attr.bccode = 0;
+	tsm_screen_set_def_attr(con, &attr);
+	write_lines(con, 3);
+	tsm_screen_sb_set_pos(con, 2);
+	ck_assert(top_symbol(con) == 'e');
+	ck_assert(top_bg(con) == 1);
+
+	/* recycled lines come back to the screen with all of their cells */
+	write_lines(con, 10);
+	tsm_screen_sb_reset(con);
+	for (i = 0; i < 10; ++i)
+		tsm_screen_write(con, 'd', &attr);
+	tsm_screen_selection_start(con, 0, 3);
+	tsm_screen_selection_target(con, 9, 3);
+	r = tsm_screen_selection_copy(con, &str);
+	ck_assert(r == 10);
+	ck_assert(!strcmp(str, "dddddddddd"));
+	free(str);
+
+	tsm_screen_unref(con);
+}
+END_TEST
+
+START_TEST(test_scrollback_share)
+{
+	struct tsm_screen *con;
+	struct tsm_screen_attr attr;
+	unsigned int i, j;
+	int r;
+
+	r = tsm_screen_new(&con, NULL, NULL);
+	ck_assert(r == 0);
+	r = tsm_screen_resize(con, 10, 4);
+	ck_assert(r == 0);
+	tsm_screen_set_max_sb(con, 100);
+
+	/* use up some attribute ids that are dropped later */
+	memset(&attr, 0, sizeof(attr));
+	attr.fccode = -1;
+	for (i = 0; i < 100; ++i) {
+		attr.fr = i;
+		tsm_screen_move_to(con, 0, 0);
+		tsm_screen_write(con, 'x', &attr);
+	}
+
+	/* equal lines share their cells */
+	memset(&attr, 0, sizeof(attr));
+	attr.bccode = 2;
+	tsm_screen_move_to(con, 0, 0);
+	for (i = 0; i < 20; ++i) {
+		for (j = 0; j < 10; ++j)
+			tsm_screen_write(con, '-', &attr);
+		tsm_screen_newline(con);
+	}
+	ck_assert(tsm_screen_sb_get_pos(con) == 17);
+
+	/* renumbering the attribute ids rewrites shared cells only once */
+	memset(&attr, 0, sizeof(attr));
+	attr.fccode = -1;
+	for (i = 0; i < 70000; ++i) {
+		attr.fr = i;
+		attr.fg = i >> 8;
+		attr.fb = i >> 16;
+		tsm_screen_move_to(con, 0, 0);
+		tsm_screen_write(con, 'y', &attr);
+	}
+	ck_assert(tsm_screen_get_attr_generation(con) > 0);
+
+	for (i = 0; i < 17; ++i) {
+		tsm_screen_sb_set_pos(con, i);
+		ck_assert(top_symbol(con) == '-');
+		ck_assert(top_bg(con) == 2);
+	}
+
+	tsm_screen_unref(con);
+}
+END_TEST
+
+START_TEST(test_scrollback_archive)
+{
+	struct tsm_screen *con;
+	unsigned int i;
+	int r;
+
+	setenv("XDG_RUNTIME_DIR", "/tmp", 0);
+
+	r = tsm_screen_new(&con, NULL, NULL);
+	ck_assert(r == 0);
+	r = tsm_screen_resize(con, 10, 4);
+	ck_assert(r == 0);
+	tsm_screen_set_max_sb(con, 10);
+	r = tsm_screen_set_sb_archive(con, true);
+	ck_assert(r == 0);
+
+	/* the 87 lines dropped from the buffer are archived */
+	write_lines(con, 100);
+	ck_assert(tsm_screen_sb_get_pos(con) == 97);
+	for (i = 0; i < 97; i += 8) {
+		tsm_screen_sb_set_pos(con, i);
+		ck_assert(tsm_screen_sb_get_pos(con) == i);
+		ck_assert(top_symbol(con) == 'a' + i % 26);
+	}
+
+	/* a shown line that is archived stays where it is */
+	tsm_screen_sb_set_pos(con, 90);
+	tsm_screen_set_flags(con, TSM_SCREEN_FIXED_POS);
+	write_lines(con, 20);
+	ck_assert(tsm_screen_sb_get_pos(con) == 90);
+	ck_assert(top_symbol(con) == 'a' + 90 % 26);
+
+	tsm_screen_clear_sb(con);
+	ck_assert(tsm_screen_sb_get_pos(con) == 0);
+
+	r = tsm_screen_set_sb_archive(con, false);
+	ck_assert(r == 0);
+	tsm_screen_unref(con);
+}
+END_TEST
+
+START_TEST(test_scrollback_archive_full)
+{
+	struct tsm_screen *con;
+	struct tsm_screen_attr attr;
+	struct rlimit old, lim;
+	unsigned int i, j, pos;
+	int r;
+
+	setenv("XDG_RUNTIME_DIR", "/tmp", 0);
+
+	r = tsm_screen_new(&con, NULL, NULL);
+	ck_assert(r == 0);
+	r = tsm_screen_resize(con, 100, 4);
+	ck_assert(r == 0);
+	tsm_screen_set_max_sb(con, 10);
+	r = tsm_screen_set_sb_archive(con, true);
+	ck_assert(r == 0);
+
+	/* the archive cannot grow past its first megabyte, as if the file
+	 * system was full */
+	r = getrlimit(RLIMIT_FSIZE, &old);
+	ck_assert(r == 0);
+	lim = old;
+	lim.rlim_cur = 1024 * 1024;
+	r = setrlimit(RLIMIT_FSIZE, &lim);
+	ck_assert(r == 0);
+	signal(SIGXFSZ, SIG_IGN);
+
+	memset(&attr, 0, sizeof(attr));
+	for (i = 0; i < 10100; ++i) {
+		if (i == 10000)
+			pos = tsm_screen_sb_get_pos(con);
+		for (j = 0; j < 100; ++j)
+			tsm_screen_write(con, 'a' + i % 26, &attr);
+		tsm_screen_newline(con);
+	}
+
+	/* lines that do not fit are dropped, the others are kept */
+	ck_assert(pos > 10 && pos < 9997);
+	ck_assert(tsm_screen_sb_get_pos(con) == pos);
+	tsm_screen_sb_set_pos(con, 0);
+	ck_assert(top_symbol(con) == 'a');
+
+	signal(SIGXFSZ, SIG_DFL);
+	setrlimit(RLIMIT_FSIZE, &old);
+	tsm_screen_unref(con);
+}
+END_TEST
+
+START_TEST(test_scrollback_archive_attrs)
+{
+	struct tsm_screen *con;
+	struct tsm_screen_attr attr;
+	unsigned int i, j, c;
+	int r;
+
+	setenv("XDG_RUNTIME_DIR", "/tmp", 0);
+
+	r = tsm_screen_new(&con, NULL, NULL);
+	ck_assert(r == 0);
+	r = tsm_screen_resize(con, 400, 4);
+	ck_assert(r == 0);
+	tsm_screen_set_max_sb(con, 200);
+	r = tsm_screen_set_sb_archive(con, true);
+	ck_assert(r == 0);
+
+	/* archived lines of distinct attributes, then so many live ones that
+	 * decoding them finds the attribute table full */
+	memset(&attr, 0, sizeof(attr));
+	attr.fccode = -1;
+	for (i = 0, c = 0; i < 304; ++i) {
+		for (j = 0; j < 400; ++j, ++c) {
+			attr.fr = c;
+			attr.fg = c >> 8;
+			attr.fb = c >> 16;
+			tsm_screen_write(con, 'a' + i % 26, &attr);
+		}
+		tsm_screen_newline(con);
+	}
+
+	tsm_screen_sb_set_pos(con, 0);
+	ck_assert(top_symbol(con) == 'a');
+	ck_assert(tsm_screen_get_attr_generation(con) < 100);
+
+	r = tsm_screen_set_sb_archive(con, false);
+	ck_assert(r == 0);
+	tsm_screen_unref(con);
+}
+END_TEST
+
+START_TEST(test_scrollback_reflow)
+{
+	struct tsm_screen *con;
+	struct tsm_screen_attr attr;
+	unsigned int i, j;
+	char *str;
+	int r;
+
+	r = tsm_screen_new(&con, NULL, NULL);
+	ck_assert(r == 0);
+	r = tsm_screen_resize(con, 10, 4);
+	ck_assert(r == 0);
+	tsm_screen_set_max_sb(con, 100);
+	tsm_screen_set_flags(con, TSM_SCREEN_AUTO_WRAP);
+
+	/* soft-wrapped text is rewrapped for the new width */
+	memset(&attr, 0, sizeof(attr));
+	for (i = 0; i < 25; ++i)
+		tsm_screen_write(con, 'x', &attr);
+	tsm_screen_newline(con);
+	tsm_screen_write(con, 'a', &attr);
+	tsm_screen_write(con, 'b', &attr);
+	r = tsm_screen_resize(con, 20, 4);
+	ck_assert(r == 0);
+	ck_assert(tsm_screen_get_cursor_x(con) == 2);
+	ck_assert(tsm_screen_get_cursor_y(con) == 2);
+	ck_assert(tsm_screen_sb_get_pos(con) == 0);
+
+	/* rows that do not fit go to the scroll-back buffer, and copying the
+	 * selection joins them again */
+	r = tsm_screen_resize(con, 5, 4);
+	ck_assert(r == 0);
+	ck_assert(tsm_screen_get_cursor_x(con) == 2);
+	ck_assert(tsm_screen_get_cursor_y(con) == 3);
+	ck_assert(tsm_screen_sb_get_pos(con) == 2);
+
+	tsm_screen_sb_set_pos(con, 0);
+	tsm_screen_selection_start(con, 0, 0);
+	tsm_screen_sb_reset(con);
+	tsm_screen_selection_target(con, 1, 3);
+	r = tsm_screen_selection_copy(con, &str);
+	ck_assert(r == 28);
+	ck_assert(!strcmp(str, "xxxxxxxxxxxxxxxxxxxxxxxxx\nab"));
+	free(str);
+	tsm_screen_selection_reset(con);
+
+	/* and they come back if there is room again */
+	r = tsm_screen_resize(con, 10, 4);
+	ck_assert(r == 0);
+	ck_assert(tsm_screen_get_cursor_x(con) == 2);
+	ck_assert(tsm_screen_get_cursor_y(con) == 3);
+	ck_assert(tsm_screen_sb_get_pos(con) == 0);
+
+	/* the scroll-back buffer is reflowed in steps, newest lines first */
+	tsm_screen_newline(con);
+	for (i = 0; i < 10; ++i) {
+		for (j = 0; j < 15; ++j)
+			tsm_screen_write(con, 'a' + i, &attr);
+		tsm_screen_newline(con);
+	}
+	ck_assert(tsm_screen_sb_get_pos(con) == 21);
+	tsm_screen_sb_set_pos(con, 6);
+	ck_assert(top_symbol(con) == 'b');
+
+	r = tsm_screen_resize(con, 5, 4);
+	ck_assert(r == 0);
+	ck_assert(tsm_screen_sb_reflow(con, 1) == 18);
+	ck_assert(tsm_screen_sb_get_pos(con) == 6);
+	ck_assert(top_symbol(con) == 'b');
+	while (tsm_screen_sb_reflow(con, 4))
+		;
+	ck_assert(tsm_screen_sb_reflow(con, 4) == 0);
+
+	/* the shown line is still the first one of 'b' */
+	ck_assert(tsm_screen_sb_get_pos(con) == 9);
+	ck_assert(top_symbol(con) == 'b');
+	for (i = 0; i < 8; ++i) {
+		tsm_screen_sb_set_pos(con, 9 + i * 3);
+		ck_assert(top_symbol(con) == 'b' + i);
+	}
+
+	tsm_screen_unref(con);
+}
+END_TEST
+
+START_TEST(test_scrollback_reflow_sel)
+{
+	struct tsm_screen *con;
+	char *str;
+	int r;
+
+	r = tsm_screen_new(&con, NULL, NULL);
+	ck_assert(r == 0);
+	r = tsm_screen_resize(con, 30, 12);
+	ck_assert(r == 0);
+
+	/* a selection scrolled off the bottom stays on the screen */
+	tsm_screen_selection_start(con, 0, 10);
+	tsm_screen_selection_target(con, 5, 11);
+	tsm_screen_scroll_down(con, 12);
+	tsm_screen_scroll_down(con, 12);
+	r = tsm_screen_resize(con, 40, 12);
+	ck_assert(r == 0);
+
+	r = tsm_screen_selection_copy(con, &str);
+	ck_assert(r >= 0);
+	free(str);
+
+	tsm_screen_unref(con);
+}
+END_TEST
+
+START_TEST(test_scrollback_reflow_reuse)
+{
+	struct tsm_screen *con;
+	struct tsm_screen_attr attr;
+	unsigned int i;
+	int r;
+
+	r = tsm_screen_new(&con, NULL, NULL);
+	ck_assert(r == 0);
+	r = tsm_screen_resize(con, 10, 3);
+	ck_assert(r == 0);
+	tsm_screen_set_flags(con, TSM_SCREEN_AUTO_WRAP);
+
+	/* without a scroll-back buffer the soft-wrapped top line is cleared
+	 * and reused at the bottom; it must not be joined with the next one,
+	 * which would move the cursor behind the 'a' */
+	memset(&attr, 0, sizeof(attr));
+	for (i = 0; i < 15; ++i)
+		tsm_screen_write(con, 'x', &attr);
+	tsm_screen_newline(con);
+	tsm_screen_newline(con);
+	tsm_screen_write(con, 'a', &attr);
+	tsm_screen_newline(con);
+	tsm_screen_write(con, 'b', &attr);
+
+	r = tsm_screen_resize(con, 20, 3);
+	ck_assert(r == 0);
+	ck_assert(tsm_screen_get_cursor_x(con) == 1);
+	ck_assert(tsm_screen_get_cursor_y(con) == 2);
+
+	tsm_screen_unref(con);
+}
+END_TEST
+
+TEST_DEFINE_CASE(misc)
+	TEST(test_scrollback_null)
+TEST_END_CASE
+
+TEST_DEFINE_CASE(pos)
+	TEST(test_scrollback_pos)
+	TEST(test_scrollback_recycle)
+TEST_END_CASE
+
+TEST_DEFINE_CASE(compress)
+	TEST(test_scrollback_compress)
+	TEST(test_scrollback_compress_attrs)
+TEST_END_CASE
+
+TEST_DEFINE_CASE(trim)
+	TEST(test_scrollback_trim)
+TEST_END_CASE
+
+TEST_DEFINE_CASE(share)
+	TEST(test_scrollback_share)
+TEST_END_CASE
+
+TEST_DEFINE_CASE(archive)
+	TEST(test_scrollback_archive)
+	TEST(test_scrollback_archive_full)
+	TEST(test_scrollback_archive_attrs)
+TEST_END_CASE
+
+TEST_DEFINE_CASE(reflow)
+	TEST(test_scrollback_reflow)
+	TEST(test_scrollback_reflow_reuse)
+	TEST(test_scrollback_reflow_sel)
+TEST_END_CASE
+
+TEST_DEFINE(
+	TEST_SUITE(scrollback,
+		TEST_CASE(misc),
+		TEST_CASE(pos),
+		TEST_CASE(compress),
+		TEST_CASE(trim),
+		TEST_CASE(share),
+		TEST_CASE(archive),
+		TEST_CASE(reflow),
+		TEST_END
+	)
+)
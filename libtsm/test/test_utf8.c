@@ -0,0 +1,283 @@
+/*
+ * TSM - UTF8 Decoder Tests
+ *
+ * Copyright (c) 2012-2013 David Herrmann <dh.herrmann@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include <string.h>
+#include "test_common.h"
+
+/* Decode @u8 in chunks of random size and compare the output against the
+ * byte-wise reference decoder. Both are called with the same random output
+ * sizes so they have to stop at exactly the same positions. */
+static void check_decode_once(const char *u8, size_t len, unsigned int seed)
+{
+	struct tsm_utf8_mach *m1, *m2;
+	uint32_t out1[64], out2[64];
+	size_t pos1, pos2, end, chunk, n1, n2, r1, r2;
+	int r;
+
+	r = tsm_utf8_mach_new(&m1);
+	ck_assert(!r);
+	r = tsm_utf8_mach_new(&m2);
+	ck_assert(!r);
+
+	srand(seed);
+	pos1 = 0;
+	pos2 = 0;
+	while (pos1 < len) {
+		chunk = 1 + rand() % 80;
+		end = pos1 + chunk;
+		if (end > len)
+			end = len;
+
+		while (pos1 < end) {
+			n1 = 1 + rand() % 64;
+			n2 = n1;
+			r1 = tsm_utf8_mach_decode(m1, &u8[pos1], end - pos1,
+						  out1, &n1);
+			r2 = tsm_utf8_mach_decode_ref(m2, &u8[pos2],
+						      end - pos2, out2, &n2);
+			ck_assert(r1 > 0);
+			ck_assert(r1 == r2);
+			ck_assert(n1 == n2);
+			ck_assert(!memcmp(out1, out2, n1 * sizeof(*out1)));
+			pos1 += r1;
+			pos2 += r2;
+		}
+	}
+
+	tsm_utf8_mach_free(m2);
+	tsm_utf8_mach_free(m1);
+}
+
+/* check_decode_once() with and without the SIMD decoders */
+static void check_decode(const char *u8, size_t len, unsigned int seed)
+{
+	tsm_utf8_set_simd(false);
+	check_decode_once(u8, len, seed);
+	if (tsm_utf8_set_simd(true))
+		check_decode_once(u8, len, seed);
+}
+
+START_TEST(test_utf8_null)
+{
+	uint32_t out[4];
+	size_t n = 4, r;
+
+	r = tsm_utf8_mach_decode(NULL, "a", 1, out, &n);
+	ck_assert(!r);
+}
+END_TEST
+
+START_TEST(test_utf8_ascii)
+{
+	struct tsm_utf8_mach *mach;
+	uint32_t out[128];
+	char buf[100];
+	size_t i, n, r;
+	int ret;
+
+	for (i = 0; i < sizeof(buf); ++i)
+		buf[i] = 0x20 + i % 0x5f;
+	buf[70] = '\n';
+
+	ret = tsm_utf8_mach_new(&mach);
+	ck_assert(!ret);
+
+	/* stops right after the control character */
+	n = 128;
+	r = tsm_utf8_mach_decode(mach, buf, sizeof(buf), out, &n);
+	ck_assert(r == 71);
+	ck_assert(n == 71);
+	for (i = 0; i < 70; ++i)
+		ck_assert(out[i] == (uint32_t)buf[i]);
+	ck_assert(out[70] == '\n');
+
+	/* stops when the output is full */
+	n = 10;
+	r = tsm_utf8_mach_decode(mach, &buf[71], sizeof(buf) - 71, out, &n);
+	ck_assert(r == 10);
+	ck_assert(n == 10);
+
+	tsm_utf8_mach_free(mach);
+}
+END_TEST
+
+START_TEST(test_utf8_split)
+{
+	static const char str[] = "a\xc3\xa4\xe2\x82\xac\xf0\x9f\x98\x80z";
+	static const uint32_t res[] = { 'a', 0xe4, 0x20ac, 0x1f600, 'z' };
+	struct tsm_utf8_mach *mach;
+	uint32_t out[8];
+	size_t i, n, r, cnt = 0;
+	int ret;
+
+	ret = tsm_utf8_mach_new(&mach);
+	ck_assert(!ret);
+
+	/* feed one byte at a time so every sequence is split */
+	for (i = 0; i < sizeof(str) - 1; ++i) {
+		n = 8 - cnt;
+		r = tsm_utf8_mach_decode(mach, &str[i], 1, &out[cnt], &n);
+		ck_assert(r == 1);
+		cnt += n;
+	}
+
+	ck_assert(cnt == 5);
+	ck_assert(!memcmp(out, res, sizeof(res)));
+
+	tsm_utf8_mach_free(mach);
+}
+END_TEST
+
+START_TEST(test_utf8_random)
+{
+	static const unsigned char pool[] = {
+		0x00, 0x0a, 0x1b, 0x20, 0x41, 0x7e, 0x7f, 0x80, 0x8f, 0x9b,
+		0xbf, 0xc0, 0xc1, 0xc2, 0xc3, 0xdf, 0xe0, 0xe2, 0xef, 0xf0,
+		0xf4, 0xf7, 0xf8, 0xfe, 0xff,
+	};
+	char buf[4096];
+	unsigned int seed;
+	size_t i;
+
+	for (seed = 1; seed <= 64; ++seed) {
+		srand(seed);
+		for (i = 0; i < sizeof(buf); ++i) {
+			/* mostly text with some noise in between */
+			if (rand() % 4)
+				buf[i] = 0x20 + rand() % 0x5f;
+			else
+				buf[i] = pool[rand() % sizeof(pool)];
+		}
+
+		check_decode(buf, sizeof(buf), seed);
+	}
+}
+END_TEST
+
+START_TEST(test_utf8_valid)
+{
+	char buf[4096];
+	unsigned int seed;
+	uint32_t ch;
+	size_t i, n;
+
+	for (seed = 1; seed <= 16; ++seed) {
+		srand(seed);
+		for (i = 0; i + 4 <= sizeof(buf); i += n) {
+			switch (rand() % 4) {
+			case 0:
+				ch = 0x20 + rand() % 0x5f;
+				break;
+			case 1:
+				ch = 0x80 + rand() % 0x780;
+				break;
+			case 2:
+				ch = 0x800 + rand() % 0xf800;
+				break;
+			default:
+				ch = 0x10000 + rand() % 0x100000;
+				break;
+			}
+			n = tsm_ucs4_to_utf8(ch, &buf[i]);
+		}
+
+		check_decode(buf, i, seed);
+	}
+}
+END_TEST
+
+START_TEST(test_utf8_dense)
+{
+	static const uint32_t ranges[][2] = {
+		{ 0x80, 0x80 },		/* C1 controls and Latin-1 */
+		{ 0x400, 0x100 },	/* Cyrillic */
+		{ 0x2500, 0x80 },	/* box drawing */
+		{ 0x4e00, 0x5200 },	/* CJK */
+		{ 0x1f300, 0x800 },	/* emoji */
+	};
+	static const char *noise[] = {
+		"\n", " ", "\x80", "\xbf", "\xc0", "\xc1", "\xe2", "\xf0",
+		"\xf8", "\xff",
+		"\xe0\x80\x8a",		/* overlong LF */
+		"\xe0\x82\x85",		/* overlong NEL */
+		"\xf0\x80\x81\xbf",	/* overlong DEL */
+	};
+	const unsigned int nranges = sizeof(ranges) / sizeof(*ranges);
+	char buf[4096];
+	unsigned int seed, r, script = 0, run = 0;
+	uint32_t ch;
+	size_t i, n;
+
+	/* almost only multi-byte sequences, in runs of one script or mixed, so
+	 * most blocks are decoded in groups and sequences are split at every
+	 * possible block offset */
+	for (seed = 1; seed <= 64; ++seed) {
+		srand(seed);
+		for (i = 0; i + 4 <= sizeof(buf); ) {
+			if (!(rand() % 64)) {
+				r = rand() % (sizeof(noise) / sizeof(*noise));
+				n = strlen(noise[r]);
+				if (i + n > sizeof(buf))
+					break;
+				memcpy(&buf[i], noise[r], n);
+				i += n;
+				continue;
+			}
+
+			/* script @nranges mixes all of them */
+			if (!run--) {
+				run = rand() % 64;
+				script = rand() % (nranges + 1);
+			}
+			r = script < nranges ? script : rand() % nranges;
+			ch = ranges[r][0] + rand() % ranges[r][1];
+			i += tsm_ucs4_to_utf8(ch, &buf[i]);
+		}
+
+		check_decode(buf, i, seed);
+	}
+}
+END_TEST
+
+TEST_DEFINE_CASE(misc)
+	TEST(test_utf8_null)
+	TEST(test_utf8_ascii)
+	TEST(test_utf8_split)
+TEST_END_CASE
+
+TEST_DEFINE_CASE(diff)
+	TEST(test_utf8_random)
+	TEST(test_utf8_valid)
+	TEST(test_utf8_dense)
+TEST_END_CASE
+
+TEST_DEFINE(
+	TEST_SUITE(utf8,
+		TEST_CASE(misc),
+		TEST_CASE(diff),
+		TEST_END
+	)
+)
@@ -27,6 +27,7 @@
 
 #include "vte.h"
 #include "terminal.h"
+#include "rasterizer.h"
 #include "wayland-dropdown-client-protocol.h"
 
 class Term
@@ -107,8 +108,11 @@ const wl_registry_listener Term::s_registryListener = {
 
 void usage()
 {
-    printf("Usage: termistor [-w]\n\n");
+    printf("Usage: termistor [-w] [-t] [-p] [-s]\n\n");
     printf("  -w    run in a normal window\n");
+    printf("  -t    parse the shell output on a separate thread\n");
+    printf("  -p    paint with QPainter instead of the software rasterizer\n");
+    printf("  -s    keep unlimited scroll-back in $XDG_RUNTIME_DIR\n");
     printf("  -h    show this help\n");
 }
 
@@ -124,6 +128,12 @@ int main(int argc, char *argv[])
         QString arg = app.arguments().at(i);
         if (arg == "-w") {
             window = true;
+        } else if (arg == "-t") {
+            VTE::setThreaded(true);
+        } else if (arg == "-p") {
+            Rasterizer::setEnabled(false);
+        } else if (arg == "-s") {
+            VTE::setDiskScrollback(true);
         } else if (arg == "-h") {
             usage();
             return 0;
@@ -0,0 +1,161 @@
+/*
+ * Copyright 2013 Giulio Camuffo <giuliocamuffo@gmail.com>
+ *
+ * This file is part of Termistor
+ *
+ * Termistor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Termistor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Termistor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include <QImage>
+#include <QPainter>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "rasterizer.h"
+
+static bool s_enabled = true;
+
+void Rasterizer::setEnabled(bool enabled)
+{
+    s_enabled = enabled;
+}
+
+QImage *Rasterizer::target(QPainter *painter, QPoint *offset)
+{
+    if (!s_enabled) {
+        return nullptr;
+    }
+
+    const QTransform &transform = painter->worldTransform();
+    QPaintDevice *device = painter->device();
+    if (device->devType() != QInternal::Image || transform.type() > QTransform::TxTranslate) {
+        return nullptr;
+    }
+
+    QImage *image = static_cast<QImage *>(device);
+    if ((image->format() != QImage::Format_ARGB32_Premultiplied && image->format() != QImage::Format_RGB32) ||
+        image->devicePixelRatio() != 1) {
+        return nullptr;
+    }
+
+    *offset = QPoint(transform.dx(), transform.dy());
+    return image;
+}
+
+void Rasterizer::fill(QImage *image, const QRect &r, QRgb color)
+{
+    const QRect rect = r & image->rect();
+    if (image->format() == QImage::Format_RGB32) {
+        color |= 0xff000000;
+    }
+
+#ifdef __SSE2__
+    const __m128i c = _mm_set1_epi32(color);
+#endif
+    for (int y = rect.top(); y <= rect.bottom(); ++y) {
+        QRgb *line = reinterpret_cast<QRgb *>(image->scanLine(y)) + rect.x();
+        int x = 0;
+#ifdef __SSE2__
+        for (; x + 4 <= rect.width(); x += 4) {
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(line + x), c);
+        }
+#endif
+        for (; x < rect.width(); ++x) {
+            line[x] = color;
+        }
+    }
+}
+
+// (color * a + dst * (255 - a)) / 255 for every channel. Two channels are
+// done at once, the division is done as (t + 0x80 + ((t + 0x80) >> 8)) >> 8,
+// like the vector version below.
+static inline uint blendPixel(uint dst, uint color, uint a)
+{
+    const uint na = 255 - a;
+
+    uint rb = (color & 0xff00ff) * a + (dst & 0xff00ff) * na + 0x800080;
+    rb = ((rb + ((rb >> 8) & 0xff00ff)) >> 8) & 0xff00ff;
+
+    uint ag = ((color >> 8) & 0xff00ff) * a + ((dst >> 8) & 0xff00ff) * na + 0x800080;
+    ag = (ag + ((ag >> 8) & 0xff00ff)) & 0xff00ff00;
+
+    return rb | ag;
+}
+
+#ifdef __SSE2__
+// Same as blendPixel() on two pixels unpacked to 16 bits per channel, with
+// their coverage repeated over their channels.
+static inline __m128i blendPixels(__m128i dst, __m128i color, __m128i a)
+{
+    const __m128i na = _mm_sub_epi16(_mm_set1_epi16(255), a);
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(color, a), _mm_mullo_epi16(dst, na));
+    t = _mm_add_epi16(t, _mm_set1_epi16(0x80));
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+#endif
+
+void Rasterizer::blendMask(QImage *image, const QPoint &pos, const QImage &mask, const QRect &src, QRgb color)
+{
+    const QRect rect = QRect(pos, src.size()) & image->rect();
+    const int dx = src.x() - pos.x();
+    const int dy = src.y() - pos.y();
+    color |= 0xff000000;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i c = _mm_set1_epi32(color);
+    const __m128i c16 = _mm_unpacklo_epi8(c, zero);
+#endif
+    for (int y = rect.top(); y <= rect.bottom(); ++y) {
+        const uchar *m = mask.constScanLine(y + dy) + dx + rect.x();
+        QRgb *line = reinterpret_cast<QRgb *>(image->scanLine(y)) + rect.x();
+        int x = 0;
+#ifdef __SSE2__
+        for (; x + 4 <= rect.width(); x += 4) {
+            uint32_t m4;
+            memcpy(&m4, m + x, 4);
+            if (m4 == 0) {
+                continue;
+            }
+            __m128i *p = reinterpret_cast<__m128i *>(line + x);
+            if (m4 == 0xffffffff) {
+                _mm_storeu_si128(p, c);
+                continue;
+            }
+
+            // a0 a0 a0 a0 a1 a1 a1 a1 ... a3
+            __m128i a = _mm_cvtsi32_si128(m4);
+            a = _mm_unpacklo_epi8(a, a);
+            a = _mm_unpacklo_epi16(a, a);
+
+            const __m128i d = _mm_loadu_si128(p);
+            const __m128i lo = blendPixels(_mm_unpacklo_epi8(d, zero), c16, _mm_unpacklo_epi8(a, zero));
+            const __m128i hi = blendPixels(_mm_unpackhi_epi8(d, zero), c16, _mm_unpackhi_epi8(a, zero));
+            _mm_storeu_si128(p, _mm_packus_epi16(lo, hi));
+        }
+#endif
+        for (; x < rect.width(); ++x) {
+            const uint a = m[x];
+            if (a == 255) {
+                line[x] = color;
+            } else if (a) {
+                line[x] = blendPixel(line[x], color, a);
+            }
+        }
+    }
+}
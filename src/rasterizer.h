@@ -0,0 +1,47 @@
+#ifndef RASTERIZER_H
+#define RASTERIZER_H
+/*
+ * Copyright 2013 Giulio Camuffo <giuliocamuffo@gmail.com>
+ *
+ * This file is part of Termistor
+ *
+ * Termistor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Termistor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Termistor.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QColor>
+
+class QImage;
+class QPainter;
+class QPoint;
+class QRect;
+
+// Software renderer writing straight into the image behind a raster
+// backing store, instead of going through QPainter for every cell.
+class Rasterizer
+{
+public:
+    static void setEnabled(bool enabled);
+
+    // The image painter draws on, if the rasterizer is enabled and can draw
+    // on it, or nullptr. offset is set to the painter's translation.
+    static QImage *target(QPainter *painter, QPoint *offset);
+
+    // Fill rect with the premultiplied color.
+    static void fill(QImage *image, const QRect &rect, QRgb color);
+    // Blend the opaque color into image at pos, using the src part of the
+    // Alpha8 mask as its coverage.
+    static void blendMask(QImage *image, const QPoint &pos, const QImage &mask, const QRect &src, QRgb color);
+};
+
+#endif
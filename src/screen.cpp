@@ -18,7 +18,9 @@
  */
 
 #include <assert.h>
+#include <string.h>
 #include <math.h>
+#include <algorithm>
 
 #include <QColor>
 #include <QFontMetrics>
@@ -26,97 +28,212 @@
 #include <QWheelEvent>
 #include <QKeyEvent>
 #include <QLinkedList>
+#include <QTimer>
 #include <QDebug>
 
 #include "screen.h"
 #include "vte.h"
 #include "terminal.h"
+#include "rasterizer.h"
 
+// Longest time a synchronized update (DEC mode 2026) may hold back frames
+static const int SyncUpdateTimeout = 150;
+
+// What was last drawn in a cell. Cells are plain data stored row after row,
+// and compared with memcmp. A zeroed cell never matches a drawn one, as its
+// foreground is never transparent.
 struct Cell {
+    enum Style {
+        Bold = 1,
+        Underline = 2,
+        Outline = 4,
+    };
+
     uint32_t id;
-    QString str;
-    QColor color;
-    QColor bgColor;
-    bool bold;
-    bool underline;
-    bool outline;
+    QRgb fg;
+    QRgb bg;
+    uint32_t style;
 };
 
-class Image
-{
+// Glyphs are cached as alpha masks once per symbol and weight, whatever
+// their color is, packed in a few big atlas pages. Every glyph is one cell
+// high, so a page is filled row after row. When all the pages are full the
+// one used least recently is emptied, unless the frame being prepared uses
+// them all, in which case another page is added.
+struct AtlasGlyph {
+    int page;
+    QRect rect;
+};
+
+struct AtlasPage {
+    QImage image;
+    int x;
+    int y;
+    unsigned int lastUsed;
+    QVector<quint64> keys;
+};
+
+static const int AtlasPageSize = 1024;
+static const int AtlasMaxPages = 4;
+
+class GlyphAtlas {
 public:
-    Image()
-        : prev(nullptr)
-        , next(nullptr)
+    GlyphAtlas()
+        : current(-1)
+        , frame(0)
+        , hits(0)
+        , misses(0)
     {
     }
 
-    void insert(Image *pr)
+    static quint64 key(uint32_t id, bool bold) { return (quint64)id << 1 | bold; }
+
+    bool find(quint64 key, AtlasGlyph *glyph)
     {
-        remove();
-        if (pr == this) {
-            return;
-        }
-        if (pr->next) {
-            pr->next->prev = this;
+        QHash<quint64, AtlasGlyph>::const_iterator it = glyphs.constFind(key);
+        if (it == glyphs.constEnd()) {
+            ++misses;
+            return false;
         }
-        pr->next = this;
-        prev = pr;
+        ++hits;
+        *glyph = *it;
+        pages[glyph->page].lastUsed = frame;
+        return true;
     }
-    void remove()
+
+    // Make room for a glyph of the given size.
+    AtlasGlyph insert(quint64 key, const QSize &size)
     {
-        if (prev) {
-            prev->next = next;
+        if (current < 0 || !advance(&pages[current], size)) {
+            current = -1;
+            if (pages.size() >= AtlasMaxPages) {
+                for (int i = 0; i < pages.size(); ++i) {
+                    if (pages[i].lastUsed != frame && (current < 0 || pages[i].lastUsed < pages[current].lastUsed)) {
+                        current = i;
+                    }
+                }
+            }
+            if (current < 0) {
+                AtlasPage page;
+                page.image = QImage(AtlasPageSize, AtlasPageSize, QImage::Format_Alpha8);
+                pages.append(page);
+                current = pages.size() - 1;
+            }
+
+            AtlasPage &page = pages[current];
+            for (quint64 k: page.keys) {
+                glyphs.remove(k);
+            }
+            page.keys.clear();
+            page.x = 0;
+            page.y = 0;
+            advance(&page, size);
         }
-        if (next) {
-            next->prev = prev;
+
+        AtlasPage &page = pages[current];
+        AtlasGlyph glyph;
+        glyph.page = current;
+        glyph.rect = QRect(QPoint(page.x, page.y), size);
+        page.x += size.width();
+        page.lastUsed = frame;
+        page.keys.append(key);
+        glyphs.insert(key, glyph);
+        return glyph;
+    }
+
+    int size() const { return pages.size() * AtlasPageSize * AtlasPageSize; }
+
+    QHash<quint64, AtlasGlyph> glyphs;
+    QVector<AtlasPage> pages;
+    int current;
+    unsigned int frame;
+    int hits;
+    int misses;
+
+private:
+    // Move the packing position to the next row if size doesn't fit in
+    // the current one, and tell whether it fits in the page at all.
+    static bool advance(AtlasPage *page, const QSize &size)
+    {
+        if (page->x + size.width() > AtlasPageSize) {
+            page->x = 0;
+            page->y += size.height();
         }
-        prev = nullptr;
-        next = nullptr;
+        return page->y + size.height() <= AtlasPageSize;
     }
+};
 
-    QImage image;
-    Image *prev;
-    Image *next;
+static GlyphAtlas s_atlas;
+
+// What drawCell() asks for is not painted right away but collected here and
+// flushed once per frame: first the fills, then the glyphs, then the lines
+// going over them. Cells come in row order, so fills continuing the previous
+// one with the same color are merged with it, and so are runs of glyphs.
+struct Fill {
+    QRect rect;
     QRgb color;
-    QHash<QRgb, Image *> *container;
 };
 
-class Glyph {
-public:
-    QHash<QRgb, Image *> normalGlyphs;
-    QHash<QRgb, Image *> boldGlyphs;
-    QHash<QRgb, Image *> underlineGlyphs;
-    QHash<QRgb, Image *> boldAndUnderlineGlyphs;
+struct GlyphRun {
+    QPoint pos;
+    int width;
+    QRgb color;
+    // range in s_batch.glyphs
+    int first;
+    int count;
 };
 
-class Cache {
-public:
-    Cache()
-        : numImages(0)
-        , size(0)
-        , firstImg(nullptr)
-        , lastImg(nullptr)
-    {
-    }
-    ~Cache()
-    {
-        Image *img = firstImg;
-        while (img) {
-            Image *prev = img->prev;
-            delete img;
-            img = prev;
+static struct {
+    QVector<Fill> fills;
+    QVector<GlyphRun> runs;
+    QVector<AtlasGlyph> glyphs;
+    QVector<Fill> lines;
+    // scratch image the masks are tinted into, when not blitting directly
+    QImage tinted;
+} s_batch;
+
+static void queueFill(QVector<Fill> *fills, const QRect &rect, QRgb color)
+{
+    if (!fills->isEmpty()) {
+        Fill &last = fills->last();
+        if (last.color == color && last.rect.y() == rect.y() && last.rect.height() == rect.height() &&
+            last.rect.right() + 1 == rect.x()) {
+            last.rect.setRight(rect.right());
+            return;
         }
     }
+    fills->append({ rect, color });
+}
 
-    QHash<uint32_t, Glyph> glyphs;
-    int numImages;
-    int size;
-    Image *firstImg;
-    Image *lastImg;
-};
+static void queueGlyph(const QPoint &pos, const AtlasGlyph &glyph, QRgb color)
+{
+    s_batch.glyphs.append(glyph);
+    if (!s_batch.runs.isEmpty()) {
+        GlyphRun &last = s_batch.runs.last();
+        if (last.color == color && last.pos.y() == pos.y() && last.pos.x() + last.width == pos.x()) {
+            last.width += glyph.rect.width();
+            ++last.count;
+            return;
+        }
+    }
+    s_batch.runs.append({ pos, glyph.rect.width(), color, s_batch.glyphs.size() - 1, 1 });
+}
 
-static Cache s_cache;
+// Fill target at pos with color, using the src part of mask as its coverage.
+static void tintMask(const QImage &mask, const QRect &src, QRgb color, QImage *target, int pos)
+{
+    const int r = qRed(color);
+    const int g = qGreen(color);
+    const int b = qBlue(color);
+    for (int y = 0; y < src.height(); ++y) {
+        const uchar *m = mask.constScanLine(src.y() + y) + src.x();
+        QRgb *dst = reinterpret_cast<QRgb *>(target->scanLine(y)) + pos;
+        for (int x = 0; x < src.width(); ++x) {
+            const int a = m[x];
+            dst[x] = qRgba(r * a / 255, g * a / 255, b * a / 255, a);
+        }
+    }
+}
 
 Screen::Screen(Terminal *t, const QString &name)
       : QObject()
@@ -131,12 +248,21 @@ Screen::Screen(Terminal *t, const QString &name)
       , m_hasFocus(false)
       , m_backgroundAlpha(250)
       , m_accumDelta(0)
+      , m_serial(0)
+      , m_marginsDirty(true)
+      , m_syncTimer(new QTimer(this))
+      , m_attrGeneration(0)
 {
+    m_syncTimer->setSingleShot(true);
+    connect(m_syncTimer, &QTimer::timeout, this, &Screen::update);
+
     m_renderdata.font = QFont("Monospace");
     m_renderdata.font.setPixelSize(12);
     QFontMetrics metrics(m_renderdata.font);
     m_renderdata.cellW = metrics.width(' ');
     m_renderdata.cellH = metrics.height();
+    m_renderdata.underlinePos = metrics.ascent() + metrics.underlinePos();
+    m_renderdata.lineWidth = qMax(1, metrics.lineWidth());
     m_renderdata.age = 0;
 }
 
@@ -160,19 +286,19 @@ void Screen::initCells()
         return;
     }
 
+    // Nothing of the old grid is worth keeping: the backing store loses its
+    // pixels on a resize and everything is drawn again anyway.
+    delete[] m_cells;
+    m_cells = new Cell[rows * columns]();
+
     m_columns = columns;
     m_rows = rows;
     m_renderdata.age = 0;
     m_screenSize = screenSize;
 
-
-    if (m_cells) {
-        delete[] m_cells;
-    }
-
-    m_cells = new Cell[m_rows * m_columns];
-
+    m_vte->mutex()->lock();
     tsm_screen_resize(m_vte->screen(), m_columns, m_rows);
+    m_vte->mutex()->unlock();
     m_vte->resize(m_rows, m_columns);
 }
 
@@ -181,114 +307,172 @@ QString Screen::name() const
     return m_name;
 }
 
-int Screen::drawCell(uint32_t id, const uint32_t *ch, size_t len, uint32_t width, unsigned int posx, unsigned int posy, const tsm_screen_attr *attr, tsm_age_t age)
+// Resolve the attributes with the given id, once per id.
+const Screen::AttrColors &Screen::attrColors(const ScreenSnapshot &snapshot, uint16_t attr, bool inverse)
+{
+    const int index = attr * 2 + inverse;
+    if (index >= m_attrColors.size()) {
+        m_attrColors.resize(attr * 2 + 2);
+    }
+
+    AttrColors &colors = m_attrColors[index];
+    if (!colors.valid) {
+        const tsm_screen_attr &a = snapshot.attrs.at(attr);
+        if (inverse) {
+            colors.fg = qRgb(a.br, a.bg, a.bb);
+            colors.bg = qRgba(a.fr, a.fg, a.fb, m_backgroundAlpha);
+        } else {
+            colors.fg = qRgb(a.fr, a.fg, a.fb);
+            colors.bg = qRgba(a.br, a.bg, a.bb, m_backgroundAlpha);
+        }
+        colors.style = (a.bold ? Cell::Bold : 0) | (a.underline ? Cell::Underline : 0);
+        colors.valid = true;
+    }
+    return colors;
+}
+
+void Screen::drawCell(const ScreenSnapshot &snapshot, int index, unsigned int posx, unsigned int posy, tsm_age_t age)
 {
     if (age && m_renderdata.age && age <= m_renderdata.age && !m_forceRedraw) {
-        return 0;
+        return;
     }
 
+    const ScreenSnapshot::Cell &c = snapshot.cells.at(index);
+    const uint32_t id = c.id;
+    const uint32_t *ch = snapshot.chars.constData() + c.ch;
+    const size_t len = c.len;
+    const uint32_t width = c.width;
+
     Cell &cell = m_cells[posy * m_columns + posx];
-    bool outline = attr->inverse && m_cursor == &cell && !m_hasFocus;
-
-    uint8_t fr, fg, fb, br, bg, bb;
-    if (attr->inverse && !outline) {
-        fr = attr->br;
-        fg = attr->bg;
-        fb = attr->bb;
-        br = attr->fr;
-        bg = attr->fg;
-        bb = attr->fb;
-    } else {
-        fr = attr->fr;
-        fg = attr->fg;
-        fb = attr->fb;
-        br = attr->br;
-        bg = attr->bg;
-        bb = attr->bb;
-    }
-    QColor  c(fr, fg, fb);
-    QColor bgc(br, bg, bb, m_backgroundAlpha);
-
-    if (cell.id != id || cell.color != c || cell.bgColor != bgc ||
-        cell.bold != attr->bold || cell.underline != attr->underline || outline != cell.outline || m_forceRedraw) {
-        cell.id = id;
-        cell.color = c;
-        cell.bgColor = bgc;
-        cell.bold = attr->bold;
-        cell.underline = attr->underline;
-        cell.outline = outline;
-        if (len) {
-            cell.str = QString::fromUcs4(ch, len);
-        }
+    bool outline = c.inverse && m_cursor == &cell && !m_hasFocus;
+
+    const AttrColors &colors = attrColors(snapshot, c.attr, c.inverse && !outline);
+    Cell next;
+    next.id = id;
+    next.fg = colors.fg;
+    next.bg = colors.bg;
+    next.style = colors.style | (outline ? Cell::Outline : 0);
+
+    if (memcmp(&cell, &next, sizeof(Cell)) || m_forceRedraw) {
+        cell = next;
 
         QRect rect(posx * m_renderdata.cellW, posy * m_renderdata.cellH, width * m_renderdata.cellW, m_renderdata.cellH);
 
-        m_painter->setCompositionMode(QPainter::CompositionMode_Source);
-        m_painter->fillRect(rect, bgc);
+        // rows are drawn in order, so one rectangle per row is enough
+        if (!m_damage.isEmpty() && m_damage.last().y() == rect.y()) {
+            m_damage.last() |= rect;
+        } else {
+            m_damage.append(rect);
+        }
+
+        const QRgb crgb = cell.fg;
+        queueFill(&s_batch.fills, rect, cell.bg);
         if (outline) {
-            m_painter->setPen(c);
-            m_painter->drawRect(rect.x(), rect.y(), rect.width() - 1, rect.height() - 1);
+            queueFill(&s_batch.fills, QRect(rect.x(), rect.y(), rect.width(), 1), crgb);
+            queueFill(&s_batch.fills, QRect(rect.x(), rect.bottom(), rect.width(), 1), crgb);
+            queueFill(&s_batch.fills, QRect(rect.x(), rect.y(), 1, rect.height()), crgb);
+            queueFill(&s_batch.fills, QRect(rect.right(), rect.y(), 1, rect.height()), crgb);
         }
         if (len) {
-            QRgb crgb = c.rgb();
-
-            Glyph &glyph = s_cache.glyphs[id];
-            QHash<QRgb, Image *> *hash = &glyph.normalGlyphs;
-            if (!cell.underline && cell.bold) {
-                hash = &glyph.boldGlyphs;
-            } else if (cell.underline && !cell.bold) {
-                hash = &glyph.underlineGlyphs;
-            } else if (cell.underline && cell.bold) {
-                hash = &glyph.boldAndUnderlineGlyphs;
-            }
-            Image *img = nullptr;
-            if (!hash->contains(crgb)) {
-                img = new Image;
-                img->image = QImage(m_renderdata.cellW, m_renderdata.cellH, QImage::Format_ARGB6666_Premultiplied);
-                img->image.fill(Qt::transparent);
-                QPainter painter(&img->image);
-
+            const bool bold = cell.style & Cell::Bold;
+            const quint64 key = GlyphAtlas::key(id, bold);
+            AtlasGlyph glyph;
+            if (!s_atlas.find(key, &glyph)) {
+                glyph = s_atlas.insert(key, rect.size());
+                QPainter painter(&s_atlas.pages[glyph.page].image);
                 QFont font = m_renderdata.font;
-                if (cell.bold) font.setBold(true);
-                if (cell.underline) font.setUnderline(true);
+                if (bold) font.setBold(true);
                 painter.setFont(font);
-                painter.setPen(c);
-                painter.drawText(0, 0, m_renderdata.cellW, m_renderdata.cellH, 0, cell.str);
+                painter.setCompositionMode(QPainter::CompositionMode_Source);
+                painter.fillRect(glyph.rect, Qt::transparent);
+                painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
+                painter.setPen(Qt::white);
+                painter.drawText(glyph.rect, 0, QString::fromUcs4(ch, len));
                 painter.end();
+            }
+            queueGlyph(rect.topLeft(), glyph, crgb);
+        }
+        if (cell.style & Cell::Underline) {
+            queueFill(&s_batch.lines, QRect(rect.x(), rect.y() + m_renderdata.underlinePos, rect.width(), m_renderdata.lineWidth), crgb);
+        }
+    }
+}
 
-                img->container = hash;
-                img->color = crgb;
-                hash->insert(crgb, img);
-                if (s_cache.firstImg) {
-                    img->insert(s_cache.firstImg);
-                }
-                s_cache.firstImg = img;
-                if (!s_cache.lastImg) {
-                    s_cache.lastImg = img;
-                }
+// Move the pixels of the rows top to bottom up by num rows, or down if
+// negative, together with what m_cells knows about them.
+bool Screen::scrollRows(int top, int bottom, int num)
+{
+    const int n = qAbs(num);
+    const int rows = bottom + 1 - top - n;
+    const int src = num > 0 ? top + n : top;
+    QRect area(0, src * m_renderdata.cellH, m_columns * m_renderdata.cellW, rows * m_renderdata.cellH);
+    if (!m_terminal->scroll(area.translated(m_margins.left() + 1, m_margins.top()), -num * m_renderdata.cellH)) {
+        return false;
+    }
 
-                ++s_cache.numImages;
-                s_cache.size += img->image.byteCount() + sizeof(QImage) + sizeof(Image);
-            } else {
-                img = hash->value(crgb);
-                if (s_cache.lastImg == img) {
-                    s_cache.lastImg = img->next;
-                }
-                if (s_cache.firstImg != img) {
-                    img->insert(s_cache.firstImg);
-                }
-                if (!s_cache.lastImg) {
-                    s_cache.lastImg = img;
-                }
-                s_cache.firstImg = img;
-            }
+    Cell *first = m_cells + top * m_columns;
+    Cell *last = m_cells + (bottom + 1) * m_columns;
+    if (num > 0) {
+        std::rotate(first, first + n * m_columns, last);
+        first = last - n * m_columns;
+    } else {
+        std::rotate(first, last - n * m_columns, last);
+        last = first + n * m_columns;
+    }
+    // the uncovered rows still show their old pixels; make sure they are
+    // repainted
+    memset(first, 0, (last - first) * sizeof(Cell));
+    return true;
+}
 
-            m_painter->setCompositionMode(QPainter::CompositionMode_SourceOver);
-            m_painter->drawImage(posx * m_renderdata.cellW, posy * m_renderdata.cellH, img->image);
+// Paint what drawCell() queued, with the Rasterizer when it can draw on
+// painter's device, otherwise through painter.
+void Screen::flushBatch(QPainter *painter)
+{
+    QPoint offset;
+    QImage *image = Rasterizer::target(painter, &offset);
+    if (image) {
+        for (const Fill &fill: s_batch.fills) {
+            Rasterizer::fill(image, fill.rect.translated(offset), qPremultiply(fill.color));
+        }
+        for (const GlyphRun &run: s_batch.runs) {
+            QPoint pos = run.pos + offset;
+            for (int i = run.first; i < run.first + run.count; ++i) {
+                const AtlasGlyph &glyph = s_batch.glyphs.at(i);
+                Rasterizer::blendMask(image, pos, s_atlas.pages[glyph.page].image, glyph.rect, run.color);
+                pos.rx() += glyph.rect.width();
+            }
+        }
+        for (const Fill &line: s_batch.lines) {
+            Rasterizer::fill(image, line.rect.translated(offset), line.color);
+        }
+    } else {
+        painter->setCompositionMode(QPainter::CompositionMode_Source);
+        for (const Fill &fill: s_batch.fills) {
+            painter->fillRect(fill.rect, QColor::fromRgba(fill.color));
+        }
+        painter->setCompositionMode(QPainter::CompositionMode_SourceOver);
+        for (const GlyphRun &run: s_batch.runs) {
+            if (s_batch.tinted.width() < run.width || s_batch.tinted.height() < m_renderdata.cellH) {
+                s_batch.tinted = QImage(qMax(run.width, s_batch.tinted.width()), m_renderdata.cellH, QImage::Format_ARGB32_Premultiplied);
+            }
+            int x = 0;
+            for (int i = run.first; i < run.first + run.count; ++i) {
+                const AtlasGlyph &glyph = s_batch.glyphs.at(i);
+                tintMask(s_atlas.pages[glyph.page].image, glyph.rect, run.color, &s_batch.tinted, x);
+                x += glyph.rect.width();
+            }
+            painter->drawImage(run.pos, s_batch.tinted, QRect(0, 0, run.width, m_renderdata.cellH));
+        }
+        for (const Fill &line: s_batch.lines) {
+            painter->fillRect(line.rect, QColor::fromRgba(line.color));
         }
     }
 
-    return 0;
+    s_batch.fills.clear();
+    s_batch.runs.clear();
+    s_batch.glyphs.clear();
+    s_batch.lines.clear();
 }
 
 void Screen::resize(const QSize &s)
@@ -297,79 +481,171 @@ void Screen::resize(const QSize &s)
     initCells();
 }
 
-void Screen::render(QPainter *painter)
+// Work out what the next frame changes and queue the drawing for render().
+// Returns the area it is going to paint, in screen coordinates.
+QRegion Screen::prepare()
 {
     if (!m_cells) {
-        return;
+        return QRegion();
     }
 
-    m_painter = painter;
-    painter->setFont(m_renderdata.font);
+    const ScreenSnapshot &snapshot = m_vte->snapshot();
+    if (snapshot.columns != m_columns || snapshot.rows != m_rows) {
+        return QRegion();
+    }
+    if (snapshot.reset) {
+        m_forceRedraw = true;
+    }
 
-    const QRect &geom = geometry();
-    tsm_screen_attr attr;
-    tsm_vte_get_def_attr(m_vte->vte(), &attr);
+    // The application is in the middle of a synchronized update: keep showing
+    // the previous frame until it ends it, or until it took too long.
+    // m_forceRedraw survives, so a reset in a held snapshot is not lost.
+    if (snapshot.flags & TSM_SCREEN_SYNC_UPDATE) {
+        if (!m_syncStart.isValid()) {
+            m_syncStart.start();
+        }
+        qint64 elapsed = m_syncStart.elapsed();
+        if (elapsed < SyncUpdateTimeout) {
+            m_syncTimer->start(SyncUpdateTimeout - elapsed);
+            return QRegion();
+        }
+    } else if (m_syncStart.isValid()) {
+        m_syncStart.invalidate();
+        m_syncTimer->stop();
+    }
 
+    const tsm_screen_attr &attr = snapshot.defAttr;
     QColor bg(attr.br, attr.bg, attr.bb, m_backgroundAlpha);
-    float wm = geom.width() - m_screenSize.width();
-    float hm = geom.height() - m_screenSize.height();
-    painter->fillRect(QRect(QPoint(0, 0), QPoint(geom.width() - m_margins.right(), m_margins.top())), bg);
-    painter->fillRect(QRect(QPoint(0, 0), QPoint(m_margins.left(), geom.bottom())), bg);
-    painter->fillRect(QRect(QPoint(geom.right() - wm + m_margins.left(), 0), geom.bottomRight()), bg);
-    painter->fillRect(QRect(QPoint(0, geom.bottom() - hm + m_margins.top()), geom.bottomRight()), bg);
-
-    painter->translate(m_margins.left() + 1, m_margins.top());
+    if (m_forceRedraw || bg != m_marginColor) {
+        m_marginColor = bg;
+        m_marginsDirty = true;
+    }
 
-    unsigned int flags = tsm_screen_get_flags(m_vte->screen());
-    if (flags & TSM_SCREEN_HIDE_CURSOR) {
+    if (snapshot.flags & TSM_SCREEN_HIDE_CURSOR) {
         m_cursor = nullptr;
     } else {
-        const unsigned int x = tsm_screen_get_cursor_x(m_vte->screen());
-        const unsigned int y = tsm_screen_get_cursor_y(m_vte->screen());
+        const unsigned int x = qMin<unsigned int>(snapshot.cursorX, m_columns - 1);
+        const unsigned int y = qMin<unsigned int>(snapshot.cursorY, m_rows - 1);
         m_cursor = &m_cells[y * m_columns + x];
     }
 
-    m_renderdata.age =  tsm_screen_draw(m_vte->screen(),
-                                        [](tsm_screen *screen, uint32_t id,
-                                           const uint32_t *ch, size_t len,
-                                           unsigned int cwidth, unsigned int posx,
-                                           unsigned int posy,
-                                           const tsm_screen_attr *attr,
-                                           tsm_age_t age, void *data) -> int {
-                                               return static_cast<Screen *>(data)->drawCell(id, ch, len, cwidth, posx, posy, attr, age); }, this);
+    // If this snapshot directly follows the last one drawn, move the scrolled
+    // rows on screen and only draw the damaged cells. Otherwise go through all
+    // of them and let the ages and m_cells sort it out.
+    bool incremental = !m_forceRedraw && !snapshot.damageFull && snapshot.serial == m_serial + 1;
+    bool scrolled = false;
+    if (incremental && snapshot.scroll) {
+        incremental = scrolled = scrollRows(snapshot.scrollTop, snapshot.scrollBottom, snapshot.scroll);
+    }
 
-    m_painter = nullptr;
+    if (snapshot.attrGeneration != m_attrGeneration) {
+        m_attrColors.clear();
+        m_attrGeneration = snapshot.attrGeneration;
+    }
+
+    m_damage.clear();
+    const ScreenSnapshot::Cell *cells = snapshot.cells.constData();
+    if (incremental) {
+        for (int y = 0; y < m_rows; ++y) {
+            const tsm_screen_span &span = snapshot.damage.at(y);
+            if (span.start > span.end) {
+                continue;
+            }
+            // start at the head of a wide character
+            int x = span.start;
+            while (x > 0 && !cells[y * m_columns + x].width) {
+                --x;
+            }
+            for (; x <= (int)span.end; ++x) {
+                drawCell(snapshot, y * m_columns + x, x, y, 0);
+            }
+        }
+    } else if (m_forceRedraw || snapshot.serial != m_serial) {
+        int index = 0;
+        for (int y = 0; y < m_rows; ++y) {
+            for (int x = 0; x < m_columns; ++x, ++index) {
+                drawCell(snapshot, index, x, y, cells[index].age);
+            }
+        }
+    }
+    m_renderdata.age = snapshot.age;
+    m_serial = snapshot.serial;
     m_forceRedraw = false;
 
-    painter->translate(-m_margins.left() - 1, -m_margins.top());
+    QRegion region;
+    region.setRects(m_damage.constData(), m_damage.size());
+    if (scrolled) {
+        const int top = snapshot.scrollTop * m_renderdata.cellH;
+        const int bottom = (snapshot.scrollBottom + 1) * m_renderdata.cellH;
+        region += QRect(0, top, m_columns * m_renderdata.cellW, bottom - top);
+    }
+    region.translate(m_margins.left() + 1, m_margins.top());
+    if (m_marginsDirty) {
+        for (const QRect &r: marginRects()) {
+            region += r;
+        }
+    }
+    return region;
+}
 
-    while (s_cache.numImages > 1000) {
-        Image *img = s_cache.lastImg;
-        assert(img != 0);
-        assert(img->next != 0);
-        s_cache.lastImg = img->next;
-        img->remove();
-        img->container->remove(img->color);
+// The parts of the screen around the cells
+QVector<QRect> Screen::marginRects() const
+{
+    const QRect &geom = geometry();
+    float wm = geom.width() - m_screenSize.width();
+    float hm = geom.height() - m_screenSize.height();
+    return {
+        QRect(QPoint(0, 0), QPoint(geom.width() - m_margins.right(), m_margins.top())),
+        QRect(QPoint(0, 0), QPoint(m_margins.left(), geom.bottom())),
+        QRect(QPoint(geom.right() - wm + m_margins.left(), 0), geom.bottomRight()),
+        QRect(QPoint(0, geom.bottom() - hm + m_margins.top()), geom.bottomRight()),
+    };
+}
 
-        --s_cache.numImages;
-        s_cache.size -= (img->image.byteCount() + sizeof(QImage) + sizeof(Image));
-        delete img;
+// Paint what prepare() queued.
+void Screen::render(QPainter *painter)
+{
+    if (m_marginsDirty) {
+        m_marginsDirty = false;
+        painter->setCompositionMode(QPainter::CompositionMode_Source);
+        for (const QRect &r: marginRects()) {
+            painter->fillRect(r, m_marginColor);
+        }
     }
 
-    Debugger::printCache(s_cache.numImages, s_cache.size);
+    painter->translate(m_margins.left() + 1, m_margins.top());
+    flushBatch(painter);
+    painter->translate(-m_margins.left() - 1, -m_margins.top());
+
+    ++s_atlas.frame;
+    Debugger::printCache(s_atlas.glyphs.size(), s_atlas.size(), s_atlas.hits, s_atlas.misses);
+    s_atlas.hits = 0;
+    s_atlas.misses = 0;
 }
 
 void Screen::update()
 {
-    if (m_terminal->currentScreen() == this) {
+    if (isVisible()) {
         m_terminal->update();
     }
 }
 
+bool Screen::isVisible() const
+{
+    return m_terminal->currentScreen() == this && m_terminal->isExposed();
+}
+
+void Screen::frameRendered()
+{
+    m_vte->frameRendered();
+}
+
 QByteArray Screen::copy()
 {
     char *out;
+    m_vte->mutex()->lock();
     int len = tsm_screen_selection_copy(m_vte->screen(), &out);
+    m_vte->mutex()->unlock();
     if (len <= 0) {
         return QByteArray();
     }
@@ -418,15 +694,15 @@ void Screen::keyPressEvent(QKeyEvent *ev)
 void Screen::wheelEvent(QWheelEvent *ev)
 {
     m_accumDelta += ev->angleDelta().y() / 40.;
-    if (m_accumDelta >= 1) {
-        int delta = floor(m_accumDelta);
-        tsm_screen_sb_up(m_vte->screen(), delta);
-        m_accumDelta -= delta;
-    } else if (m_accumDelta <= -1) {
-        int delta = ceil(m_accumDelta);
-        tsm_screen_sb_down(m_vte->screen(), -delta);
+    const int delta = m_accumDelta >= 1 ? floor(m_accumDelta) : m_accumDelta <= -1 ? ceil(m_accumDelta) : 0;
+    if (delta) {
+        m_vte->mutex()->lock();
+        const int pos = tsm_screen_sb_get_pos(m_vte->screen());
+        tsm_screen_sb_set_pos(m_vte->screen(), qMax(0, pos - delta));
+        m_vte->mutex()->unlock();
         m_accumDelta -= delta;
     }
+    m_vte->invalidateSnapshot();
     update();
     ev->accept();
 }
@@ -444,19 +720,25 @@ QPoint Screen::gridPosFromGlobal(const QPointF &pos)
 void Screen::mousePressEvent(QMouseEvent *ev)
 {
     m_selectionStart = gridPosFromGlobal(ev->pos());
+    m_vte->mutex()->lock();
     tsm_screen_selection_reset(m_vte->screen());
+    m_vte->mutex()->unlock();
+    m_vte->invalidateSnapshot();
     ev->accept();
     update();
 }
 
 void Screen::mouseMoveEvent(QMouseEvent *ev)
 {
+    QPoint p = gridPosFromGlobal(ev->pos());
+    m_vte->mutex()->lock();
     if (m_selectionStart.x() >= 0) {
         tsm_screen_selection_start(m_vte->screen(), m_selectionStart.x(), m_selectionStart.y());
         m_selectionStart.setX(-1);
     }
-    QPoint p = gridPosFromGlobal(ev->pos());
     tsm_screen_selection_target(m_vte->screen(), p.x(), p.y());
+    m_vte->mutex()->unlock();
+    m_vte->invalidateSnapshot();
     update();
 }
 
@@ -502,8 +784,11 @@ void Screen::mouseDoubleClickEvent(QMouseEvent *ev)
                 break;
         }
 
+        m_vte->mutex()->lock();
         tsm_screen_selection_start(m_vte->screen(), left + 1, p.y());
         tsm_screen_selection_target(m_vte->screen(), right - 1, p.y());
+        m_vte->mutex()->unlock();
+        m_vte->invalidateSnapshot();
     }
 }
 
@@ -528,6 +813,7 @@ void Screen::forceRedraw()
 
 char Screen::getCharacter(int x, int y)
 {
+    QMutexLocker locker(m_vte->mutex());
     tsm_screen_selection_start(m_vte->screen(), x, y);
     tsm_screen_selection_target(m_vte->screen(), x, y);
     char c, *d;
@@ -25,6 +25,10 @@
 #include <QMargins>
 #include <QSize>
 #include <QRect>
+#include <QRegion>
+#include <QVector>
+#include <QColor>
+#include <QElapsedTimer>
 
 #include <libtsm.h>
 
@@ -32,12 +36,14 @@ class QPainter;
 class QKeyEvent;
 class QWheelEvent;
 class QMouseEvent;
+class QTimer;
 
 struct tsm_screen;
 
 class Terminal;
 class VTE;
 struct Cell;
+struct ScreenSnapshot;
 
 class Screen : public QObject
 {
@@ -53,6 +59,9 @@ public:
     void close();
     void resize(const QSize &size);
     void update();
+    bool isVisible() const;
+    void frameRendered();
+    QRegion prepare();
     void render(QPainter *painter);
     void forceRedraw();
 
@@ -67,8 +76,20 @@ public:
     void focusOut();
 
 private:
+    // The colors and style bits of a cell drawn with some attributes
+    struct AttrColors {
+        QRgb fg;
+        QRgb bg;
+        uint32_t style;
+        bool valid;
+    };
+
     inline QRect geometry() const { return m_geometry; }
-    int drawCell(uint32_t id, const uint32_t *ch, size_t len, uint32_t width, unsigned int posx, unsigned int posy, const tsm_screen_attr *attr, tsm_age_t age);
+    const AttrColors &attrColors(const ScreenSnapshot &snapshot, uint16_t attr, bool inverse);
+    void drawCell(const ScreenSnapshot &snapshot, int index, unsigned int posx, unsigned int posy, tsm_age_t age);
+    bool scrollRows(int top, int bottom, int num);
+    void flushBatch(QPainter *painter);
+    QVector<QRect> marginRects() const;
     QPoint gridPosFromGlobal(const QPointF &pos);
     char getCharacter(int x, int y);
 
@@ -81,10 +102,11 @@ private:
     Cell *m_cells;
     Cell *m_cursor;
 
-    QPainter *m_painter;
     struct {
         int cellW;
         int cellH;
+        int underlinePos;
+        int lineWidth;
         QFont font;
         tsm_age_t age;
     } m_renderdata;
@@ -98,6 +120,15 @@ private:
     QPoint m_selectionStart;
     int m_backgroundAlpha;
     double m_accumDelta;
+    unsigned int m_serial;
+    QVector<QRect> m_damage;
+    bool m_marginsDirty;
+    QColor m_marginColor;
+    QElapsedTimer m_syncStart;
+    QTimer *m_syncTimer;
+    // by attribute id, plain and inverted, for the ids of m_attrGeneration
+    QVector<AttrColors> m_attrColors;
+    unsigned int m_attrGeneration;
 };
 
 #endif
@@ -25,6 +25,7 @@
 #include <QMouseEvent>
 #include <QClipboard>
 #include <QMimeData>
+#include <QElapsedTimer>
 
 #include "terminal.h"
 #include "vte.h"
@@ -35,6 +36,8 @@ static const QStringList ACCEPTED_MIMETYPES = { "text/plain;charset=utf-8", "tex
 Terminal::Terminal(QWindow *parent)
         : QWindow(parent)
         , m_updatePending(false)
+        , m_frames(0)
+        , m_skippedStates(0)
         , m_borders(2, 0, 2, 20)
         , m_bordersDirty(true)
         , m_backingStore(nullptr)
@@ -198,6 +201,7 @@ bool Terminal::event(QEvent *event)
 void Terminal::exposeEvent(QExposeEvent *event)
 {
     Q_UNUSED(event);
+    m_bordersDirty = true;
     renderNow();
 }
 
@@ -231,18 +235,40 @@ void Terminal::setScreenSize(const QSize &s)
     resize(s + QSize(m_borders.left() + m_borders.right(), m_borders.top() + m_borders.bottom()));
 }
 
+// Rendering is paced by the display: requestUpdate() delivers the
+// UpdateRequest with the next frame (a frame callback on Wayland). Every state
+// change that arrives while a frame is pending is folded into that frame.
 void Terminal::update()
 {
     if (!m_updatePending) {
         m_updatePending = true;
-        QCoreApplication::postEvent(this, new QEvent(QEvent::UpdateRequest));
+        requestUpdate();
+    } else {
+        ++m_skippedStates;
+    }
+}
+
+// Move the pixels in area, relative to the current screen, by dy. Not every
+// backing store can do that, in which case the caller has to repaint.
+bool Terminal::scroll(const QRect &area, int dy)
+{
+    return m_backingStore && m_backingStore->scroll(QRegion(area.translated(m_borders.left(), m_borders.top())), 0, dy);
+}
+
+void Terminal::frameRendered()
+{
+    for (Screen *screen: m_screens) {
+        screen->frameRendered();
     }
 }
 
 void Terminal::renderNow()
 {
-    if (!isExposed())
+    if (!isExposed()) {
+        // nothing is shown, don't keep the screens waiting for a frame
+        frameRendered();
         return;
+    }
 
     m_updatePending = false;
 
@@ -251,12 +277,26 @@ void Terminal::renderNow()
         m_backingStore->resize(size());
     }
 
-    m_backingStore->beginPaint(geometry());
+    // Only paint and flush what changed, unless the borders need to be drawn
+    // again, which is when everything does.
+    if (m_bordersDirty) {
+        currentScreen()->forceRedraw();
+    }
+    QRegion damage = currentScreen()->prepare().translated(m_borders.left(), m_borders.top());
+    if (m_bordersDirty) {
+        damage = QRegion(0, 0, width(), height());
+    }
 
-    render();
+    if (!damage.isEmpty()) {
+        m_backingStore->beginPaint(damage);
+        render();
+        m_backingStore->endPaint();
+        m_backingStore->flush(damage, this);
+    }
 
-    m_backingStore->endPaint();
-    m_backingStore->flush(QRect(0, 0, width(),height()), this);
+    ++m_frames;
+    Debugger::printFrames(m_frames, m_skippedStates);
+    frameRendered();
 }
 
 void Terminal::closeScreen(Screen *screen)
@@ -366,21 +406,60 @@ void Terminal::moveScreen(int cur, int d)
 // trick to put a newline at app close
 static struct A { ~A() { fprintf(stderr, "\n"); } } a;
 
+// The status line is printed at most every s_statusInterval ms, so that the
+// frames being counted do not each write to stderr.
+static const int s_statusInterval = 1000;
+static QElapsedTimer s_statusTimer;
+
 bool Debugger::printedCache = false;
 int Debugger::cacheNum = 0;
 int Debugger::cacheSize = 0;
+int Debugger::cacheHitRate = 100;
+int Debugger::frameNum = 0;
+int Debugger::skippedNum = 0;
+bool Debugger::catchUp = false;
+qint64 Debugger::catchUpBytes = 0;
 
 void Debugger::print(const char *msg)
 {
     fprintf(stderr, "\033[2K%s\n",msg);
     printedCache = false;
-    printCache(cacheNum, cacheSize);
+    printStatus(true);
 }
 
-void Debugger::printCache(int num, int size)
+void Debugger::printCache(int num, int size, int hits, int misses)
 {
-    fprintf(stderr, "\033[2KCache: %d images taking approximately %gkB\r", num, size / 1000.f);
-    printedCache = true;
     cacheNum = num;
     cacheSize = size;
+    if (hits + misses) {
+        cacheHitRate = hits * 100 / (hits + misses);
+    }
+    printStatus(false);
+}
+
+void Debugger::printFrames(int frames, int skipped)
+{
+    frameNum = frames;
+    skippedNum = skipped;
+    printStatus(false);
+}
+
+void Debugger::printCatchUp(bool active, qint64 bytes)
+{
+    const bool changed = catchUp != active;
+    catchUp = active;
+    catchUpBytes = bytes;
+    printStatus(changed);
+}
+
+void Debugger::printStatus(bool force)
+{
+    if (!force && s_statusTimer.isValid() && s_statusTimer.elapsed() < s_statusInterval) {
+        return;
+    }
+    s_statusTimer.start();
+
+    fprintf(stderr, "\033[2KCache: %d images taking approximately %gkB, %d%% hits, %d frames, %d states skipped%s%gMB caught up\r",
+            cacheNum, cacheSize / 1000.f, cacheHitRate, frameNum, skippedNum, catchUp ? ", CATCHING UP, " : ", ", catchUpBytes / 1000000.f);
+    printedCache = true;
 }
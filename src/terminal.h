@@ -37,6 +37,7 @@ public:
     void render();
     void renderNow();
     void update();
+    bool scroll(const QRect &area, int dy);
     void closeScreen(Screen *screen);
 
     inline Screen *currentScreen() const { return m_screens.at(m_currentScreen); }
@@ -61,9 +62,13 @@ private:
     void paste();
     void moveScreen(int screen, int d);
 
+    void frameRendered();
+
     QList<Screen *> m_screens;
     int m_currentScreen;
     bool m_updatePending;
+    int m_frames;
+    int m_skippedStates;
     QMargins m_borders;
     bool m_bordersDirty;
     QBackingStore *m_backingStore;
@@ -74,12 +79,21 @@ class Debugger
 {
 public:
     static void print(const char *msg);
-    static void printCache(int num, int size);
+    static void printCache(int num, int size, int hits, int misses);
+    static void printFrames(int frames, int skipped);
+    static void printCatchUp(bool active, qint64 bytes);
 
 private:
+    static void printStatus(bool force);
+
     static bool printedCache;
     static int cacheNum;
     static int cacheSize;
+    static int cacheHitRate;
+    static int frameNum;
+    static int skippedNum;
+    static bool catchUp;
+    static qint64 catchUpBytes;
 };
 
 #endif // TERMINAL_H
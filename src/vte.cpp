@@ -22,10 +22,14 @@
 #include <pty.h>
 #include <sys/ioctl.h>
 #include <errno.h>
+#include <algorithm>
 #include <xkbcommon/xkbcommon-keysyms.h>
 
 #include <QSocketNotifier>
 #include <QFile>
+#include <QThread>
+#include <QElapsedTimer>
+#include <QTimer>
 #include <QDebug>
 
 #include "vte.h"
@@ -83,10 +87,65 @@ static uint8_t color_palette_solarized_white[TSM_COLOR_NUM][3] = {
 	[TSM_COLOR_BACKGROUND]    = {  44,  44,  44 }, /* light grey */
 };
 
+// In threaded mode the pty is read and parsed on a worker thread per VTE. The
+// input is fed to libtsm in slices of this size, so that the GUI thread never
+// has to wait long for the lock.
+static bool s_threaded = false;
+static const int s_sliceSize = 4096;
+
+// Without a worker, at most s_frameBudget bytes are parsed per rendered frame.
+// If no frame shows up within s_frameTimeout ms we continue anyway.
+static const int s_readSize = 64 * 1024;
+static const int s_frameBudget = 1024 * 1024;
+static const int s_frameTimeout = 100;
+
+// Lines of scroll-back. All but the newest s_scrollbackHot are compressed.
+// With s_diskScrollback, older lines go to a file instead of being dropped.
+static const unsigned s_scrollbackMax = 1000000;
+static const unsigned s_scrollbackHot = 10000;
+static bool s_diskScrollback = false;
+
+// Catch-up mode: with more than s_backlogThreshold bytes waiting on the pty we
+// parse in slices of s_catchUpSlice ms and render only every
+// s_catchUpInterval ms, until the backlog is drained.
+static const int s_backlogThreshold = 16 * 1024;
+static const int s_catchUpSlice = 20;
+static const int s_catchUpInterval = 250;
+
+// After the width changed the scroll-back is rewrapped while idle, at most
+// s_reflowSlice lines at a time, newest first.
+static const unsigned s_reflowSlice = 2000;
+
+void VTE::setThreaded(bool threaded)
+{
+    s_threaded = threaded;
+}
+
+void VTE::setDiskScrollback(bool enabled)
+{
+    s_diskScrollback = enabled;
+}
+
 VTE::VTE(Screen *screen)
    : QObject(screen)
+   , m_notifier(nullptr)
    , m_termScreen(screen)
+   , m_thread(nullptr)
+   , m_reader(nullptr)
+   , m_back(&m_snapshots[0])
+   , m_ready(&m_snapshots[1])
+   , m_front(&m_snapshots[2])
+   , m_readyFresh(false)
+   , m_pending(false)
+   , m_generation(1)
+   , m_frameBytes(0)
+   , m_frameTimer(nullptr)
+   , m_reflowTimer(nullptr)
+   , m_catchUp(false)
+   , m_catchUpBytes(0)
 {
+    m_readBuffer.resize(s_readSize);
+
     if (tsm_screen_new(&m_screen, log, 0) < 0) {
         tsm_screen_unref(m_screen);
         qFatal("Failed to create tsm screen");
@@ -99,7 +158,11 @@ VTE::VTE(Screen *screen)
         qFatal("Failed to create tsm vte");
     }
     tsm_vte_set_palette_colors(m_vte, color_palette_solarized_white, TSM_COLOR_NUM);
-    tsm_screen_set_max_sb(m_screen, 10000);
+    tsm_screen_set_max_sb(m_screen, s_scrollbackMax);
+    tsm_screen_set_sb_compress(m_screen, s_scrollbackHot);
+    if (s_diskScrollback && tsm_screen_set_sb_archive(m_screen, true) < 0) {
+        fprintf(stderr, "cannot keep the scroll-back on disk\n");
+    }
 
     pid_t pid = forkpty(&m_master, NULL, NULL, NULL);
     if (pid == 0) {
@@ -117,18 +180,57 @@ VTE::VTE(Screen *screen)
     }
 
     fcntl(m_master, F_SETFL, O_NONBLOCK);
-    m_notifier = new QSocketNotifier(m_master, QSocketNotifier::Read, this);
-    connect(m_notifier, &QSocketNotifier::activated, this, &VTE::onSocketActivated);
+
+    // these are queued to the GUI thread when emitted by the worker
+    connect(this, &VTE::updated, this, [this]() { m_termScreen->update(); });
+    connect(this, &VTE::finished, this, [this]() {
+        Debugger::print("No data read. Exiting.");
+        m_termScreen->close();
+    });
+    connect(this, &VTE::catchUpChanged, this, [](bool active, qint64 bytes) { Debugger::printCatchUp(active, bytes); });
+
+    m_reflowTimer = new QTimer(this);
+    m_reflowTimer->setInterval(0);
+    connect(m_reflowTimer, &QTimer::timeout, this, &VTE::reflowScrollback);
+
+    if (!s_threaded) {
+        m_notifier = new QSocketNotifier(m_master, QSocketNotifier::Read, this);
+        connect(m_notifier, &QSocketNotifier::activated, this, &VTE::onSocketActivated);
+
+        m_frameTimer = new QTimer(this);
+        m_frameTimer->setSingleShot(true);
+        m_frameTimer->setInterval(s_frameTimeout);
+        connect(m_frameTimer, &QTimer::timeout, this, &VTE::frameRendered);
+        return;
+    }
+
+    m_thread = new QThread(this);
+    m_reader = new QObject;
+    m_reader->moveToThread(m_thread);
+    connect(m_thread, &QThread::started, m_reader, [this]() {
+        m_notifier = new QSocketNotifier(m_master, QSocketNotifier::Read, m_reader);
+        connect(m_notifier, &QSocketNotifier::activated, m_reader, [this](int socket) { onSocketActivated(socket); });
+    });
+    connect(m_thread, &QThread::finished, m_reader, &QObject::deleteLater);
+    connect(this, &VTE::snapshotWanted, m_reader, [this]() { publishSnapshot(); });
+    m_thread->start();
 }
 
 VTE::~VTE()
 {
+    if (m_thread) {
+        m_thread->quit();
+        m_thread->wait();
+    }
     tsm_vte_unref(m_vte);
     tsm_screen_unref(m_screen);
 }
 
 void VTE::resize(int rows, int cols)
 {
+    invalidateSnapshot();
+    m_reflowTimer->start();
+
     struct winsize ws;
     memset(&ws, 0, sizeof(ws));
     ws.ws_col = cols;
@@ -136,6 +238,32 @@ void VTE::resize(int rows, int cols)
     ioctl(m_master, TIOCSWINSZ, &ws);
 }
 
+void VTE::reflowScrollback()
+{
+    bool shown;
+    {
+        QMutexLocker locker(&m_lock);
+        // The screen only damages itself if the reflowed lines are scrolled
+        // into view. If it already was damaged, whoever did that publishes it.
+        tsm_screen_damage damage;
+        tsm_screen_get_damage(m_screen, &damage);
+        const bool wasDamaged = damage.full;
+
+        if (!tsm_screen_sb_reflow(m_screen, s_reflowSlice)) {
+            m_reflowTimer->stop();
+        }
+
+        tsm_screen_get_damage(m_screen, &damage);
+        shown = !wasDamaged && damage.full;
+        if (shown) {
+            ++m_generation;
+        }
+    }
+    if (shown) {
+        emit updated();
+    }
+}
+
 void VTE::paste(const QByteArray &data)
 {
     QByteArray d = data;
@@ -150,17 +278,258 @@ void VTE::vte_event(const char *u8, size_t len) {
 }
 
 void VTE::onSocketActivated(int socket) {
-    QFile file;
-    file.open(socket, QIODevice::ReadOnly);
-    QByteArray data = file.readAll();
-    if (data.length() == 0) {
-        Debugger::print("No data read. Exiting.");
-        m_termScreen->close();
+    QElapsedTimer slice;
+    slice.start();
+
+    const bool wasCatchingUp = m_catchUp;
+    int total = 0;
+    for (;;) {
+        int len = read(socket, m_readBuffer.data(), m_readBuffer.size());
+        if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+            setCatchUp(false);
+            break;
+        }
+        if (len <= 0) {
+            m_notifier->setEnabled(false);
+            emit finished();
+            return;
+        }
+
+        const char *data = m_readBuffer.constData();
+        for (int i = 0; i < len; i += s_sliceSize) {
+            QMutexLocker locker(&m_lock);
+            tsm_vte_input(m_vte, data + i, qMin(s_sliceSize, len - i));
+        }
+        total += len;
+
+        // A full read with a large backlog behind it means the application
+        // writes faster than we can show it. Stay in catch-up mode until
+        // a read does not fill the buffer anymore.
+        int backlog = 0;
+        if (len == m_readBuffer.size()) {
+            ioctl(socket, FIONREAD, &backlog);
+        }
+        setCatchUp(backlog >= s_backlogThreshold || (m_catchUp && len == m_readBuffer.size()));
+        if (!m_catchUp || slice.elapsed() >= s_catchUpSlice) {
+            break;
+        }
+    }
+
+    // after catching up the final state must be shown even if nothing new came
+    if (!total && !(wasCatchingUp && !m_catchUp)) {
         return;
     }
-    tsm_vte_input(m_vte, data.constData(), data.length());
-    m_termScreen->update();
 
+    if (m_catchUp) {
+        m_catchUpBytes += total;
+        if (m_catchUpTimer.elapsed() < s_catchUpInterval) {
+            return;
+        }
+        m_catchUpTimer.restart();
+        emit catchUpChanged(true, m_catchUpBytes);
+    }
+
+    if (m_thread) {
+        publishSnapshot();
+        return;
+    }
+
+    // Once the frame budget is used up stop reading until the pending frame
+    // was rendered, so that the GUI thread gets to draw it.
+    m_frameBytes += total;
+    if (!m_catchUp && m_frameBytes >= s_frameBudget && m_termScreen->isVisible()) {
+        m_notifier->setEnabled(false);
+        m_frameTimer->start();
+    }
+    emit updated();
+}
+
+void VTE::setCatchUp(bool catchUp)
+{
+    if (m_catchUp == catchUp) {
+        return;
+    }
+
+    m_catchUp = catchUp;
+    if (catchUp) {
+        m_catchUpBytes = 0;
+        m_catchUpTimer.start();
+    }
+    emit catchUpChanged(catchUp, m_catchUpBytes);
+}
+
+void VTE::frameRendered()
+{
+    m_frameBytes = 0;
+    if (!m_thread && !m_notifier->isEnabled()) {
+        m_frameTimer->stop();
+        m_notifier->setEnabled(true);
+    }
+}
+
+static int drawSnapshotCell(tsm_screen *screen, uint32_t id, const uint32_t *ch, size_t len,
+                            unsigned int cwidth, unsigned int posx, unsigned int posy,
+                            const tsm_screen_attr *attr, tsm_age_t age, void *data)
+{
+    ScreenSnapshot *s = static_cast<ScreenSnapshot *>(data);
+    ScreenSnapshot::Cell &cell = s->cells[posy * s->columns + posx];
+    const unsigned int attrId = tsm_screen_get_draw_attr_id(screen);
+    cell.id = id;
+    cell.width = cwidth;
+    cell.ch = s->chars.size();
+    cell.len = len;
+    cell.attr = attrId;
+    cell.inverse = attr->inverse;
+    if (attrId >= (unsigned int)s->attrs.size()) {
+        s->attrs.resize(attrId + 1);
+    }
+    s->attrs[attrId] = *attr;
+    // age 0 only comes with a reset, which redraws everything anyway. Don't
+    // keep it, or the cell would be redrawn in every frame after that.
+    cell.age = age ? age : 1;
+    for (size_t i = 0; i < len; ++i) {
+        s->chars.append(ch[i]);
+    }
+    return 0;
+}
+
+// Must be called with m_lock locked.
+void VTE::takeSnapshot(ScreenSnapshot *snapshot)
+{
+    ScreenSnapshot &s = m_shadow;
+
+    // drop the vectors the old snapshot shares with the shadow, or the
+    // first change below would copy them
+    *snapshot = ScreenSnapshot();
+    const int columns = tsm_screen_get_width(m_screen);
+    const int rows = tsm_screen_get_height(m_screen);
+
+    // damaged cells append their characters, so start over once the unused
+    // ones pile up. The attribute ids of the cells that are kept are only
+    // valid until the screen renumbers them.
+    const unsigned int attrGeneration = tsm_screen_get_attr_generation(m_screen);
+    bool full = columns != s.columns || rows != s.rows || s.chars.size() > 2 * s.cells.size() + 1024 ||
+                attrGeneration != s.attrGeneration;
+
+    s.columns = columns;
+    s.rows = rows;
+    s.cursorX = tsm_screen_get_cursor_x(m_screen);
+    s.cursorY = tsm_screen_get_cursor_y(m_screen);
+    s.flags = tsm_screen_get_flags(m_screen);
+    s.generation = m_generation;
+    s.attrGeneration = attrGeneration;
+    tsm_vte_get_def_attr(m_vte, &s.defAttr);
+
+    tsm_screen_damage damage;
+    tsm_screen_get_damage(m_screen, &damage);
+    ++s.serial;
+    s.damageFull = full || damage.full;
+    s.scroll = s.damageFull ? 0 : damage.scroll;
+    s.scrollTop = damage.scroll_top;
+    s.scrollBottom = damage.scroll_bottom;
+
+    if (s.damageFull) {
+        s.cells.resize(columns * rows);
+        s.chars.resize(0);
+        s.attrs.resize(0);
+        s.damage.clear();
+        s.age = tsm_screen_draw(m_screen, drawSnapshotCell, &s);
+    } else {
+        s.damage.resize(rows);
+        std::copy(damage.spans, damage.spans + rows, s.damage.begin());
+
+        // move the cells like the renderer moves its pixels
+        int moved = 0;
+        int movedStart = 0;
+        if (s.scroll) {
+            ScreenSnapshot::Cell *cells = s.cells.data();
+            const int n = qAbs(s.scroll);
+            const int top = s.scrollTop * columns;
+            moved = (s.scrollBottom + 1 - s.scrollTop - n) * columns;
+            movedStart = top;
+            if (s.scroll > 0) {
+                std::copy(cells + top + n * columns, cells + top + n * columns + moved, cells + top);
+            } else {
+                movedStart += n * columns;
+                std::copy_backward(cells + top, cells + top + moved, cells + movedStart + moved);
+            }
+        }
+        s.age = tsm_screen_draw_damage(m_screen, true, drawSnapshotCell, &s);
+
+        // A renderer that moved its pixels along has the moved cells already.
+        // One that missed the move has to draw them once, so give them the
+        // age of this snapshot. Age 0 would redraw them in every frame.
+        ScreenSnapshot::Cell *dst = s.cells.data() + movedStart;
+        for (int i = 0; i < moved; ++i) {
+            dst[i].age = s.age ? s.age : 1;
+        }
+    }
+    // an age of 0 means everything has to be redrawn
+    s.reset = !s.age;
+
+    *snapshot = s;
+}
+
+// Called on the worker thread. If the GUI did not pick up the last snapshot yet
+// we only remember that there is a newer state and publish it once it asks.
+void VTE::publishSnapshot()
+{
+    {
+        QMutexLocker locker(&m_snapshotLock);
+        if (m_readyFresh) {
+            m_pending = true;
+            return;
+        }
+    }
+
+    {
+        QMutexLocker locker(&m_lock);
+        takeSnapshot(m_back);
+    }
+
+    {
+        QMutexLocker locker(&m_snapshotLock);
+        qSwap(m_back, m_ready);
+        m_readyFresh = true;
+        m_pending = false;
+    }
+    emit updated();
+}
+
+const ScreenSnapshot &VTE::snapshot()
+{
+    bool taken = false;
+
+    if (m_thread) {
+        QMutexLocker locker(&m_snapshotLock);
+        if (m_readyFresh) {
+            qSwap(m_ready, m_front);
+            m_readyFresh = false;
+            taken = true;
+            if (m_pending) {
+                emit snapshotWanted();
+            }
+        }
+    }
+
+    // Without a worker, or if the GUI changed the screen itself (scrolling,
+    // selection, resizing) after the snapshot was taken, take a new one here.
+    if (!m_thread || m_front->generation != m_generation) {
+        bool reset = taken && m_front->reset;
+
+        QMutexLocker locker(&m_lock);
+        takeSnapshot(m_front);
+        m_front->reset |= reset;
+    }
+
+    return *m_front;
+}
+
+// Must be called by the GUI thread after modifying the screen.
+void VTE::invalidateSnapshot()
+{
+    QMutexLocker locker(&m_lock);
+    ++m_generation;
 }
 
 struct {
@@ -197,12 +566,18 @@ void VTE::keyPress(int key, Qt::KeyboardModifiers modifiers, const QString &stri
 {
     if (modifiers & Qt::ShiftModifier) {
         if (key == Qt::Key_PageUp) {
+            m_lock.lock();
             tsm_screen_sb_page_up(m_screen, 1);
+            m_lock.unlock();
+            invalidateSnapshot();
             m_termScreen->update();
             return;
         }
         if (key == Qt::Key_PageDown) {
+            m_lock.lock();
             tsm_screen_sb_page_down(m_screen, 1);
+            m_lock.unlock();
+            invalidateSnapshot();
             m_termScreen->update();
             return;
         }
@@ -221,8 +596,11 @@ void VTE::keyPress(int key, Qt::KeyboardModifiers modifiers, const QString &stri
         ucs4 = TSM_VTE_INVALID;
     }
 
+    QMutexLocker locker(&m_lock);
     if (tsm_vte_handle_keyboard(m_vte, findSym(key), c.toLatin1(), mods, ucs4)) {
         tsm_screen_sb_reset(m_screen);
+        locker.unlock();
+        invalidateSnapshot();
     }
 }
 
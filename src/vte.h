@@ -21,12 +21,60 @@
 #define VTE_H
 
 #include <QObject>
+#include <QMutex>
+#include <QElapsedTimer>
+#include <QVector>
 #include <libtsm.h>
 
 class QSocketNotifier;
+class QThread;
+class QTimer;
 
 class Screen;
 
+// A copy of everything Screen::prepare() needs from the tsm_screen, so that
+// painting does not need to hold the VTE lock.
+struct ScreenSnapshot
+{
+    struct Cell {
+        uint32_t id;
+        uint32_t width;
+        int ch;
+        int len;
+        uint16_t attr;
+        bool inverse;
+        tsm_age_t age;
+    };
+
+    int columns = 0;
+    int rows = 0;
+    unsigned int cursorX = 0;
+    unsigned int cursorY = 0;
+    unsigned int flags = 0;
+    tsm_age_t age = 0;
+    bool reset = false;
+    unsigned int generation = 0;
+    tsm_screen_attr defAttr;
+    QVector<Cell> cells;
+    QVector<uint32_t> chars;
+
+    // The attributes of the cells by their id in the tsm_screen's attribute
+    // table. Their inverse flag means nothing, the cells have their own. The
+    // ids change with attrGeneration.
+    QVector<tsm_screen_attr> attrs;
+    unsigned int attrGeneration = 0;
+
+    // What changed since the snapshot with the previous serial. Unless
+    // damageFull is set, rows scrollTop to scrollBottom moved up by scroll
+    // rows (down if negative) and then the damage spans were redrawn.
+    unsigned int serial = 0;
+    bool damageFull = true;
+    int scroll = 0;
+    unsigned int scrollTop = 0;
+    unsigned int scrollBottom = 0;
+    QVector<tsm_screen_span> damage;
+};
+
 class VTE : public QObject
 {
     Q_OBJECT
@@ -34,27 +82,75 @@ public:
     explicit VTE(Screen *screen);
     ~VTE();
 
+    static void setThreaded(bool threaded);
+    static void setDiskScrollback(bool enabled);
+
     void write(const QChar &ch);
     void resize(int rows, int cols);
     void paste(const QByteArray &data);
 
+    // m_vte and m_screen may only be touched with mutex() locked
     inline tsm_vte *vte() const { return m_vte; }
     inline tsm_screen *screen() const { return m_screen; }
+    inline QMutex *mutex() { return &m_lock; }
+
+    const ScreenSnapshot &snapshot();
+    void invalidateSnapshot();
+    void frameRendered();
 
 public:
     void keyPress(int key, Qt::KeyboardModifiers mods, const QString &string);
 
+signals:
+    void updated();
+    void finished();
+    void snapshotWanted();
+    void catchUpChanged(bool active, qint64 bytes);
+
 private slots:
     void onSocketActivated(int);
+    void reflowScrollback();
 
 private:
     void vte_event(const char *u8, size_t len);
+    void setCatchUp(bool catchUp);
+    void takeSnapshot(ScreenSnapshot *snapshot);
+    void publishSnapshot();
 
     tsm_screen *m_screen;
     tsm_vte *m_vte;
     int m_master;
     QSocketNotifier *m_notifier;
     Screen *m_termScreen;
+    QMutex m_lock;
+    // copy of the whole screen, only updated where libtsm reports damage.
+    // Snapshots share its vectors. Before it is updated, the snapshot taken
+    // next lets go of them, so without a worker nothing is copied. With one,
+    // the vectors are still shared with the last published snapshot, and
+    // are copied once per published snapshot.
+    ScreenSnapshot m_shadow;
+
+    // threaded mode: the worker parses into m_screen and fills m_back, which
+    // is then swapped with m_ready. The GUI thread takes m_ready as m_front.
+    QThread *m_thread;
+    QObject *m_reader;
+    QMutex m_snapshotLock;
+    ScreenSnapshot m_snapshots[3];
+    ScreenSnapshot *m_back;
+    ScreenSnapshot *m_ready;
+    ScreenSnapshot *m_front;
+    bool m_readyFresh;
+    bool m_pending;
+    unsigned int m_generation;
+
+    QByteArray m_readBuffer;
+    int m_frameBytes;
+    QTimer *m_frameTimer;
+    QTimer *m_reflowTimer;
+
+    bool m_catchUp;
+    qint64 m_catchUpBytes;
+    QElapsedTimer m_catchUpTimer;
 };
 
 #endif // VTE_H